@@ -0,0 +1,106 @@
+/* Cache of the AP last connected to
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "ap_cache.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "nvs.h"
+#include "mbedtls/md.h"
+#include "mbedtls/pkcs5.h"
+
+#include "uart_proto.h"
+
+#define NVS_NAMESPACE "ap_cache"
+// "ap" and 8 hex digits, NVS keys have at most 15 characters
+#define KEY_LEN 11
+// Passphrases of WPA, 64 characters are the PSK in hex already
+#define PASSPHRASE_MIN 8
+#define PASSPHRASE_MAX 63
+#define PBKDF2_ITERATIONS 4096
+
+static const char *TAG = "ap_cache";
+
+// As stored in NVS
+typedef struct {
+    uint8_t ssid[SSID_MAX_LEN];
+    uint8_t ssid_len;
+    // Tells whether the entry is for the current passphrase
+    uint32_t pass_crc;
+    ap_cache_entry entry;
+} ap_cache_record;
+
+static void make_key(char *key, const uint8_t *ssid, size_t ssid_len) {
+    snprintf(key, KEY_LEN, "ap%08x", uart_proto_crc32(0, ssid, ssid_len));
+}
+
+bool ap_cache_load(const uint8_t *ssid, size_t ssid_len, const uint8_t *pass, size_t pass_len, ap_cache_entry *entry) {
+    char key[KEY_LEN];
+    make_key(key, ssid, ssid_len);
+
+    nvs_handle handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return false;
+    }
+    ap_cache_record record;
+    size_t len = sizeof(record);
+    const esp_err_t err = nvs_get_blob(handle, key, &record, &len);
+    nvs_close(handle);
+
+    if (err != ESP_OK || len != sizeof(record)
+            || record.ssid_len != ssid_len || memcmp(record.ssid, ssid, ssid_len) != 0
+            || record.pass_crc != uart_proto_crc32(0, pass, pass_len)) {
+        return false;
+    }
+    *entry = record.entry;
+    return true;
+}
+
+void ap_cache_store(const uint8_t *ssid, size_t ssid_len, const uint8_t *pass, size_t pass_len, const uint8_t *bssid, uint8_t channel) {
+    ap_cache_record record;
+    memset(&record, 0, sizeof(record));
+    memcpy(record.ssid, ssid, ssid_len);
+    record.ssid_len = ssid_len;
+    record.pass_crc = uart_proto_crc32(0, pass, pass_len);
+    memcpy(record.entry.bssid, bssid, sizeof(record.entry.bssid));
+    record.entry.channel = channel;
+
+    if (pass_len >= PASSPHRASE_MIN && pass_len <= PASSPHRASE_MAX) {
+        mbedtls_md_context_t md;
+        mbedtls_md_init(&md);
+        record.entry.has_pmk = mbedtls_md_setup(&md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA1), 1) == 0
+            && mbedtls_pkcs5_pbkdf2_hmac(&md, pass, pass_len, ssid, ssid_len, PBKDF2_ITERATIONS, AP_CACHE_PMK_LEN, record.entry.pmk) == 0;
+        mbedtls_md_free(&md);
+    }
+
+    char key[KEY_LEN];
+    make_key(key, ssid, ssid_len);
+    nvs_handle handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        ESP_LOGI(TAG, "Failed to open NVS");
+        return;
+    }
+    if (nvs_set_blob(handle, key, &record, sizeof(record)) != ESP_OK || nvs_commit(handle) != ESP_OK) {
+        ESP_LOGI(TAG, "Failed to store AP");
+    }
+    nvs_close(handle);
+}
+
+void ap_cache_forget(const uint8_t *ssid, size_t ssid_len) {
+    char key[KEY_LEN];
+    make_key(key, ssid, ssid_len);
+    nvs_handle handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    if (nvs_erase_key(handle, key) == ESP_OK) {
+        nvs_commit(handle);
+    }
+    nvs_close(handle);
+}
@@ -0,0 +1,47 @@
+/* Cache of the AP last connected to
+
+  Remembers in NVS where the AP of a network was found and the PMK derived
+  from its passphrase, so that the next connection can go straight to the
+  AP's channel and skip the PBKDF2 derivation, which takes seconds on the
+  LX106. Entries are keyed by a hash of the SSID and are only used with the
+  same passphrase.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define AP_CACHE_PMK_LEN 32
+
+typedef struct {
+    uint8_t bssid[6];
+    uint8_t channel;
+    // The network has a WPA passphrase and pmk holds the key derived from it
+    bool has_pmk;
+    uint8_t pmk[AP_CACHE_PMK_LEN];
+} ap_cache_entry;
+
+/**
+ * @brief Look the network up
+ *
+ * @return bool Found, entry is filled in
+ */
+bool ap_cache_load(const uint8_t *ssid, size_t ssid_len, const uint8_t *pass, size_t pass_len, ap_cache_entry *entry);
+
+/**
+ * @brief Remember the AP of the network
+ *
+ * Derives the PMK, which takes seconds, so call from a low priority task.
+ */
+void ap_cache_store(const uint8_t *ssid, size_t ssid_len, const uint8_t *pass, size_t pass_len, const uint8_t *bssid, uint8_t channel);
+
+/**
+ * @brief Drop the entry of the network, it didn't work
+ */
+void ap_cache_forget(const uint8_t *ssid, size_t ssid_len);
@@ -0,0 +1,84 @@
+/* ARP responder
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "arp_responder.h"
+
+#include <string.h>
+
+#define ETH_ADDR_LEN 6
+#define IP_ADDR_LEN 4
+
+// Offsets within the frame
+#define ETH_DST 0
+#define ETH_SRC 6
+#define ETH_TYPE 12
+#define ARP_OPER 20
+#define ARP_SHA 22
+#define ARP_SPA 28
+#define ARP_THA 32
+#define ARP_TPA 38
+
+#define ARP_OPER_REQUEST 1
+#define ARP_OPER_REPLY 2
+
+// Fixed part of ARP over Ethernet for IPv4, from the EtherType to the opcode
+static const DRAM_ATTR uint8_t arp_ipv4[] = {0x08, 0x06, 0x00, 0x01, 0x08, 0x00, ETH_ADDR_LEN, IP_ADDR_LEN, 0x00};
+
+static inline bool IRAM_ATTR is_arp_ipv4(const uint8_t *frame, size_t len) {
+    return len >= ARP_FRAME_LEN && memcmp(frame + ETH_TYPE, arp_ipv4, sizeof(arp_ipv4)) == 0;
+}
+
+arp_verdict IRAM_ATTR arp_respond(const arp_offload *offload, const uint8_t *mac, const uint8_t *frame, size_t len, uint8_t *reply) {
+    if (!offload->count || !is_arp_ipv4(frame, len)) {
+        return ARP_PASS;
+    }
+    // Gratuitous, the sender announces its own address. The host updates its
+    // cache from it, or finds a conflict with its address.
+    if (memcmp(frame + ARP_SPA, frame + ARP_TPA, IP_ADDR_LEN) == 0) {
+        return ARP_PASS;
+    }
+
+    const uint8_t *target = frame + ARP_TPA;
+    size_t i = 0;
+    while (i < offload->count && memcmp(target, offload->addrs[i], IP_ADDR_LEN) != 0) {
+        ++i;
+    }
+    if (i == offload->count) {
+        return ARP_DROP;
+    }
+    if (frame[ARP_OPER + 1] != ARP_OPER_REQUEST) {
+        return ARP_PASS;
+    }
+
+    memcpy(reply + ETH_DST, frame + ARP_SHA, ETH_ADDR_LEN);
+    memcpy(reply + ETH_SRC, mac, ETH_ADDR_LEN);
+    memcpy(reply + ETH_TYPE, arp_ipv4, sizeof(arp_ipv4));
+    reply[ARP_OPER + 1] = ARP_OPER_REPLY;
+    memcpy(reply + ARP_SHA, mac, ETH_ADDR_LEN);
+    memcpy(reply + ARP_SPA, target, IP_ADDR_LEN);
+    memcpy(reply + ARP_THA, frame + ARP_SHA, ETH_ADDR_LEN);
+    memcpy(reply + ARP_TPA, frame + ARP_SPA, IP_ADDR_LEN);
+    return ARP_REPLY;
+}
+
+const uint8_t *IRAM_ATTR arp_sender(const uint8_t *frame, size_t len, const uint8_t *ip) {
+    if (!is_arp_ipv4(frame, len) || memcmp(frame + ARP_SPA, ip, IP_ADDR_LEN) != 0) {
+        return NULL;
+    }
+    return frame + ARP_SHA;
+}
+
+void arp_request(const uint8_t *mac, const uint8_t *dst, const uint8_t *sender_ip, const uint8_t *target_ip, uint8_t *request) {
+    memcpy(request + ETH_DST, dst, ETH_ADDR_LEN);
+    memcpy(request + ETH_SRC, mac, ETH_ADDR_LEN);
+    memcpy(request + ETH_TYPE, arp_ipv4, sizeof(arp_ipv4));
+    request[ARP_OPER + 1] = ARP_OPER_REQUEST;
+    memcpy(request + ARP_SHA, mac, ETH_ADDR_LEN);
+    memcpy(request + ARP_SPA, sender_ip, IP_ADDR_LEN);
+    memset(request + ARP_THA, 0, ETH_ADDR_LEN);
+    memcpy(request + ARP_TPA, target_ip, IP_ADDR_LEN);
+}
@@ -0,0 +1,59 @@
+/* ARP responder
+
+  Answers ARP requests for the addresses of the host on its behalf, see
+  MSG_SET_ARP_OFFLOAD, and builds the requests probing the gateway. Does not
+  depend on ESP8266_RTOS_SDK.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "uart_proto.h"
+
+// Ethernet header and ARP for IPv4, without padding
+#define ARP_FRAME_LEN 42
+
+typedef enum {
+    // Not ARP for IPv4 over Ethernet, or offload disabled
+    ARP_PASS,
+    // Request for the host, the reply is ready
+    ARP_REPLY,
+    // For another target
+    ARP_DROP,
+} arp_verdict;
+
+/**
+ * @brief Decide about a frame received from WiFi
+ *
+ * ARP messages other than requests for the host, like replies to its own
+ * requests, are passed. So is gratuitous ARP, announcing a new hardware
+ * address of a neighbor or claiming the address of the host. Probes from
+ * 0.0.0.0 for the address of the host are answered, as the host would.
+ *
+ * @param mac Hardware address of the NIC
+ * @param reply ARP_FRAME_LEN bytes to build the reply in
+ */
+arp_verdict arp_respond(const arp_offload *offload, const uint8_t *mac, const uint8_t *frame, size_t len, uint8_t *reply);
+
+/**
+ * @brief Get the hardware address of the sender of an ARP message
+ *
+ * @param ip Expected sender protocol address
+ * @return const uint8_t* The address or NULL when the frame is not ARP from ip
+ */
+const uint8_t *arp_sender(const uint8_t *frame, size_t len, const uint8_t *ip);
+
+/**
+ * @brief Build an ARP request
+ *
+ * @param dst Destination hardware address, broadcast when not known
+ * @param sender_ip Address of the host, zeros for a probe without one
+ * @param request ARP_FRAME_LEN bytes to build the request in
+ */
+void arp_request(const uint8_t *mac, const uint8_t *dst, const uint8_t *sender_ip, const uint8_t *target_ip, uint8_t *request);
@@ -0,0 +1,54 @@
+/* Fixed-size buffer pool
+
+  The LX106 has no compare-and-swap, so instead of a lock-free list the few
+  instructions touching the free list run with interrupts masked. This is
+  what the SDK's own atomics do and it is bounded and ISR safe on the single
+  core.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "buf_pool.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+
+void buf_pool_init(buf_pool_t *pool, void *mem, size_t elem_size, uint16_t count) {
+    elem_size = (elem_size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+    pool->free_list = NULL;
+    for (uint16_t i = count; i > 0; --i) {
+        void **block = (void **)((uint8_t *)mem + (i - 1) * elem_size);
+        *block = pool->free_list;
+        pool->free_list = block;
+    }
+    pool->count = count;
+    pool->free_count = count;
+    pool->low_water = count;
+    pool->exhausted = 0;
+}
+
+void *IRAM_ATTR buf_pool_alloc(buf_pool_t *pool) {
+    portENTER_CRITICAL();
+    void **block = pool->free_list;
+    if (block) {
+        pool->free_list = *block;
+        if (--pool->free_count < pool->low_water) {
+            pool->low_water = pool->free_count;
+        }
+    } else {
+        pool->exhausted++;
+    }
+    portEXIT_CRITICAL();
+    return block;
+}
+
+void IRAM_ATTR buf_pool_free(buf_pool_t *pool, void *block) {
+    portENTER_CRITICAL();
+    *(void **)block = pool->free_list;
+    pool->free_list = block;
+    pool->free_count++;
+    portEXIT_CRITICAL();
+}
@@ -0,0 +1,49 @@
+/* Fixed-size buffer pool
+
+  Preallocated blocks handed out in constant time without touching the heap.
+  Safe to use from the WiFi RX callback and from interrupts.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+    // Free blocks are chained through their first word
+    void *free_list;
+    uint16_t count;
+    uint16_t free_count;
+    // Lowest free_count seen since init
+    uint16_t low_water;
+    // Number of allocations that failed because the pool was empty
+    uint32_t exhausted;
+} buf_pool_t;
+
+// Storage for count blocks of elem_size bytes with the alignment buf_pool needs
+#define BUF_POOL_STORAGE(name, elem_size, count) \
+    static void *name[((elem_size) + sizeof(void *) - 1) / sizeof(void *) * (count)]
+
+/**
+ * @brief Split the memory into blocks and put them all on the free list
+ *
+ * @param mem Storage, aligned for a pointer, count * elem_size bytes
+ * @param elem_size Block size, rounded up to a multiple of pointer size
+ */
+void buf_pool_init(buf_pool_t *pool, void *mem, size_t elem_size, uint16_t count);
+
+/**
+ * @brief Take a block from the pool
+ *
+ * @return void* The block or NULL if the pool is exhausted
+ */
+void *buf_pool_alloc(buf_pool_t *pool);
+
+/**
+ * @brief Return a block obtained from buf_pool_alloc
+ */
+void buf_pool_free(buf_pool_t *pool, void *block);
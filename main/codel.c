@@ -0,0 +1,115 @@
+/* CoDel active queue management
+
+  The control law divides the interval by the square root of the drop
+  count. The CPU has no FPU, so the root is computed on integers, in 16
+  bounded steps.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "codel.h"
+
+// Saturate the drop rate, past this the queue is hopelessly overloaded anyway
+#define COUNT_MAX 0xFFFF
+
+static uint32_t IRAM_ATTR isqrt(uint32_t x) {
+    uint32_t root = 0;
+    uint32_t bit = 1UL << 30;
+    while (bit > x) {
+        bit >>= 2;
+    }
+    while (bit) {
+        if (x >= root + bit) {
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+// Time of the next drop: t + interval / sqrt(count)
+static uint32_t IRAM_ATTR control_law(const codel_t *codel, uint32_t t) {
+    // interval / sqrt(count) == interval * 256 / sqrt(count * 65536)
+    const uint32_t root = isqrt(codel->count << 16);
+    return t + (uint32_t)(((uint64_t)codel->interval << 8) / root);
+}
+
+static inline bool IRAM_ATTR time_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+static bool IRAM_ATTR ok_to_drop(codel_t *codel, uint32_t now, uint32_t sojourn, size_t backlog) {
+    // Never drop the last packet, the link would go idle
+    if (sojourn < codel->target || backlog == 0) {
+        codel->above = false;
+        return false;
+    }
+    if (!codel->above) {
+        codel->above = true;
+        codel->first_above = now + codel->interval;
+        return false;
+    }
+    return !time_before(now, codel->first_above);
+}
+
+void codel_init(codel_t *codel, uint32_t target, uint32_t interval) {
+    codel->target = target;
+    codel->interval = interval;
+    codel->above = false;
+    codel->first_above = 0;
+    codel->dropping = false;
+    codel->drop_next = 0;
+    codel->count = 0;
+    codel->last_count = 0;
+}
+
+void codel_set_target(codel_t *codel, uint32_t target) {
+    codel->target = target;
+    if (!target) {
+        codel->above = false;
+        codel->dropping = false;
+    }
+}
+
+bool IRAM_ATTR codel_drop(codel_t *codel, uint32_t now, uint32_t sojourn, size_t backlog) {
+    if (!codel->target) {
+        return false;
+    }
+
+    const bool ok = ok_to_drop(codel, now, sojourn, backlog);
+    if (codel->dropping) {
+        if (!ok) {
+            codel->dropping = false;
+            return false;
+        }
+        if (time_before(now, codel->drop_next)) {
+            return false;
+        }
+        if (codel->count < COUNT_MAX) {
+            codel->count++;
+        }
+        codel->drop_next = control_law(codel, codel->drop_next);
+        return true;
+    }
+
+    if (!ok) {
+        return false;
+    }
+    // Soon after leaving the dropping state, resume at about the drop rate
+    // that controlled the queue the last time
+    codel->dropping = true;
+    const uint32_t delta = codel->count - codel->last_count;
+    if (delta > 1 && time_before(now - 16 * codel->interval, codel->drop_next)) {
+        codel->count = delta;
+    } else {
+        codel->count = 1;
+    }
+    codel->drop_next = control_law(codel, now);
+    codel->last_count = codel->count;
+    return true;
+}
@@ -0,0 +1,65 @@
+/* CoDel active queue management
+
+  Controlled Delay as described in RFC 8289, evaluated when a packet leaves
+  the queue. Once packets keep waiting longer than the target for a whole
+  interval, packets are dropped at a rate growing with the square root of
+  the number of drops, until the delay falls below the target again. A TCP
+  sender backs off early instead of filling the queue up to the tail drop.
+  Does not depend on ESP8266_RTOS_SDK, times are in arbitrary units that
+  wrap around.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#else
+#define IRAM_ATTR
+#endif
+
+typedef struct {
+    uint32_t target;
+    uint32_t interval;
+
+    // Sojourn time is above the target, since first_above - interval
+    bool above;
+    uint32_t first_above;
+    // In the dropping state, the next drop is due at drop_next
+    bool dropping;
+    uint32_t drop_next;
+    // Drops in the current dropping state and at the end of the previous one
+    uint32_t count;
+    uint32_t last_count;
+} codel_t;
+
+/**
+ * @brief Start with no packet dropped
+ *
+ * @param target Acceptable standing queue delay, 0 disables dropping
+ * @param interval Time to tolerate delay over the target, about a round trip
+ */
+void codel_init(codel_t *codel, uint32_t target, uint32_t interval);
+
+/**
+ * @brief Change the target, as when the queue drains at a different rate
+ *
+ * @param target Acceptable standing queue delay, 0 disables dropping
+ */
+void codel_set_target(codel_t *codel, uint32_t target);
+
+/**
+ * @brief Decide about a packet just taken from the queue
+ *
+ * @param sojourn How long the packet waited in the queue
+ * @param backlog Packets still waiting after it
+ * @return bool Drop the packet and take the next one
+ */
+bool codel_drop(codel_t *codel, uint32_t now, uint32_t sojourn, size_t backlog);
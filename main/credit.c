@@ -0,0 +1,45 @@
+/* Credit flow control of packets from the host
+
+  Counts wrap around, only their differences matter.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "credit.h"
+
+void credit_init(credit_t *credit, uint32_t step) {
+    credit->accepted = 0;
+    credit->advertised = 0;
+    credit->step = step;
+}
+
+void IRAM_ATTR credit_accept(credit_t *credit) {
+    credit->accepted++;
+}
+
+uint32_t credit_sync(credit_t *credit, uint32_t sent) {
+    const uint32_t lost = sent - credit->accepted;
+    credit->accepted = sent;
+    return lost;
+}
+
+uint32_t IRAM_ATTR credit_limit(const credit_t *credit, uint32_t free) {
+    return credit->accepted + free;
+}
+
+void IRAM_ATTR credit_advertise(credit_t *credit, uint32_t limit) {
+    credit->advertised = limit;
+}
+
+bool IRAM_ATTR credit_update_due(const credit_t *credit, uint32_t free) {
+    const uint32_t advertised = credit->advertised;
+    const uint32_t gained = credit_limit(credit, free) - advertised;
+    return gained >= credit->step || (gained && credit->accepted == advertised);
+}
+
+bool IRAM_ATTR credit_host_waiting(const credit_t *credit, uint32_t free) {
+    const uint32_t advertised = credit->advertised;
+    return credit->accepted == advertised && credit_limit(credit, free) != advertised;
+}
@@ -0,0 +1,72 @@
+/* Credit flow control of packets from the host
+
+  The NIC grants the host one credit per free packet buffer, see MSG_CREDIT.
+  Both sides count MSG_PACKETs since the host enabled FEATURE_CREDITS and the
+  limit is in the same count, so a lost MSG_CREDIT costs nothing. A packet
+  header lost to a transmission error is counted by the host only, the host
+  makes up for it by sending its count back. Does not depend on
+  ESP8266_RTOS_SDK.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#else
+#define IRAM_ATTR
+#endif
+
+typedef struct {
+    // MSG_PACKETs received, written by the UART RX task only
+    atomic_uint_least32_t accepted;
+    // Limit last sent to the host, written by the UART TX thread only
+    atomic_uint_least32_t advertised;
+    // Send a new limit once this many buffers got free, or on the first one
+    // when the host used up all its credits
+    uint32_t step;
+} credit_t;
+
+/**
+ * @brief Start counting, as when the host enables FEATURE_CREDITS
+ */
+void credit_init(credit_t *credit, uint32_t step);
+
+/**
+ * @brief Count a packet from the host, whatever happens to it
+ */
+void credit_accept(credit_t *credit);
+
+/**
+ * @brief Take the count of packets the host sent as the count received
+ *
+ * @return uint32_t Packets lost before their header was parsed
+ */
+uint32_t credit_sync(credit_t *credit, uint32_t sent);
+
+/**
+ * @brief Limit granting the host the free buffers
+ */
+uint32_t credit_limit(const credit_t *credit, uint32_t free);
+
+/**
+ * @brief Remember the limit was sent
+ */
+void credit_advertise(credit_t *credit, uint32_t limit);
+
+/**
+ * @brief Tell whether sending a new limit is worth it
+ */
+bool credit_update_due(const credit_t *credit, uint32_t free);
+
+/**
+ * @brief Tell whether the host used up its credits while some buffers are free
+ */
+bool credit_host_waiting(const credit_t *credit, uint32_t free);
@@ -0,0 +1,16 @@
+/* Link inactivity check
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "link_check.h"
+
+uint32_t link_check_idle(uint32_t last, uint32_t now) {
+    return now >= last ? now - last : now;
+}
+
+bool link_check_inactive(uint32_t last, uint32_t now, uint32_t timeout) {
+    return link_check_idle(last, now) > timeout;
+}
@@ -0,0 +1,32 @@
+/* Link inactivity check
+
+  Decides from the time of the last packet received from WiFi whether to
+  probe that the AP is still there. Checked periodically by a timer, so the
+  loss is detected within the timeout plus the period whatever the traffic
+  from the host. Does not depend on ESP8266_RTOS_SDK, times are in seconds
+  of a clock wrapping around at any value.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Seconds since the last packet
+ *
+ * The clock is the tick count converted to seconds, it wraps around at no
+ * power of two. Once it did, now is lower than last and only the part
+ * after the wrap is counted, as checks come often enough for that part to
+ * be most of it.
+ */
+uint32_t link_check_idle(uint32_t last, uint32_t now);
+
+/**
+ * @brief Tell whether no packet came for longer than the timeout
+ */
+bool link_check_inactive(uint32_t last, uint32_t now, uint32_t timeout);
@@ -0,0 +1,114 @@
+/* Ingress frame classification
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "pkt_class.h"
+
+#define ETH_HEADER_LEN 14
+#define VLAN_TAG_LEN 4
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_ARP 0x0806
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_IPV6 0x86DD
+
+#define IPV6_HEADER_LEN 40
+
+#define IP_PROTO_ICMP 1
+#define IP_PROTO_TCP 6
+#define IP_PROTO_UDP 17
+#define IP_PROTO_ICMPV6 58
+
+#define PORT_DNS 53
+#define PORT_DHCP_SERVER 67
+#define PORT_DHCP_CLIENT 68
+#define PORT_DHCPV6_CLIENT 546
+#define PORT_DHCPV6_SERVER 547
+
+static inline uint16_t IRAM_ATTR read_u16(const uint8_t *data) {
+    return (data[0] << 8) | data[1];
+}
+
+/**
+ * @brief Classify the transport layer
+ *
+ * @param l4 Transport header
+ * @param len Bytes of the IP payload, as declared by the IP header
+ * @param avail Bytes of the IP payload actually received
+ */
+static pkt_class IRAM_ATTR classify_l4(uint8_t proto, const uint8_t *l4, size_t len, size_t avail) {
+    switch (proto) {
+    case IP_PROTO_ICMP:
+    case IP_PROTO_ICMPV6:
+        return PKT_CLASS_CONTROL;
+    case IP_PROTO_UDP: {
+        if (avail < 4) {
+            return PKT_CLASS_BULK;
+        }
+        const uint16_t src = read_u16(l4);
+        const uint16_t dst = read_u16(l4 + 2);
+        if (src == PORT_DNS
+                || src == PORT_DHCP_SERVER || dst == PORT_DHCP_CLIENT
+                || src == PORT_DHCPV6_SERVER || dst == PORT_DHCPV6_CLIENT) {
+            return PKT_CLASS_CONTROL;
+        }
+        return PKT_CLASS_BULK;
+    }
+    case IP_PROTO_TCP: {
+        if (avail < 13) {
+            return PKT_CLASS_BULK;
+        }
+        const size_t header_len = (l4[12] >> 4) * 4;
+        return len <= header_len ? PKT_CLASS_ACK : PKT_CLASS_BULK;
+    }
+    default:
+        return PKT_CLASS_BULK;
+    }
+}
+
+pkt_class IRAM_ATTR pkt_classify(const uint8_t *frame, size_t len) {
+    if (len < ETH_HEADER_LEN) {
+        return PKT_CLASS_BULK;
+    }
+    size_t pos = ETH_HEADER_LEN;
+    uint16_t ethertype = read_u16(frame + pos - 2);
+    if (ethertype == ETHERTYPE_VLAN) {
+        if (len < ETH_HEADER_LEN + VLAN_TAG_LEN) {
+            return PKT_CLASS_BULK;
+        }
+        pos += VLAN_TAG_LEN;
+        ethertype = read_u16(frame + pos - 2);
+    }
+
+    const uint8_t *l3 = frame + pos;
+    const size_t l3_avail = len - pos;
+    switch (ethertype) {
+    case ETHERTYPE_ARP:
+        return PKT_CLASS_CONTROL;
+    case ETHERTYPE_IPV4: {
+        if (l3_avail < 20) {
+            return PKT_CLASS_BULK;
+        }
+        const size_t header_len = (l3[0] & 0x0F) * 4;
+        const size_t total_len = read_u16(l3 + 2);
+        // Later fragments carry no transport header
+        const uint16_t fragment_offset = read_u16(l3 + 6) & 0x1FFF;
+        if (header_len < 20 || total_len < header_len || l3_avail < header_len || fragment_offset) {
+            return PKT_CLASS_BULK;
+        }
+        return classify_l4(l3[9], l3 + header_len, total_len - header_len, l3_avail - header_len);
+    }
+    case ETHERTYPE_IPV6: {
+        if (l3_avail < IPV6_HEADER_LEN) {
+            return PKT_CLASS_BULK;
+        }
+        const size_t payload_len = read_u16(l3 + 4);
+        return classify_l4(l3[6], l3 + IPV6_HEADER_LEN, payload_len, l3_avail - IPV6_HEADER_LEN);
+    }
+    default:
+        return PKT_CLASS_BULK;
+    }
+}
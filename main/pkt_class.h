@@ -0,0 +1,35 @@
+/* Ingress frame classification
+
+  Sorts Ethernet frames received from WiFi into priority classes, so that
+  the few frames keeping connections alive are not dropped behind bulk data
+  on their way to UART. Looks at fixed offsets only, without walking IPv6
+  extension headers or IP options beyond their length, so the cost is
+  bounded. Does not depend on ESP8266_RTOS_SDK.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#else
+#define IRAM_ATTR
+#endif
+
+// In order of priority
+typedef enum {
+    // ARP, DHCP, DNS answers, ICMP and ICMPv6 (neighbor discovery)
+    PKT_CLASS_CONTROL,
+    // TCP segments without payload: ACK, SYN, FIN, RST
+    PKT_CLASS_ACK,
+    PKT_CLASS_BULK,
+    PKT_CLASS_COUNT,
+} pkt_class;
+
+pkt_class pkt_classify(const uint8_t *frame, size_t len);
@@ -0,0 +1,45 @@
+/* Storm limit of group addressed frames
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "storm_limit.h"
+
+void storm_limit_init(storm_limit *limit, uint32_t rate, uint32_t burst, uint32_t now) {
+    for (size_t i = 0; i < STORM_CLASSES; ++i) {
+        token_bucket_init(&limit->bucket[i], rate, burst, now);
+    }
+}
+
+void storm_limit_set(storm_limit *limit, uint8_t cls, uint32_t rate, uint32_t burst, uint32_t now) {
+    if (cls >= STORM_CLASSES) {
+        return;
+    }
+    if (!burst) {
+        burst = 1;
+    }
+    token_bucket_init(&limit->bucket[cls], rate, burst, now);
+}
+
+uint8_t IRAM_ATTR storm_class(const uint8_t *frame, size_t len) {
+    if (len < 14) {
+        return STORM_OTHER;
+    }
+    switch ((frame[12] << 8) | frame[13]) {
+    case 0x0806:
+        return STORM_ARP;
+    case 0x0800:
+        return STORM_IPV4;
+    case 0x86DD:
+        return STORM_IPV6;
+    default:
+        return STORM_OTHER;
+    }
+}
+
+bool IRAM_ATTR storm_limit_pass(storm_limit *limit, const uint8_t *frame, size_t len, uint32_t now, uint8_t *cls) {
+    *cls = storm_class(frame, len);
+    return token_bucket_take(&limit->bucket[*cls], now);
+}
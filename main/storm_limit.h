@@ -0,0 +1,49 @@
+/* Storm limit of group addressed frames
+
+  Sorts broadcast and multicast frames from WiFi by EtherType into the
+  STORM_* classes and rate limits each class with its own token bucket, see
+  MSG_SET_STORM_LIMIT. A storm of one class does not starve the others. Does
+  not depend on ESP8266_RTOS_SDK, times are in microseconds and wrap around.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "uart_proto.h"
+#include "token_bucket.h"
+
+typedef struct {
+    token_bucket bucket[STORM_CLASSES];
+} storm_limit;
+
+/**
+ * @brief Set the same limits for all the classes
+ */
+void storm_limit_init(storm_limit *limit, uint32_t rate, uint32_t burst, uint32_t now);
+
+/**
+ * @brief Set the limits of one class, ignoring unknown classes
+ *
+ * A burst of 0 would never let anything through, it is raised to 1.
+ */
+void storm_limit_set(storm_limit *limit, uint8_t cls, uint32_t rate, uint32_t burst, uint32_t now);
+
+/**
+ * @brief The STORM_* class of a group addressed frame
+ */
+uint8_t storm_class(const uint8_t *frame, size_t len);
+
+/**
+ * @brief Take a token of the class of a group addressed frame
+ *
+ * @param cls The class, for counting the drops
+ * @return bool The frame may pass
+ */
+bool storm_limit_pass(storm_limit *limit, const uint8_t *frame, size_t len, uint32_t now, uint8_t *cls);
@@ -0,0 +1,34 @@
+/* Token bucket rate limiter
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "token_bucket.h"
+
+#define TOKEN 1000000
+
+void token_bucket_init(token_bucket *bucket, uint32_t rate, uint32_t burst, uint32_t now) {
+    bucket->rate = rate;
+    bucket->burst = burst;
+    bucket->tokens = (uint64_t)burst * TOKEN;
+    bucket->last = now;
+}
+
+bool IRAM_ATTR token_bucket_take(token_bucket *bucket, uint32_t now) {
+    if (!bucket->rate) {
+        return true;
+    }
+    const uint32_t elapsed = now - bucket->last;
+    bucket->last = now;
+
+    const uint64_t full = (uint64_t)bucket->burst * TOKEN;
+    uint64_t tokens = bucket->tokens + (uint64_t)elapsed * bucket->rate;
+    if (tokens > full) {
+        tokens = full;
+    }
+    const bool pass = tokens >= TOKEN;
+    bucket->tokens = pass ? tokens - TOKEN : tokens;
+    return pass;
+}
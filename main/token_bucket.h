@@ -0,0 +1,43 @@
+/* Token bucket rate limiter
+
+  Lets events through at a sustained rate with bursts up to a limit, in
+  constant time. Does not depend on ESP8266_RTOS_SDK, times are in
+  microseconds and wrap around.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#else
+#define IRAM_ATTR
+#endif
+
+typedef struct {
+    // Events per second, 0 lets everything through
+    uint32_t rate;
+    // Events let through at once after a pause
+    uint32_t burst;
+    // In millionths of an event, so that a microsecond adds rate of them
+    uint64_t tokens;
+    uint32_t last;
+} token_bucket;
+
+/**
+ * @brief Set the limits, starting with a full bucket
+ */
+void token_bucket_init(token_bucket *bucket, uint32_t rate, uint32_t burst, uint32_t now);
+
+/**
+ * @brief Take a token for an event
+ *
+ * @return bool The event may pass
+ */
+bool token_bucket_take(token_bucket *bucket, uint32_t now);
@@ -29,7 +29,9 @@
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
 #include "freertos/queue.h"
+#include "freertos/timers.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_log.h"
 #include "esp_netif.h"
 #include "esp_event.h"
@@ -45,12 +47,25 @@
 #include "esp_private/wifi.h"
 #include "esp_supplicant/esp_wpa.h"
 
+#include "uart_proto.h"
+#include "buf_pool.h"
+#include "uart_tx.h"
+#include "pkt_class.h"
+#include "codel.h"
+#include "arp_responder.h"
+#include "storm_limit.h"
+#include "ap_cache.h"
+#include "credit.h"
+#include "link_check.h"
+
 
 // Externals with no header
 int ieee80211_output_pbuf(esp_aio_t *aio);
 esp_err_t mac_init(void);
 
-static const uint16_t FW_VERSION = 8;
+static const uint16_t FW_VERSION = 21;
+
+static const uint32_t SUPPORTED_FEATURES = FEATURE_PACKET_BATCH | FEATURE_CRC | FEATURE_CREDITS | FEATURE_LINK_INFO;
 
 // Hack: because we don't see the beacon on some networks (and it's quite
 // common), but don't want to be "flapping", we set the timeout for beacon
@@ -59,115 +74,452 @@ static const uint16_t FW_VERSION = 8;
 // It's not longer for the only reason the uint16_t doesn't hold as big numbers.
 static const uint16_t INACTIVE_BEACON_SECONDS = 3600 * 18;
 // This is the effective timeout. If we don't receive any packet for this long,
-// we consider the signal lost.
-//
-// TODO: Shall we generate something to provoke getting some packets? Like ARP
-// pings to the AP?
-static const uint32_t INACTIVE_PACKET_SECONDS = 5;
-
-// intron
-// 0 as uint8_t
-// fw version as uint16_t
-// hw addr data as uint8_t[6]
-#define MSG_DEVINFO 0
-
-// intron
-// 1 as uint8_t
-// link up as bool (uint8_t)
-#define MSG_LINK 1
-
-// intron
-// 2 as uint8_t
-#define MSG_GET_LINK 2
-
-// intron
-// 2 as uint8_t
-// ssid size as uint8_t
-// ssid bytes
-// pass size as uint8_t
-// pass bytes
-#define MSG_CLIENTCONFIG 3
-
-// intron
-// 3 as uint8_t
-// LEN as uint32_t
-// DATA
-#define MSG_PACKET 4
-
-// intron
-// 5 as uint8_t
-// new intron as uint8_t[8]
-#define MSG_INTRON 5
+// we try to provoke some by ARP to the gateway, then look for the AP, and
+// consider the signal lost when neither works.
+static const uint32_t INACTIVE_PACKET_SECONDS = CONFIG_UART_NIC_INACTIVE_PACKET_SECONDS;
+// How often the timeout is checked
+#define LINK_CHECK_MS CONFIG_UART_NIC_LINK_CHECK_MS
 
 static const uint8_t uart_nic_protocol = WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N;
 
 static const char *TAG = "uart_nic";
 
-SemaphoreHandle_t uart_mtx = NULL;
 static int s_retry_num = 0;
+// Bulk packets from WiFi waiting for UART, NULL entries just wake the TX
+// thread up
 QueueHandle_t uart_tx_queue = 0;
+// Packets of the classes above PKT_CLASS_BULK, drained first
+static QueueHandle_t uart_prio_queue[PKT_CLASS_BULK];
 QueueHandle_t wifi_egress_queue = 0;
+// Events of the UART driver, drained by the RX thread
+static QueueHandle_t uart_event_queue = 0;
 
-static char intron[8] = {'U', 'N', '\x00', '\x01', '\x02', '\x03', '\x04', '\x05'};
+static char intron[INTRON_LEN] = {'U', 'N', '\x00', '\x01', '\x02', '\x03', '\x04', '\x05'};
 #define MAC_LEN 6
 static uint8_t mac[MAC_LEN];
 
+// Multicast accepted from WiFi, see MSG_SET_MCAST_FILTER. Written by the RX
+// thread and read by the WiFi RX callback, which may preempt it, so the
+// writer holds a critical section.
+static mcast_filter mcast = { .flags = MCAST_ACCEPT_ALL };
+// Addresses of the host answered by the NIC, see MSG_SET_ARP_OFFLOAD. Shared
+// the same way.
+static arp_offload arp_ips;
+// ARP frame built by the NIC, sent to WiFi by the egress thread
+typedef struct {
+    uint8_t frame[ARP_FRAME_LEN];
+    atomic_bool pending;
+} arp_slot;
+// The WiFi RX callback leaves the requests to the host while a reply is
+// pending
+static arp_slot arp_reply;
+// Request to the gateway checking the link, see MSG_SET_GATEWAY
+static arp_slot arp_probe;
+// Gateway set by the host, shared like the ARP offload addresses. Its
+// hardware address is learned from its ARP messages by the WiFi RX callback.
+static uint8_t gateway_ip[4];
+static uint8_t gateway_mac[MAC_LEN];
+static atomic_bool gateway_set = false;
+static atomic_bool gateway_mac_known = false;
+// Rate limits of group addressed frames from WiFi. Owned by the WiFi RX
+// callback, MSG_SET_STORM_LIMIT replaces them in a critical section.
+static storm_limit storm_limits;
+
 static uint32_t now_seconds() {
     return xTaskGetTickCount() / configTICK_RATE_HZ;
 }
 
 static atomic_uint_least32_t last_inbound_seen = 0;
+// The same in microseconds, telling whether a probe got answered
+static atomic_uint_least32_t last_inbound_us = 0;
 static atomic_bool associated = false;
+// Since when, by now_seconds
+static atomic_uint_least32_t associated_since = 0;
+
+// Link quality, see MSG_LINK_INFO. Sampled by the link check timer from the
+// driver, copied in a critical section.
+typedef struct {
+    bool up;
+    uint8_t bssid[MAC_LEN];
+    uint8_t channel;
+    int8_t rssi;
+    uint8_t phy;
+    uint32_t since;
+} link_info_t;
+static link_info_t link_info;
+// Last pushed to the host, owned by the timer
+static link_info_t link_info_pushed;
+
+// Protocol extensions the host asked for, FEATURE_* bits
+static atomic_uint_least32_t features = 0;
+
+// Credit flow control of packets from the host, see MSG_CREDIT
+static credit_t egress_credit;
+#define CREDIT_UPDATE_STEP ((CONFIG_UART_NIC_EGRESS_BUFFERS + 3) / 4)
+
+// Counters reported by MSG_STATS, indexed by STAT_*. Those kept elsewhere are
+// copied in when sending. Every counter is only ever updated by one task, so
+// plain increments are enough: the CPU has no atomic read-modify-write and
+// aligned 32 bit loads and stores are not torn.
+static uint32_t stats[STAT_COUNT];
+
+// Parser of messages from the host, owned by the RX thread
+static uart_proto_parser rx_parser;
+
+// Rates MSG_SET_BAUD may switch to. A rate outside the list, like a corrupted
+// one, could leave the host without a way back.
+static const uint32_t baud_rates[] = { BAUD_RATES, CONFIG_UART_NIC_BAUD_RATE };
+// Runtime baud rate switching, see MSG_SET_BAUD. The previous rate is 0 unless
+// a switch waits for confirmation by the host until the deadline. Messages
+// counted by the parser that don't confirm it are accounted in baud_messages.
+// Owned by the RX thread, the TX thread applies the rates.
+static uint32_t baud_rate = CONFIG_UART_NIC_BAUD_RATE;
+static uint32_t baud_previous = 0;
+static TickType_t baud_deadline;
+static uint32_t baud_messages;
+
+// Credentials from the last MSG_CLIENTCONFIG, written by the RX thread
+static uint8_t client_ssid[SSID_MAX_LEN];
+static uint8_t client_ssid_len;
+static uint8_t client_pass[PASS_MAX_LEN];
+static uint8_t client_pass_len;
+// WiFi was started with the credentials above
+static bool wifi_started = false;
+// The WiFi config points straight to the AP found in ap_cache or roamed to
+static atomic_bool fast_connect = false;
+// Connection since MSG_CLIENTCONFIG is pending, started at connect_started_us
+static atomic_bool connecting = false;
+static uint32_t connect_started_us;
+static atomic_uint_least32_t link_time_ms = 0;
 
 static bool beacon_quirk;
 static uint8_t probe_max_reties = 3;
 static atomic_bool probe_in_progress = false;
 static uint8_t probe_retry_count;
+// The probe sends ARP to the gateway, scans for the AP otherwise
+static atomic_bool probe_arp = false;
+static uint32_t probe_started_us;
+
+// Scan running, taken by scan_claim. The driver runs one scan at a time and
+// reports each one by WIFI_EVENT_SCAN_DONE, the owner tells whose it was.
+typedef enum {
+    SCAN_OWNER_NONE,
+    SCAN_OWNER_PROBE,
+    // Also owns scan_results until the TX thread sent them all
+    SCAN_OWNER_HOST,
+    // Also owns scan_results and scan_ssid
+    SCAN_OWNER_ROAM,
+} scan_owner_t;
+static atomic_uint scan_owner = SCAN_OWNER_NONE;
+static TickType_t scan_claimed;
+// A scan the driver never reported, as when WiFi stopped meanwhile, doesn't
+// block the others for longer than this. All channels take up to 14 times
+// SCAN_DWELL_MAX_MS.
+#define SCAN_STALE_MS 30000
+#define SCAN_DWELL_MAX_MS 1500
+// Scan of the host, see MSG_SCAN_START. The SSID is NUL terminated for the
+// driver, scan_ssid_len 0 for any.
+static wifi_ap_record_t scan_results[CONFIG_UART_NIC_SCAN_RESULTS_MAX];
+static uint8_t scan_ssid[SSID_MAX_LEN + 1];
+static uint8_t scan_ssid_len;
+
+// Roaming to a stronger AP of the network, scanning one channel per
+// ROAM_SCAN_PERIOD_MS while the signal is below ROAM_RSSI
+#define ROAM_RSSI CONFIG_UART_NIC_ROAM_RSSI
+#define ROAM_MARGIN CONFIG_UART_NIC_ROAM_MARGIN
+#define ROAM_SCAN_PERIOD_MS CONFIG_UART_NIC_ROAM_SCAN_PERIOD_MS
+#define ROAM_CHANNELS 13
+// When the last scan was asked for, owned by the link check timer
+static TickType_t roam_scanned;
+// Last channel scanned, owned by the event task
+static uint8_t roam_channel = 0;
+// Reassociation to another AP pending, started at roam_started_us
+static atomic_bool roaming = false;
+static uint32_t roam_started_us;
+
+// Work of the link check timer handed over to the event task, which drives
+// the WiFi driver, see event_handler
+ESP_EVENT_DEFINE_BASE(UART_NIC_EVENT);
+typedef enum {
+    UART_NIC_EVENT_ROAM_SCAN,
+} uart_nic_event_t;
 
 typedef struct {
     size_t len;
     void *data;
     void *rx_buff;
+    // When it was queued, in microseconds
+    uint32_t queued_us;
 } wifi_receive_buff;
 
 typedef struct {
     size_t len;
-    void *data;
+    uint8_t data[CONFIG_UART_NIC_PACKET_BUFFER_SIZE];
 } wifi_send_buff;
 
+// Descriptors of frames received from WiFi waiting for UART, the data stay
+// in the WiFi driver's buffers
+BUF_POOL_STORAGE(wifi_receive_buff_mem, sizeof(wifi_receive_buff), CONFIG_UART_NIC_INGRESS_DESCRIPTORS);
+static buf_pool_t wifi_receive_buff_pool;
+// Bulk packets can't take the last descriptors, leaving them to the classes
+// above
+#define PRIORITY_RESERVE CONFIG_UART_NIC_PRIORITY_RESERVE
+_Static_assert(PRIORITY_RESERVE < CONFIG_UART_NIC_INGRESS_DESCRIPTORS, "Bulk packets need a descriptor");
+
+// Keeps the delay of bulk packets waiting for UART bounded, owned by the TX
+// thread
+static codel_t ingress_codel;
+// A full size frame with the message header, the target can't be shorter
+// than sending one at the current baud rate
+#define CODEL_FRAME_BYTES 1536
+// Bulk packets put in the UART TX queue by the WiFi task and taken by the TX
+// thread, the difference is the backlog without the wakeups in the queue
+static uint32_t bulk_enqueued = 0;
+static uint32_t bulk_dequeued = 0;
+
+// Packets received from UART waiting for WiFi
+BUF_POOL_STORAGE(wifi_send_buff_mem, sizeof(wifi_send_buff), CONFIG_UART_NIC_EGRESS_BUFFERS);
+static buf_pool_t wifi_send_buff_pool;
+
 static void IRAM_ATTR free_wifi_receive_buff(wifi_receive_buff *buff) {
     if(buff->rx_buff) esp_wifi_internal_free_rx_buffer(buff->rx_buff);
     if(buff->data) free(buff->data);
-    free(buff);
+    buf_pool_free(&wifi_receive_buff_pool, buff);
+}
+
+static void IRAM_ATTR ingress_sent(void *arg) {
+    free_wifi_receive_buff(arg);
+}
+
+// The TX thread was asked to release buffers of packets already sent
+static atomic_bool tx_reap_pending = false;
+
+static void IRAM_ATTR tx_wake(BaseType_t *woken) {
+    if (!tx_reap_pending) {
+        tx_reap_pending = true;
+        wifi_receive_buff *wakeup = NULL;
+        xQueueSendToFrontFromISR(uart_tx_queue, &wakeup, woken);
+    }
 }
 
 static void IRAM_ATTR free_wifi_send_buff(wifi_send_buff *buff) {
-    if(buff->data) free(buff->data);
-    free(buff);
+    buf_pool_free(&wifi_send_buff_pool, buff);
+}
+
+// Message being written to UART. Small writes are collected here and queued
+// to the TX ring together. Only touched by the UART TX thread.
+#define TX_HEADER_SIZE 160
+static uint8_t tx_header[TX_HEADER_SIZE];
+static size_t tx_header_len;
+static bool tx_crc_frame;
+static uint32_t tx_crc;
+static uint8_t tx_framing = FRAMING_INTRON;
+static cobs_encoder tx_cobs;
+
+static void IRAM_ATTR frame_flush() {
+    if (tx_header_len) {
+        uart_tx_send(tx_header, tx_header_len, NULL, 0, NULL, NULL);
+        tx_header_len = 0;
+    }
+}
+
+static void IRAM_ATTR frame_emit(const void *data, size_t len) {
+    if (tx_header_len + len > sizeof(tx_header)) {
+        frame_flush();
+    }
+    if (len > sizeof(tx_header)) {
+        uart_tx_send(data, len, NULL, 0, NULL, NULL);
+        return;
+    }
+    memcpy(tx_header + tx_header_len, data, len);
+    tx_header_len += len;
+}
+
+static void IRAM_ATTR frame_emit_cobs(void *ctx, const uint8_t *data, size_t len) {
+    frame_emit(data, len);
+}
+
+static void IRAM_ATTR frame_write(const void *data, size_t len) {
+    if (tx_crc_frame) {
+        tx_crc = uart_proto_crc32(tx_crc, data, len);
+    }
+    if (tx_framing == FRAMING_COBS) {
+        cobs_encode(&tx_cobs, data, len, frame_emit_cobs, NULL);
+    } else {
+        frame_emit(data, len);
+    }
+}
+
+/**
+ * @brief Write data that stay intact until done is called
+ *
+ * With FRAMING_INTRON the data are sent in place, following the bytes
+ * collected so far. COBS needs them encoded, so they are copied and released
+ * right away.
+ */
+static void IRAM_ATTR frame_write_ref(const void *data, size_t len, uart_tx_done done, void *arg) {
+    if (tx_crc_frame) {
+        tx_crc = uart_proto_crc32(tx_crc, data, len);
+    }
+    if (tx_framing == FRAMING_COBS) {
+        cobs_encode(&tx_cobs, data, len, frame_emit_cobs, NULL);
+        done(arg);
+    } else {
+        uart_tx_send(tx_header, tx_header_len, data, len, done, arg);
+        tx_header_len = 0;
+    }
+}
+
+static void IRAM_ATTR frame_begin(uint8_t type) {
+    if (tx_framing == FRAMING_COBS) {
+        cobs_encode_begin(&tx_cobs);
+    } else {
+        memcpy(tx_header, intron, sizeof(intron));
+        tx_header_len = sizeof(intron);
+    }
+    tx_crc_frame = features & FEATURE_CRC;
+    tx_crc = 0;
+    if (tx_crc_frame) {
+        type |= MSG_CRC_FLAG;
+    }
+    frame_write(&type, sizeof(type));
+}
+
+static void IRAM_ATTR frame_end() {
+    if (tx_crc_frame) {
+        tx_crc_frame = false;
+        frame_write(&tx_crc, sizeof(tx_crc));
+    }
+    if (tx_framing == FRAMING_COBS) {
+        cobs_encode_end(&tx_cobs, frame_emit_cobs, NULL);
+    }
+    frame_flush();
+}
+
+// Requests of other tasks to send a control message. The UART TX thread is
+// the only one writing to UART, it sends these between frames, ahead of the
+// packets still waiting.
+typedef enum {
+    // arg: link up
+    TX_CTRL_LINK,
+    TX_CTRL_DEVINFO,
+    TX_CTRL_STATS,
+    TX_CTRL_CREDIT,
+    // arg: new framing, acknowledged in the old one
+    TX_CTRL_FRAMING,
+    // arg: new rate or 0, acknowledged at the old rate
+    TX_CTRL_SET_BAUD,
+    // arg: rate to return to, not acknowledged
+    TX_CTRL_RESTORE_BAUD,
+    // arg: token to echo
+    TX_CTRL_BAUD_PROBE,
+    // arg: CLIENTCONFIG_* action taken
+    TX_CTRL_CLIENTCONFIG_ACK,
+    // arg: records in scan_results, sent one per round between packets
+    TX_CTRL_SCAN_RESULTS,
+    // arg: SCAN_STATUS_* of a scan with no results
+    TX_CTRL_SCAN_DONE,
+    TX_CTRL_LINK_INFO,
+} tx_ctrl_type;
+
+typedef struct {
+    uint8_t type;
+    uint32_t arg;
+} tx_ctrl;
+
+#define TX_CTRL_QUEUE_LEN 8
+static QueueHandle_t tx_ctrl_queue = 0;
+
+/**
+ * @brief Request a control message
+ *
+ * @param wait How long to wait for room in the queue, 0 in the timer task
+ * @return bool Queued
+ */
+static bool post_ctrl_wait(uint8_t type, uint32_t arg, TickType_t wait) {
+    const tx_ctrl ctrl = { .type = type, .arg = arg };
+    if (!xQueueSendToBack(tx_ctrl_queue, &ctrl, wait)) {
+        return false;
+    }
+    // Wake the TX thread if it waits for packets
+    wifi_receive_buff *wakeup = NULL;
+    xQueueSendToFront(uart_tx_queue, &wakeup, 0);
+    return true;
+}
+
+static void post_ctrl(uint8_t type, uint32_t arg) {
+    post_ctrl_wait(type, arg, portMAX_DELAY);
 }
 
 static void send_link_status(uint8_t up) {
     ESP_LOGI(TAG, "Sending link status: %d", up);
-    xSemaphoreTake(uart_mtx, portMAX_DELAY);
-    uart_write_bytes(UART_NUM_0, intron, sizeof(intron));
-    const uint8_t t = MSG_LINK;
-    uart_write_bytes(UART_NUM_0, (const char*)&t, 1);
-    uart_write_bytes(UART_NUM_0, (const char*)&up, sizeof(uint8_t));
-    xSemaphoreGive(uart_mtx);
+    frame_begin(MSG_LINK);
+    frame_write(&up, sizeof(uint8_t));
+    frame_end();
+}
+
+static void post_link_status(uint8_t up) {
+    post_ctrl(TX_CTRL_LINK, up);
+}
+
+/**
+ * @brief Take the driver for a scan
+ *
+ * @return bool Nobody else scans, the scan may start
+ */
+static bool scan_claim(scan_owner_t owner) {
+    const TickType_t now = xTaskGetTickCount();
+    bool claimed = false;
+    portENTER_CRITICAL();
+    if (scan_owner == SCAN_OWNER_NONE || now - scan_claimed > pdMS_TO_TICKS(SCAN_STALE_MS)) {
+        scan_owner = owner;
+        scan_claimed = now;
+        claimed = true;
+    }
+    portEXIT_CRITICAL();
+    return claimed;
+}
+
+/**
+ * @brief Account a finished link probe
+ *
+ * Called by whichever task finishes the probe, only one is ever running.
+ *
+ * @param outcome STAT_PROBE_ARP_OK, STAT_PROBE_SCAN_OK or STAT_PROBE_FAILED
+ */
+static void probe_done(size_t outcome) {
+    const uint32_t ms = ((uint32_t)esp_timer_get_time() - probe_started_us) / 1000;
+    stats[outcome]++;
+    stats[STAT_PROBE_LAST_MS] = ms;
+    if (ms > stats[STAT_PROBE_MAX_MS]) {
+        stats[STAT_PROBE_MAX_MS] = ms;
+    }
+    probe_in_progress = false;
 }
 
 static void probe_task() {
     wifi_scan_config_t config;
+    wifi_ap_record_t ap_info;
 
-    // We need to do full scan, because the ssid/bssid filters don't work
+    // A scan of the host doesn't stay on our channel, let it finish
+    while (!scan_claim(SCAN_OWNER_PROBE)) {
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+
+    // We need to scan for all the APs, because the ssid/bssid filters don't
+    // work. Just on the channel of ours, keeping the radio there.
     config.ssid = NULL;
     config.bssid = NULL;
-    config.channel = 0;
+    config.channel = esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK ? ap_info.primary : 0;
     config.show_hidden = true;
     config.scan_type = WIFI_SCAN_TYPE_ACTIVE;
     config.scan_time.active.min = 120;
     config.scan_time.active.max = 300;
-    ESP_ERROR_CHECK(esp_wifi_scan_start(&config, false));
+    if (esp_wifi_scan_start(&config, false) != ESP_OK) {
+        // Left the AP meanwhile, the disconnect is handled on its own
+        scan_owner = SCAN_OWNER_NONE;
+        probe_done(STAT_PROBE_FAILED);
+    }
 
     vTaskDelete(NULL);
 }
@@ -176,6 +528,222 @@ static void probe_run() {
     xTaskCreate(&probe_task, "probe", 1024, NULL, tskIDLE_PRIORITY + 1, NULL);
 }
 
+/**
+ * @brief Fill in the WiFi config for the last credentials
+ *
+ * @param cached Go straight to the AP remembered for the network, if any
+ * @return bool The config uses the remembered AP
+ */
+static bool sta_config(wifi_config_t *wifi_config, bool cached) {
+    memset(wifi_config, 0, sizeof(wifi_config_t));
+    memcpy(wifi_config->sta.ssid, client_ssid, client_ssid_len);
+    memcpy(wifi_config->sta.password, client_pass, client_pass_len);
+
+    /* Setting a password implies station will connect to all security modes including WEP/WPA.
+        * However these modes are deprecated and not advisable to be used. Incase your Access point
+        * doesn't support WPA2, these mode can be enabled by commenting below line */
+    if (client_pass_len) {
+        wifi_config->sta.threshold.authmode = WIFI_AUTH_WPA2_PSK;
+    }
+
+    ap_cache_entry entry;
+    if (!cached || !ap_cache_load(client_ssid, client_ssid_len, client_pass, client_pass_len, &entry)) {
+        return false;
+    }
+    wifi_config->sta.bssid_set = true;
+    memcpy(wifi_config->sta.bssid, entry.bssid, sizeof(entry.bssid));
+    wifi_config->sta.channel = entry.channel;
+    if (entry.has_pmk) {
+        // 64 hex digits are taken for the PSK itself
+        static const char digits[] = "0123456789abcdef";
+        for (size_t i = 0; i < AP_CACHE_PMK_LEN; ++i) {
+            wifi_config->sta.password[2 * i] = digits[entry.pmk[i] >> 4];
+            wifi_config->sta.password[2 * i + 1] = digits[entry.pmk[i] & 0x0F];
+        }
+    }
+    return true;
+}
+
+typedef struct {
+    uint8_t ssid[SSID_MAX_LEN];
+    uint8_t ssid_len;
+    uint8_t pass[PASS_MAX_LEN];
+    uint8_t pass_len;
+    uint8_t bssid[MAC_LEN];
+    uint8_t channel;
+} ap_cache_job;
+
+static void ap_cache_task(void *arg) {
+    ap_cache_job *job = arg;
+    ap_cache_store(job->ssid, job->ssid_len, job->pass, job->pass_len, job->bssid, job->channel);
+    free(job);
+    vTaskDelete(NULL);
+}
+
+// Remember the AP connected to, the PMK derivation runs in the background
+static void ap_cache_remember(const wifi_event_sta_connected_t *connected) {
+    // Back at the AP remembered already, as when the cache was not used for
+    // the connection, no need to derive the PMK and write the flash again
+    ap_cache_entry entry;
+    if (ap_cache_load(client_ssid, client_ssid_len, client_pass, client_pass_len, &entry)
+            && memcmp(entry.bssid, connected->bssid, MAC_LEN) == 0 && entry.channel == connected->channel) {
+        return;
+    }
+    ap_cache_job *job = malloc(sizeof(ap_cache_job));
+    if (!job) {
+        return;
+    }
+    memcpy(job->ssid, client_ssid, client_ssid_len);
+    job->ssid_len = client_ssid_len;
+    memcpy(job->pass, client_pass, client_pass_len);
+    job->pass_len = client_pass_len;
+    memcpy(job->bssid, connected->bssid, MAC_LEN);
+    job->channel = connected->channel;
+    if (xTaskCreate(&ap_cache_task, "ap_cache", 2048, job, tskIDLE_PRIORITY + 1, NULL) != pdPASS) {
+        free(job);
+    }
+}
+
+static void probe_scan_done(const wifi_event_sta_scan_done_t *scan_data) {
+    scan_owner = SCAN_OWNER_NONE;
+
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+        // Left the AP meanwhile, the disconnect is handled on its own
+        probe_done(STAT_PROBE_FAILED);
+        return;
+    }
+
+    uint16_t ap_count = scan_data->number;
+
+    bool found = false;
+    if (!scan_data->status && ap_count) {
+        wifi_ap_record_t *aps = (wifi_ap_record_t *)malloc(sizeof(wifi_ap_record_t) * ap_count);
+        ESP_ERROR_CHECK(esp_wifi_scan_get_ap_records(&ap_count, aps));
+        // Try to match BSSID first and if that fails go on and try SSID match . The BSSD check
+        // should be sufficient, but there are APs that advertise mismatching BSSID in their
+        // beacons and/or probe rensonse. That's the real culprit of the beacon timeout
+        // disconnects and the primary motivation of this whole excercise.
+        for (int i = 0; i < ap_count; ++i) {
+            if (0 == memcmp(ap_info.bssid, aps[i].bssid, 6)) {
+                found = true;
+                beacon_quirk = false;
+                break;
+            }
+        }
+        if (beacon_quirk && !found) {
+            for (int i = 0; i < ap_count; ++i) {
+                if (ap_info.ssid && ap_info.ssid[0] && aps[i].ssid && aps[i].ssid[0]) {
+                    if (0 == strncmp((char *)(ap_info.ssid), (char *)(aps[i].ssid), 32)) {
+                        found = true;
+                        break;
+                    }
+                }
+            }
+        }
+        free(aps);
+    }
+    if (!found){
+        if (probe_retry_count++ < probe_max_reties) {
+            probe_run();
+        } else {
+            post_link_status(0);
+            probe_done(STAT_PROBE_FAILED);
+        }
+    } else {
+        last_inbound_seen = now_seconds();
+        probe_done(STAT_PROBE_SCAN_OK);
+    }
+}
+
+static bool scan_ssid_matches(const wifi_ap_record_t *ap) {
+    return !scan_ssid_len || strncmp((const char *)ap->ssid, (const char *)scan_ssid, sizeof(ap->ssid)) == 0;
+}
+
+// Hand the records over to the TX thread, without a buffer for all the APs
+static void host_scan_done(const wifi_event_sta_scan_done_t *scan_data) {
+    uint16_t count = CONFIG_UART_NIC_SCAN_RESULTS_MAX;
+    // Frees the records over count
+    if (scan_data->status || esp_wifi_scan_get_ap_records(&count, scan_results) != ESP_OK) {
+        scan_owner = SCAN_OWNER_NONE;
+        post_ctrl(TX_CTRL_SCAN_DONE, SCAN_STATUS_FAILED);
+        return;
+    }
+    // The driver may ignore the SSID filter, as it does for the probe
+    uint16_t matching = 0;
+    for (uint16_t i = 0; i < count; ++i) {
+        if (scan_ssid_matches(&scan_results[i])) {
+            scan_results[matching++] = scan_results[i];
+        }
+    }
+    post_ctrl(TX_CTRL_SCAN_RESULTS, matching);
+}
+
+static void roam_to(const wifi_ap_record_t *ap) {
+    ESP_LOGI(TAG, "Roaming to AP on channel %d, rssi %d", ap->primary, ap->rssi);
+    // The PMK is the same for the whole network, no need to derive it again
+    wifi_config_t wifi_config;
+    sta_config(&wifi_config, true);
+    wifi_config.sta.bssid_set = true;
+    memcpy(wifi_config.sta.bssid, ap->bssid, MAC_LEN);
+    wifi_config.sta.channel = ap->primary;
+    if (esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config) != ESP_OK) {
+        return;
+    }
+    // Falls back to any AP of the network on failure, as a fast connect
+    fast_connect = true;
+    roam_started_us = esp_timer_get_time();
+    roaming = true;
+    stats[STAT_ROAMS]++;
+    // Connects again on the disconnection event
+    esp_wifi_disconnect();
+}
+
+// Scan the next channel for other APs of the network
+static void roam_scan_start() {
+    if (!associated || roaming || !scan_claim(SCAN_OWNER_ROAM)) {
+        return;
+    }
+    roam_channel = roam_channel % ROAM_CHANNELS + 1;
+    memcpy(scan_ssid, client_ssid, client_ssid_len);
+    scan_ssid[client_ssid_len] = 0;
+    scan_ssid_len = client_ssid_len;
+
+    wifi_scan_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.ssid = scan_ssid;
+    config.channel = roam_channel;
+    config.scan_type = WIFI_SCAN_TYPE_ACTIVE;
+    config.scan_time.active.min = 50;
+    config.scan_time.active.max = 120;
+    if (esp_wifi_scan_start(&config, false) != ESP_OK) {
+        scan_owner = SCAN_OWNER_NONE;
+        return;
+    }
+    stats[STAT_ROAM_SCANS]++;
+}
+
+// Pick the strongest other AP of the network, if strong enough
+static void roam_scan_done(const wifi_event_sta_scan_done_t *scan_data) {
+    uint16_t count = CONFIG_UART_NIC_SCAN_RESULTS_MAX;
+    wifi_ap_record_t ap_info;
+    if (!scan_data->status && esp_wifi_scan_get_ap_records(&count, scan_results) == ESP_OK
+            && associated && esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
+        const wifi_ap_record_t *best = NULL;
+        for (uint16_t i = 0; i < count; ++i) {
+            const wifi_ap_record_t *ap = &scan_results[i];
+            if (scan_ssid_matches(ap) && memcmp(ap->bssid, ap_info.bssid, MAC_LEN) != 0
+                    && ap->rssi >= ap_info.rssi + ROAM_MARGIN && (!best || ap->rssi > best->rssi)) {
+                best = ap;
+            }
+        }
+        if (best) {
+            roam_to(best);
+        }
+    }
+    scan_owner = SCAN_OWNER_NONE;
+}
+
 static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
         uint8_t current_protocol;
@@ -187,7 +755,29 @@ static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_
         esp_wifi_connect();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
         associated = false;
-        send_link_status(0);
+        const wifi_event_sta_disconnected_t *disconnected = event_data;
+        // Leaving on our own, as when reconfiguring, doesn't tell anything
+        // about the AP
+        if (roaming && disconnected->reason != WIFI_REASON_ASSOC_LEAVE) {
+            roaming = false;
+            stats[STAT_ROAM_FAILS]++;
+        }
+        // Leaving the old AP when roaming, the host would reconfigure WiFi
+        // if it saw the link down
+        if (!roaming) {
+            post_link_status(0);
+        }
+        if (fast_connect && disconnected->reason != WIFI_REASON_ASSOC_LEAVE) {
+            // The AP may have moved, look for it from now on
+            fast_connect = false;
+            if (connecting) {
+                stats[STAT_FAST_CONNECT_FAILS]++;
+                ap_cache_forget(client_ssid, client_ssid_len);
+            }
+            wifi_config_t wifi_config;
+            sta_config(&wifi_config, false);
+            esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
+        }
         if (s_retry_num < CONFIG_ESP_MAXIMUM_RETRY) {
             esp_wifi_connect();
             s_retry_num++;
@@ -196,84 +786,143 @@ static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_
         ESP_LOGI(TAG,"connect to the AP fail");
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
         last_inbound_seen = now_seconds();
+        associated_since = now_seconds();
         associated = true;
         beacon_quirk = true;
-        send_link_status(1);
+        post_link_status(1);
         s_retry_num = 0;
+        if (connecting) {
+            connecting = false;
+            link_time_ms = ((uint32_t)esp_timer_get_time() - connect_started_us) / 1000;
+            stats[STAT_LINK_TIME_MS] = link_time_ms;
+            ESP_LOGI(TAG, "Connected in %d ms", link_time_ms);
+        }
+        if (roaming) {
+            roaming = false;
+            stats[STAT_ROAM_LAST_MS] = ((uint32_t)esp_timer_get_time() - roam_started_us) / 1000;
+            ap_cache_remember(event_data);
+        } else if (fast_connect) {
+            stats[STAT_FAST_CONNECTS]++;
+        } else {
+            ap_cache_remember(event_data);
+        }
         ESP_ERROR_CHECK(esp_wifi_set_inactive_time(ESP_IF_WIFI_STA, INACTIVE_BEACON_SECONDS));
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_SCAN_DONE) {
-        wifi_ap_record_t ap_info;
-        ESP_ERROR_CHECK(esp_wifi_sta_get_ap_info(&ap_info));
-
         const wifi_event_sta_scan_done_t *scan_data = (const wifi_event_sta_scan_done_t *)event_data;
-        uint16_t ap_count = scan_data->number;
-
-        bool found = false;
-        if (!scan_data->status && ap_count) {
-            wifi_ap_record_t *aps = (wifi_ap_record_t *)malloc(sizeof(wifi_ap_record_t) * ap_count);
-            ESP_ERROR_CHECK(esp_wifi_scan_get_ap_records(&ap_count, aps));
-            // Try to match BSSID first and if that fails go on and try SSID match . The BSSD check
-            // should be sufficient, but there are APs that advertise mismatching BSSID in their
-            // beacons and/or probe rensonse. That's the real culprit of the beacon timeout
-            // disconnects and the primary motivation of this whole excercise.
-            for (int i = 0; i < ap_count; ++i) {
-                if (0 == memcmp(ap_info.bssid, aps[i].bssid, 6)) {
-                    found = true;
-                    beacon_quirk = false;
-                    break;
-                }
-            }
-            if (beacon_quirk && !found) {
-                for (int i = 0; i < ap_count; ++i) {
-                    if (ap_info.ssid && ap_info.ssid[0] && aps[i].ssid && aps[i].ssid[0]) {
-                        if (0 == strncmp((char *)(ap_info.ssid), (char *)(aps[i].ssid), 32)) {
-                            found = true;
-                            break;
-                        }
-                    }
-                }
-            }
-            free(aps);
-        }
-        if (!found){
-            if (probe_retry_count++ < probe_max_reties) {
-                probe_run();
-            } else {
-                send_link_status(0);
-                probe_in_progress = false;
-            }
+        if (scan_owner == SCAN_OWNER_HOST) {
+            host_scan_done(scan_data);
+        } else if (scan_owner == SCAN_OWNER_ROAM) {
+            roam_scan_done(scan_data);
         } else {
-            probe_in_progress = false;
-            last_inbound_seen = now_seconds();
+            probe_scan_done(scan_data);
         }
-   }
+    } else if (event_base == UART_NIC_EVENT && event_id == UART_NIC_EVENT_ROAM_SCAN) {
+        roam_scan_start();
+    }
+}
+
+// Check a group address against the multicast filter, in bounded time
+static bool IRAM_ATTR mcast_accepted(const uint8_t *addr) {
+    static const uint8_t broadcast[MAC_LEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    if ((mcast.flags & MCAST_ACCEPT_ALL) || memcmp(addr, broadcast, MAC_LEN) == 0) {
+        return true;
+    }
+    for (size_t i = 0; i < mcast.count; ++i) {
+        if (memcmp(addr, mcast.addrs[i], MAC_LEN) == 0) {
+            return true;
+        }
+    }
+    const uint8_t bit = uart_proto_crc32(0, addr, MAC_LEN) >> 26;
+    return mcast.hash[bit / 8] & (1 << (bit % 8));
 }
 
 static int IRAM_ATTR wifi_receive_cb(void *buffer, uint16_t len, void *eb) {
     // Seeing some traffic - we have signal :-)
     last_inbound_seen = now_seconds();
+    const uint32_t now_us = esp_timer_get_time();
+    last_inbound_us = now_us;
+
+    // MAC filter, the group bit is the lowest bit of the first octet
+    const uint8_t *dst = buffer;
+    if ((dst[0] & 0x01) == 0) {
+        if (memcmp(dst, mac, MAC_LEN) != 0) {
+            stats[STAT_INGRESS_FILTERED]++;
+            goto cleanup;
+        }
+    } else if (!mcast_accepted(dst)) {
+        stats[STAT_MCAST_FILTERED]++;
+        goto cleanup;
+    } else {
+        uint8_t storm;
+        if (!storm_limit_pass(&storm_limits, dst, len, now_us, &storm)) {
+            stats[STAT_STORM_DROPS + storm]++;
+            goto cleanup;
+        }
+    }
 
-    // MAC filter
-    if ((((const char*)buffer)[5] & 0x01) == 0) {
-        for (uint i = 0; i < 6; ++i) {
-            if(((const char*)buffer)[i] != mac[i]) {
-                goto cleanup;
-            }
+    if (gateway_set) {
+        const uint8_t *sender = arp_sender(buffer, len, gateway_ip);
+        if (sender) {
+            memcpy(gateway_mac, sender, MAC_LEN);
+            gateway_mac_known = true;
         }
     }
 
-    wifi_receive_buff *buff = malloc(sizeof(wifi_receive_buff));
-    if(!buff) {
+    uint8_t reply[ARP_FRAME_LEN];
+    switch (arp_respond(&arp_ips, mac, buffer, len, reply)) {
+    case ARP_REPLY:
+        if (arp_reply.pending) {
+            break;
+        }
+        memcpy(arp_reply.frame, reply, sizeof(arp_reply.frame));
+        arp_reply.pending = true;
+        wifi_send_buff *wakeup = NULL;
+        xQueueSendToFront(wifi_egress_queue, &wakeup, 0);
         goto cleanup;
+    case ARP_DROP:
+        stats[STAT_ARP_FILTERED]++;
+        goto cleanup;
+    case ARP_PASS:
+        break;
+    }
+
+    const pkt_class cls = pkt_classify(buffer, len);
+    if (cls == PKT_CLASS_BULK && wifi_receive_buff_pool.free_count <= PRIORITY_RESERVE) {
+        goto drop;
+    }
+
+    wifi_receive_buff *buff = buf_pool_alloc(&wifi_receive_buff_pool);
+    if(!buff) {
+        goto drop;
     }
     buff->len = len;
     buff->data = buffer;
     buff->rx_buff = eb;
-    if (!xQueueSendToBack(uart_tx_queue, (void *)&buff, (TickType_t)0/*portMAX_DELAY*/)) {
-        free_wifi_receive_buff(buff);
+    buff->queued_us = now_us;
+    if (cls == PKT_CLASS_BULK) {
+        // Counted before the TX thread can take it
+        bulk_enqueued++;
+        if (!xQueueSendToBack(uart_tx_queue, (void *)&buff, (TickType_t)0/*portMAX_DELAY*/)) {
+            bulk_enqueued--;
+            stats[STAT_INGRESS_QUEUE_DROPS]++;
+            stats[STAT_INGRESS_CLASS_DROPS + cls]++;
+            free_wifi_receive_buff(buff);
+        }
+    } else {
+        if (!xQueueSendToBack(uart_prio_queue[cls], (void *)&buff, 0)) {
+            stats[STAT_INGRESS_QUEUE_DROPS]++;
+            stats[STAT_INGRESS_CLASS_DROPS + cls]++;
+            free_wifi_receive_buff(buff);
+            return 0;
+        }
+        // The TX thread may be waiting for the bulk queue
+        wifi_receive_buff *wakeup = NULL;
+        xQueueSendToFront(uart_tx_queue, &wakeup, 0);
     }
     return 0;
 
+drop:
+    stats[STAT_INGRESS_CLASS_DROPS + cls]++;
 cleanup:
     esp_wifi_internal_free_rx_buffer(eb);
     free(buffer);
@@ -288,156 +937,417 @@ void wifi_init_sta(void) {
     ESP_ERROR_CHECK(esp_wifi_init_internal(&cfg));
     ESP_ERROR_CHECK(esp_supplicant_init());
     ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(UART_NIC_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
     ESP_ERROR_CHECK(esp_wifi_internal_reg_rxcb(ESP_IF_WIFI_STA, wifi_receive_cb));
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
 }
 
 static void send_device_info() {
     ESP_LOGI(TAG, "Sending device info");
-    xSemaphoreTake(uart_mtx, portMAX_DELAY);
 
-    // Intron
-    uart_write_bytes(UART_NUM_0, intron, sizeof(intron));
-
-    // Definfo mesage identifier
-    const uint8_t t = MSG_DEVINFO;
-    uart_write_bytes(UART_NUM_0, (const char*)&t, 1);
+    frame_begin(MSG_DEVINFO);
 
     // FW version
-    uart_write_bytes(UART_NUM_0, (const char*)&FW_VERSION, sizeof(FW_VERSION));
+    frame_write(&FW_VERSION, sizeof(FW_VERSION));
 
     // MAC address
     int ret = esp_wifi_get_mac(WIFI_IF_STA, mac);
     if(ret != ESP_OK) {
         ESP_LOGI(TAG, "Failed to obtain MAC, returning last one or zeroes");
     }
-    uart_write_bytes(UART_NUM_0, (const char*)mac, sizeof(mac));
+    frame_write(mac, sizeof(mac));
+
+    // Features the host may enable
+    frame_write(&SUPPORTED_FEATURES, sizeof(SUPPORTED_FEATURES));
+
+    const uint32_t link_time = link_time_ms;
+    frame_write(&link_time, sizeof(link_time));
 
-    xSemaphoreGive(uart_mtx);
+    frame_end();
 }
 
-static void IRAM_ATTR wait_for_intron() {
-    // ESP_LOGI(TAG, "Waiting for intron");
-    uint pos = 0;
-    while(pos < sizeof(intron)) {
-        char c;
-        int read = uart_read_bytes(UART_NUM_0, (uint8_t*)&c, 1, portMAX_DELAY);
-        if(read == 1) {
-            if (c == intron[pos]) {
-                pos++;
-            } else {
-                //ESP_LOGI(TAG, "Invalid: %c, val: %d\n", c, (int)c);
-                pos = 0;
-            }
+static void send_stats() {
+    stats[STAT_CRC_ERRORS] = rx_parser.crc_errors;
+    stats[STAT_COBS_FRAME_ERRORS] = rx_parser.frame_errors;
+    stats[STAT_EGRESS_POOL_EXHAUSTED] = wifi_send_buff_pool.exhausted;
+    stats[STAT_INGRESS_POOL_EXHAUSTED] = wifi_receive_buff_pool.exhausted;
+    stats[STAT_INTRON_RESYNCS] = rx_parser.resyncs;
+    stats[STAT_EGRESS_BUFFERS_HIGH] = wifi_send_buff_pool.count - wifi_send_buff_pool.low_water;
+    stats[STAT_INGRESS_BUFFERS_HIGH] = wifi_receive_buff_pool.count - wifi_receive_buff_pool.low_water;
+
+    frame_begin(MSG_STATS);
+    const uint8_t count = STAT_COUNT;
+    frame_write(&count, sizeof(count));
+    frame_write(stats, sizeof(stats));
+    frame_end();
+}
+
+static uint8_t *IRAM_ATTR packet_begin(void *ctx, uint32_t size) {
+    // ESP_LOGI(TAG, "Receiving packet size: %d", size);
+    // Used a credit whatever happens to it
+    credit_accept(&egress_credit);
+    if (size > sizeof(((wifi_send_buff *)NULL)->data)) {
+        ESP_LOGI(TAG, "Packet does not fit the buffer: %d", size);
+        // Valid for the protocol, still too big for this configuration
+        stats[STAT_INVALID_PACKET_SIZE]++;
+        return NULL;
+    }
+    wifi_send_buff *buff = buf_pool_alloc(&wifi_send_buff_pool);
+    if(!buff) {
+        ESP_LOGI(TAG, "Out of packet buffers");
+        return NULL;
+    }
+    buff->len = size;
+    // The data buffer is handed back in packet_end, remember its descriptor
+    *(wifi_send_buff **)ctx = buff;
+    return buff->data;
+}
+
+static void IRAM_ATTR packet_abort(void *ctx, uint8_t *data) {
+    ESP_LOGI(TAG, "Dropping corrupted packet");
+    free_wifi_send_buff(*(wifi_send_buff **)ctx);
+    *(wifi_send_buff **)ctx = NULL;
+}
+
+static void IRAM_ATTR packet_end(void *ctx, uint8_t *data, uint32_t size) {
+    wifi_send_buff *buff = *(wifi_send_buff **)ctx;
+    *(wifi_send_buff **)ctx = NULL;
+
+    if (!xQueueSendToBack(wifi_egress_queue, (void *)&buff, (TickType_t)0/*portMAX_DELAY*/)) {
+        ESP_LOGI(TAG, "Out of space in egress queue");
+        stats[STAT_EGRESS_QUEUE_DROPS]++;
+        free_wifi_send_buff(buff);
+    }
+}
+
+static void packet_invalid(void *ctx, uint32_t size) {
+    ESP_LOGI(TAG, "Invalid packet size: %d", size);
+    stats[STAT_INVALID_PACKET_SIZE]++;
+    credit_accept(&egress_credit);
+}
+
+static void send_client_config_ack(uint8_t action) {
+    frame_begin(MSG_CLIENTCONFIG_ACK);
+    frame_write(&action, sizeof(action));
+    frame_end();
+}
+
+static void scan_start(void *ctx, uint8_t channel, uint8_t flags, uint16_t dwell_min, uint16_t dwell_max, const uint8_t *ssid, uint8_t ssid_len) {
+    if (!scan_claim(SCAN_OWNER_HOST)) {
+        post_ctrl(TX_CTRL_SCAN_DONE, SCAN_STATUS_BUSY);
+        return;
+    }
+    memcpy(scan_ssid, ssid, ssid_len);
+    scan_ssid[ssid_len] = 0;
+    scan_ssid_len = ssid_len;
+
+    wifi_scan_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.ssid = ssid_len ? scan_ssid : NULL;
+    config.channel = channel;
+    config.show_hidden = flags & SCAN_SHOW_HIDDEN;
+    dwell_min = dwell_min < SCAN_DWELL_MAX_MS ? dwell_min : SCAN_DWELL_MAX_MS;
+    dwell_max = dwell_max < SCAN_DWELL_MAX_MS ? dwell_max : SCAN_DWELL_MAX_MS;
+    if (flags & SCAN_PASSIVE) {
+        config.scan_type = WIFI_SCAN_TYPE_PASSIVE;
+        config.scan_time.passive = dwell_max;
+    } else {
+        config.scan_type = WIFI_SCAN_TYPE_ACTIVE;
+        config.scan_time.active.min = dwell_min;
+        config.scan_time.active.max = dwell_max;
+    }
+    // Returns right away, packets keep flowing between the channels
+    if (esp_wifi_scan_start(&config, false) != ESP_OK) {
+        ESP_LOGI(TAG, "Scan failed to start");
+        scan_owner = SCAN_OWNER_NONE;
+        post_ctrl(TX_CTRL_SCAN_DONE, SCAN_STATUS_FAILED);
+    }
+}
+
+static void send_scan_result(const wifi_ap_record_t *ap) {
+    const uint8_t ssid_len = strnlen((const char *)ap->ssid, SSID_MAX_LEN);
+    const uint8_t info[] = { ap->primary, (uint8_t)ap->rssi, ap->authmode, ssid_len };
+    frame_begin(MSG_SCAN_RESULT);
+    frame_write(ap->bssid, sizeof(ap->bssid));
+    frame_write(info, sizeof(info));
+    frame_write(ap->ssid, ssid_len);
+    frame_end();
+}
+
+static void send_scan_done(uint8_t status, uint8_t count) {
+    const uint8_t body[] = { status, count };
+    frame_begin(MSG_SCAN_DONE);
+    frame_write(body, sizeof(body));
+    frame_end();
+}
+
+// Owned by the TX thread, the records of the scan of the host being sent
+static uint8_t tx_scan_count = 0;
+static uint8_t tx_scan_sent = 0;
+
+// Send the next record, a long list doesn't hold up packets
+static void send_scan_results() {
+    if (tx_scan_sent == tx_scan_count) {
+        return;
+    }
+    send_scan_result(&scan_results[tx_scan_sent++]);
+    if (tx_scan_sent == tx_scan_count) {
+        send_scan_done(SCAN_STATUS_OK, tx_scan_count);
+        scan_owner = SCAN_OWNER_NONE;
+    }
+}
+
+static void client_config(void *ctx, const uint8_t *ssid, uint8_t ssid_len, const uint8_t *pass, uint8_t pass_len) {
+    ESP_LOGI(TAG, "Reading SSID len: %d", ssid_len);
+    ESP_LOGI(TAG, "Reading PASS len: %d", pass_len);
+
+    // Restarting would drop a working link for seconds
+    if (wifi_started
+            && ssid_len == client_ssid_len && memcmp(ssid, client_ssid, ssid_len) == 0
+            && pass_len == client_pass_len && memcmp(pass, client_pass, pass_len) == 0) {
+        if (associated) {
+            ESP_LOGI(TAG, "Wifi config unchanged");
+            post_ctrl(TX_CTRL_CLIENTCONFIG_ACK, CLIENTCONFIG_UNCHANGED);
         } else {
-            ESP_LOGI(TAG, "Timeout!!!");
+            ESP_LOGI(TAG, "Wifi config unchanged, reconnecting");
+            s_retry_num = 0;
+            esp_wifi_connect();
+            post_ctrl(TX_CTRL_CLIENTCONFIG_ACK, CLIENTCONFIG_RECONNECTING);
         }
+        return;
     }
-    // ESP_LOGI(TAG, "Intron found");
+
+    esp_wifi_stop();
+    memcpy(client_ssid, ssid, ssid_len);
+    client_ssid_len = ssid_len;
+    memcpy(client_pass, pass, pass_len);
+    client_pass_len = pass_len;
+
+    ESP_LOGI(TAG, "Reconfiguring wifi");
+    wifi_config_t wifi_config;
+    fast_connect = sta_config(&wifi_config, true);
+    ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config) );
+    connect_started_us = esp_timer_get_time();
+    connecting = true;
+    ESP_ERROR_CHECK(esp_wifi_start());
+    wifi_started = true;
+    post_ctrl(TX_CTRL_CLIENTCONFIG_ACK, CLIENTCONFIG_RESTARTED);
+    post_ctrl(TX_CTRL_DEVINFO, 0);
+}
+
+static void IRAM_ATTR new_intron(void *ctx, const uint8_t *new) {
+    memcpy(intron, new, sizeof(intron));
+}
+
+static void send_credit() {
+    const uint32_t limit = credit_limit(&egress_credit, wifi_send_buff_pool.free_count);
+    frame_begin(MSG_CREDIT);
+    frame_write(&limit, sizeof(limit));
+    frame_end();
+    credit_advertise(&egress_credit, limit);
 }
 
 /**
- * @brief Read data from UART
- * 
- * @param buff Buffer to store the data
- * @param len Number of bytes to read
- * @return size_t Number of bytes actually read
+ * @brief Tell the host about freed packet buffers, if worth it
  */
-static size_t IRAM_ATTR read_uart(uint8_t *buff, size_t len) {
-    size_t trr = 0;
-    while(trr < len) {
-        int read = uart_read_bytes(UART_NUM_0, ((uint8_t*)buff) + trr, len - trr, portMAX_DELAY);
-        if(read < 0) {
-            ESP_LOGI(TAG, "Failed to read from UART");
-            if(trr != len) {
-                ESP_LOGI(TAG, "Read %d != %d expected\n", trr, len);
-            }
-            return trr;
-        }
-        trr += read;
+static void IRAM_ATTR update_credit() {
+    if (!(features & FEATURE_CREDITS)) {
+        return;
+    }
+    if (credit_update_due(&egress_credit, wifi_send_buff_pool.free_count)) {
+        send_credit();
     }
-    return trr;
 }
 
-static void IRAM_ATTR read_packet_message() {
-    // ESP_LOGI(TAG, "Reading packet");
-    uint32_t size = 0;
+/**
+ * @brief Wake up the UART TX thread if the host waits for credit we have
+ */
+static void IRAM_ATTR credit_kick() {
+    if ((features & FEATURE_CREDITS) && credit_host_waiting(&egress_credit, wifi_send_buff_pool.free_count)) {
+        wifi_receive_buff *wakeup = NULL;
+        xQueueSendToFront(uart_tx_queue, &wakeup, 0);
+    }
+}
+
+static void set_features(void *ctx, uint32_t requested) {
+    ESP_LOGI(TAG, "Enabling features: %x", requested);
+    const uint32_t enabled = requested & SUPPORTED_FEATURES;
+    if (enabled & FEATURE_CREDITS) {
+        // The host starts counting from now
+        credit_sync(&egress_credit, 0);
+        features = enabled;
+        post_ctrl(TX_CTRL_CREDIT, 0);
+    } else {
+        features = enabled;
+    }
+}
 
-    read_uart((uint8_t*)&size, sizeof(size));
-    if(size > 2000) {
-        ESP_LOGI(TAG, "Invalid packet size: %d", size);
+static void credit_sync_host(void *ctx, uint32_t sent) {
+    if (!(features & FEATURE_CREDITS)) {
         return;
     }
-    // ESP_LOGI(TAG, "Receiving packet size: %d", size);
-    // ESP_LOGI(TAG, "Allocating pbuf size: %d, free heap: %d", size, esp_get_free_heap_size());
+    // Whatever the host sent before is parsed by now, what is missing got
+    // lost on the way
+    const uint32_t lost = credit_sync(&egress_credit, sent);
+    ESP_LOGI(TAG, "Credit sync, packet headers lost: %d", lost);
+    stats[STAT_EGRESS_LOST_HEADERS] += lost;
+    post_ctrl(TX_CTRL_CREDIT, 0);
+}
 
-    wifi_send_buff *buff = malloc(sizeof(wifi_send_buff));
-    if(!buff) {
-        goto nomem;
+static void set_framing(void *ctx, uint8_t framing) {
+    ESP_LOGI(TAG, "Switching framing: %d", framing);
+    post_ctrl(TX_CTRL_FRAMING, framing);
+}
+
+static void send_framing(uint8_t framing) {
+    // Acknowledge as the last message in the old framing
+    frame_begin(MSG_SET_FRAMING);
+    frame_write(&framing, sizeof(framing));
+    frame_end();
+    tx_framing = framing;
+    if (framing == FRAMING_COBS) {
+        // Delimiter to let the host synchronize
+        const uint8_t delimiter = 0;
+        frame_emit(&delimiter, sizeof(delimiter));
+        frame_flush();
     }
-    buff->len = size;
-    buff->data = malloc(buff->len);
-    if(!buff->data) {
-        free(buff);
-        goto nomem;
+}
+
+/**
+ * @brief CoDel target for the bulk queue drained at the baud rate
+ *
+ * 10 bits a byte with the start and stop bits.
+ */
+static uint32_t codel_target(uint32_t rate) {
+    if (!CONFIG_UART_NIC_CODEL_TARGET_US) {
+        return 0;
     }
+    const uint32_t frame_us = (uint64_t)CODEL_FRAME_BYTES * 10 * 1000000 / rate;
+    return frame_us > CONFIG_UART_NIC_CODEL_TARGET_US ? frame_us : CONFIG_UART_NIC_CODEL_TARGET_US;
+}
 
-    read_uart(buff->data, buff->len);
+/**
+ * @brief Change the rate of both directions
+ */
+static void switch_baud(uint32_t rate) {
+    // Let the last message go out at the old rate
+    uart_tx_wait_idle();
+    uart_wait_tx_done(UART_NUM_0, portMAX_DELAY);
+    uart_set_baudrate(UART_NUM_0, rate);
+    // Anything received meanwhile is garbage at one of the rates
+    uart_flush_input(UART_NUM_0);
+    codel_set_target(&ingress_codel, codel_target(rate));
+}
 
-    if (!xQueueSendToBack(wifi_egress_queue, (void *)&buff, (TickType_t)0/*portMAX_DELAY*/)) {
-        ESP_LOGI(TAG, "Out of space in egress queue");
-        free_wifi_send_buff(buff);
+static bool baud_supported(uint32_t rate) {
+    for (size_t i = 0; i < sizeof(baud_rates) / sizeof(baud_rates[0]); ++i) {
+        if (baud_rates[i] == rate) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void set_baud(void *ctx, uint32_t rate) {
+    ESP_LOGI(TAG, "Switching baud rate: %d", rate);
+    if (!baud_supported(rate)) {
+        rate = 0;
+    }
+    if (rate) {
+        if (!baud_previous) {
+            baud_previous = baud_rate;
+        }
+        baud_rate = rate;
+        baud_deadline = xTaskGetTickCount() + pdMS_TO_TICKS(BAUD_FALLBACK_MS);
+        // Including this one
+        baud_messages = rx_parser.messages;
     }
-    return;
+    post_ctrl(TX_CTRL_SET_BAUD, rate);
+}
 
-nomem:
-    ESP_LOGI(TAG, "Out of mem for packet data");
-    for(uint i = 0; i < size; ++i) {
-        uint8_t c;
-        read_uart(&c, 1);
+static void send_baud(uint32_t rate) {
+    // Acknowledge as the last message at the old rate
+    frame_begin(MSG_SET_BAUD);
+    frame_write(&rate, sizeof(rate));
+    frame_end();
+    if (rate) {
+        switch_baud(rate);
     }
-    return;
 }
 
-static void read_wifi_client_message() {
-    wifi_config_t wifi_config;
-    memset(&wifi_config, 0, sizeof(wifi_config_t));
+static void baud_probe(void *ctx, uint32_t token) {
+    // Probes don't confirm the new rate
+    baud_messages++;
+    post_ctrl(TX_CTRL_BAUD_PROBE, token);
+}
 
-    uint8_t ssid_len = 0;
-    read_uart(&ssid_len, 1);
-    ESP_LOGI(TAG, "Reading SSID len: %d", ssid_len);
-    if(ssid_len > sizeof(wifi_config.sta.ssid)) {
-        ESP_LOGI(TAG, "SSID too long, trimming");
-        ssid_len = sizeof(wifi_config.sta.ssid);
-    }
-    read_uart(wifi_config.sta.ssid, ssid_len);
+static void send_baud_probe(uint32_t token) {
+    frame_begin(MSG_BAUD_PROBE);
+    frame_write(&token, sizeof(token));
+    frame_end();
+}
 
-    uint8_t pass_len = 0;
-    read_uart(&pass_len, 1);
-    ESP_LOGI(TAG, "Reading PASS len: %d", pass_len);
-    if(pass_len > sizeof(wifi_config.sta.password)) {
-        ESP_LOGI(TAG, "PASS too long, trimming");
-        pass_len = sizeof(wifi_config.sta.password);
+/**
+ * @brief Keep or revert a baud rate switch waiting for confirmation
+ *
+ * @return TickType_t How long the RX thread may sleep before checking again
+ */
+static TickType_t check_baud() {
+    if (!baud_previous) {
+        return portMAX_DELAY;
+    }
+    if (rx_parser.messages != baud_messages) {
+        ESP_LOGI(TAG, "Baud rate confirmed: %d", baud_rate);
+        baud_previous = 0;
+        return portMAX_DELAY;
     }
-    read_uart(wifi_config.sta.password, pass_len);
+    const TickType_t left = baud_deadline - xTaskGetTickCount();
+    if ((int32_t)left > 0) {
+        return left;
+    }
+    ESP_LOGI(TAG, "Baud rate not confirmed, returning to: %d", baud_previous);
+    post_ctrl(TX_CTRL_RESTORE_BAUD, baud_previous);
+    baud_rate = baud_previous;
+    baud_previous = 0;
+    return portMAX_DELAY;
+}
 
-    ESP_LOGI(TAG, "Reconfiguring wifi");
+static void set_mcast_filter(void *ctx, const mcast_filter *filter) {
+    portENTER_CRITICAL();
+    mcast = *filter;
+    portEXIT_CRITICAL();
+    ESP_LOGI(TAG, "Multicast filter: flags %#x, %d addresses", filter->flags, filter->count);
+}
 
-    /* Setting a password implies station will connect to all security modes including WEP/WPA.
-        * However these modes are deprecated and not advisable to be used. Incase your Access point
-        * doesn't support WPA2, these mode can be enabled by commenting below line */
-    if (strlen((char *)wifi_config.sta.password)) {
-        wifi_config.sta.threshold.authmode = WIFI_AUTH_WPA2_PSK;
+static void set_arp_offload(void *ctx, const arp_offload *offload) {
+    portENTER_CRITICAL();
+    arp_ips = *offload;
+    portEXIT_CRITICAL();
+    ESP_LOGI(TAG, "ARP offload: %d addresses", offload->count);
+}
+
+static void set_storm_limit(void *ctx, uint8_t cls, uint16_t rate, uint16_t burst) {
+    if (cls >= STORM_CLASSES) {
+        return;
     }
+    portENTER_CRITICAL();
+    storm_limit_set(&storm_limits, cls, rate, burst, esp_timer_get_time());
+    portEXIT_CRITICAL();
+    ESP_LOGI(TAG, "Storm limit of class %d: %d/s, burst %d", cls, rate, burst);
+}
 
-    esp_wifi_stop();
-    ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config) );
-    ESP_ERROR_CHECK(esp_wifi_start());
-    send_device_info();
+static void set_gateway(void *ctx, const uint8_t *ip) {
+    static const uint8_t no_ip[4] = {0};
+    portENTER_CRITICAL();
+    memcpy(gateway_ip, ip, sizeof(gateway_ip));
+    gateway_mac_known = false;
+    gateway_set = memcmp(ip, no_ip, sizeof(no_ip)) != 0;
+    portEXIT_CRITICAL();
+    ESP_LOGI(TAG, "Gateway: %d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
 }
 
-static void IRAM_ATTR read_intron_message() {
-    read_uart((uint8_t*)intron, sizeof(intron));
+static void unknown_message(void *ctx, uint8_t type) {
+    ESP_LOGI(TAG, "Unknown message type: %d !!!", type);
 }
 
 static int get_link_status() {
@@ -449,104 +1359,520 @@ static int get_link_status() {
     return online;
 }
 
-static void check_online_status() {
-    if (!associated || probe_in_progress) {
-        // Nothing to check, we are not online and we know it.
+static void get_link(void *ctx) {
+    post_link_status(get_link_status());
+}
+
+static void get_stats(void *ctx) {
+    post_ctrl(TX_CTRL_STATS, 0);
+}
+
+static void get_link_info(void *ctx) {
+    post_ctrl(TX_CTRL_LINK_INFO, 0);
+}
+
+static void send_link_info() {
+    portENTER_CRITICAL();
+    const link_info_t info = link_info;
+    portEXIT_CRITICAL();
+
+    const uint8_t up = info.up;
+    const uint8_t radio[] = { info.channel, (uint8_t)info.rssi, info.phy };
+    const uint32_t uptime = info.up ? now_seconds() - info.since : 0;
+    frame_begin(MSG_LINK_INFO);
+    frame_write(&up, sizeof(up));
+    frame_write(info.bssid, sizeof(info.bssid));
+    frame_write(radio, sizeof(radio));
+    frame_write(&uptime, sizeof(uptime));
+    frame_end();
+}
+
+// Worth telling the host about, the RSSI has some hysteresis
+static bool link_info_changed(const link_info_t *now, const link_info_t *before) {
+    const int rssi_change = now->rssi - before->rssi;
+    return now->up != before->up
+        || memcmp(now->bssid, before->bssid, MAC_LEN) != 0
+        || now->channel != before->channel
+        || now->phy != before->phy
+        || rssi_change >= CONFIG_UART_NIC_LINK_INFO_RSSI_STEP
+        || rssi_change <= -CONFIG_UART_NIC_LINK_INFO_RSSI_STEP;
+}
+
+/**
+ * @brief Have the next channel scanned for other APs of the network if the signal is weak
+ *
+ * The link stays up meanwhile, the radio leaves the channel of the AP for
+ * just one channel at a time. The scan and the reassociation run in the
+ * event task, the timer only decides.
+ */
+static void roam_check(const link_info_t *link) {
+    if (ROAM_RSSI == 0 || !link->up || link->rssi >= ROAM_RSSI || roaming || connecting || probe_in_progress) {
         return;
     }
-    const uint32_t last = last_inbound_seen; // Atomic load
-    const uint32_t now = now_seconds();
-    // The time may overflow from time to time and due to the conversion to
-    // seconds, we don't know when exactly. But if it overflows, the now would
-    // get smaller than the last time (assuming we check often enough). In that
-    // case we ignore the part up to the overflow and take just the part in the
-    // „new round“.
-    const uint32_t elapsed = now >= last ? now - last : now;
-
-    if (elapsed > INACTIVE_PACKET_SECONDS) {
-        probe_in_progress = true;
-        probe_retry_count = 0;
-        probe_run();
+    const TickType_t now = xTaskGetTickCount();
+    if (now - roam_scanned < pdMS_TO_TICKS(ROAM_SCAN_PERIOD_MS)) {
+        return;
+    }
+    // Without waiting, as anything in the timer task
+    if (esp_event_post(UART_NIC_EVENT, UART_NIC_EVENT_ROAM_SCAN, NULL, 0, 0) == ESP_OK) {
+        roam_scanned = now;
     }
 }
 
-static void IRAM_ATTR read_message() {
-    wait_for_intron();
+// Driver keeps the AP info at hand, cheap enough for every link check
+static void sample_link_info() {
+    link_info_t sample;
+    memset(&sample, 0, sizeof(sample));
+    wifi_ap_record_t ap_info;
+    if (associated && esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
+        sample.up = true;
+        memcpy(sample.bssid, ap_info.bssid, MAC_LEN);
+        sample.channel = ap_info.primary;
+        sample.rssi = ap_info.rssi;
+        sample.phy = (ap_info.phy_11b ? LINK_PHY_11B : 0)
+            | (ap_info.phy_11g ? LINK_PHY_11G : 0)
+            | (ap_info.phy_11n ? LINK_PHY_11N : 0);
+        sample.since = associated_since;
+    }
+    portENTER_CRITICAL();
+    link_info = sample;
+    portEXIT_CRITICAL();
+
+    if ((features & FEATURE_LINK_INFO) && link_info_changed(&sample, &link_info_pushed)) {
+        // Blocking would hold up all the software timers, try again with the
+        // next sample instead
+        if (post_ctrl_wait(TX_CTRL_LINK_INFO, 0, 0)) {
+            link_info_pushed = sample;
+        } else {
+            stats[STAT_TIMER_CTRL_DROPS]++;
+        }
+    }
+    roam_check(&sample);
+}
 
-    // Check that we are receiving some packets from the AP. We do so in the
-    // thread that receives messages from the main CPU because we know that one
-    // will generate a message from time to time (at least the get-link one).
-    // On the other hand, if we lose connectivity, we will receive no packets
-    // from the AP and we would block forever and never get to the check.
-    check_online_status();
+/**
+ * @brief Send ARP to the gateway to provoke some packets
+ *
+ * @return bool The request was queued
+ */
+static bool send_probe_arp() {
+    static const uint8_t broadcast[MAC_LEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    static const uint8_t no_ip[4] = {0};
+    if (!gateway_set || arp_probe.pending) {
+        return false;
+    }
+    // Unicast once known, the gateway answers even without a sender address
+    portENTER_CRITICAL();
+    arp_request(mac, gateway_mac_known ? gateway_mac : broadcast, arp_ips.count ? arp_ips.addrs[0] : no_ip, gateway_ip, arp_probe.frame);
+    portEXIT_CRITICAL();
+    arp_probe.pending = true;
+    wifi_send_buff *wakeup = NULL;
+    xQueueSendToFront(wifi_egress_queue, &wakeup, 0);
+    return true;
+}
 
-    uint8_t type = 0;
-    size_t read = uart_read_bytes(UART_NUM_0, (uint8_t*)&type, 1, portMAX_DELAY);
-    if(read != 1) {
-        ESP_LOGI(TAG, "Cannot read message type");
+/**
+ * @brief Wait for an answer to ARP to the gateway, one check period per try
+ *
+ * Scans for the AP when no packet arrives even after the retries.
+ */
+static void check_probe_arp() {
+    if ((int32_t)(last_inbound_us - probe_started_us) > 0) {
+        probe_done(STAT_PROBE_ARP_OK);
         return;
     }
+    if (probe_retry_count++ < probe_max_reties && send_probe_arp()) {
+        return;
+    }
+    probe_arp = false;
+    probe_retry_count = 0;
+    probe_run();
+}
 
-    // ESP_LOGI(TAG, "Detected message type: %d", type);
-    if(type == MSG_PACKET) {
-        read_packet_message();
-    } else if (type == MSG_CLIENTCONFIG) {
-        read_wifi_client_message();
-    } else if (type == MSG_GET_LINK) {
-        send_link_status(get_link_status());
-    } else if (type == MSG_INTRON) {
-        read_intron_message();
-    } else {
-        ESP_LOGI(TAG, "Unknown message type: %d !!!", type);
+static void check_online_status() {
+    if (probe_in_progress && probe_arp) {
+        if (associated) {
+            check_probe_arp();
+        } else {
+            // Disconnected meanwhile, already reported
+            probe_arp = false;
+            probe_done(STAT_PROBE_FAILED);
+        }
+        return;
+    }
+    if (!associated || probe_in_progress || roaming) {
+        // Nothing to check, we are not online and we know it, or we are
+        // leaving the AP on purpose.
+        return;
+    }
+    const uint32_t last = last_inbound_seen; // Atomic load
+    if (link_check_inactive(last, now_seconds(), INACTIVE_PACKET_SECONDS)) {
+        probe_in_progress = true;
+        probe_retry_count = 0;
+        probe_started_us = esp_timer_get_time();
+        stats[STAT_PROBES]++;
+        // Scanning takes the radio off the traffic, try the gateway first
+        probe_arp = send_probe_arp();
+        if (!probe_arp) {
+            probe_run();
+        }
+    }
+}
+
+/**
+ * @brief Send the frame in the slot, if any
+ *
+ * @return bool A frame was sent
+ */
+static bool send_arp_slot(arp_slot *slot) {
+    if (!slot->pending) {
+        return false;
     }
+    const esp_err_t err = esp_wifi_internal_tx(ESP_IF_WIFI_STA, slot->frame, sizeof(slot->frame));
+    slot->pending = false;
+    if (err != ESP_OK) {
+        stats[STAT_WIFI_TX_ERRORS]++;
+        return false;
+    }
+    return true;
+}
+
+// Check that we are receiving some packets from the AP. Runs on a timer, so
+// the loss is detected in bounded time whatever the host does. Waiting for
+// the packets themselves would block forever once the connectivity is lost.
+static void link_check_timer(TimerHandle_t timer) {
+    sample_link_info();
+    check_online_status();
 }
 
 static void IRAM_ATTR wifi_egress_thread(void *arg) {
     for(;;) {
         wifi_send_buff *buff;
         if(xQueueReceive(wifi_egress_queue, &buff, (TickType_t)portMAX_DELAY)) {
+            // Checked with every packet, the NULL waking us up may not fit
+            // the queue
+            if (send_arp_slot(&arp_reply)) {
+                stats[STAT_ARP_REPLIES]++;
+            }
+            send_arp_slot(&arp_probe);
             if (!buff) {
-                ESP_LOGI(TAG, "NULL pulled from egress queue");
                 continue;
             }
 
             int8_t err = esp_wifi_internal_tx(ESP_IF_WIFI_STA, buff->data, buff->len);
             if (err != ESP_OK) {
                 ESP_LOGI(TAG, "Failed to send packet !!!");
+                stats[STAT_WIFI_TX_ERRORS]++;
+            } else {
+                stats[STAT_EGRESS_PACKETS]++;
+                stats[STAT_EGRESS_BYTES] += buff->len;
             }
             free_wifi_send_buff(buff);
+            credit_kick();
+        }
+    }
+}
+
+static const uart_proto_callbacks rx_callbacks = {
+    .packet_begin = packet_begin,
+    .packet_end = packet_end,
+    .packet_abort = packet_abort,
+    .packet_invalid = packet_invalid,
+    .client_config = client_config,
+    .get_link = get_link,
+    .get_stats = get_stats,
+    .get_link_info = get_link_info,
+    .intron = new_intron,
+    .set_features = set_features,
+    .credit_sync = credit_sync_host,
+    .set_framing = set_framing,
+    .set_baud = set_baud,
+    .baud_probe = baud_probe,
+    .set_mcast_filter = set_mcast_filter,
+    .set_arp_offload = set_arp_offload,
+    .set_storm_limit = set_storm_limit,
+    .set_gateway = set_gateway,
+    .scan_start = scan_start,
+    .unknown = unknown_message,
+};
+
+#define RX_CHUNK_SIZE 256
+#define UART_EVENT_QUEUE_LEN 20
+
+/**
+ * @brief Account an event of the UART driver
+ *
+ * @return true The event reports received data
+ */
+static bool IRAM_ATTR uart_event(const uart_event_t *event) {
+    switch (event->type) {
+    case UART_DATA:
+        return true;
+    case UART_FIFO_OVF:
+        // The driver already flushed the FIFO
+        stats[STAT_UART_FIFO_OVF]++;
+        break;
+    case UART_BUFFER_FULL:
+        stats[STAT_UART_BUFFER_FULL]++;
+        break;
+    case UART_FRAME_ERR:
+        stats[STAT_UART_FRAME_ERR]++;
+        break;
+    default:
+        break;
+    }
+    return false;
+}
+
+/**
+ * @brief Feed everything the UART driver has to the parser
+ */
+static void IRAM_ATTR rx_drain() {
+    static uint8_t chunk[RX_CHUNK_SIZE];
+
+    for (;;) {
+        size_t len = 0;
+        uart_get_buffered_data_len(UART_NUM_0, &len);
+        if (len == 0) {
+            return;
+        }
+
+        size_t direct_len;
+        uint8_t *direct = uart_proto_direct_buffer(&rx_parser, &direct_len);
+        // Rest of a packet goes straight to its buffer
+        uint8_t *dest = direct ? direct : chunk;
+        const size_t max = direct ? direct_len : sizeof(chunk);
+        if (len > max) {
+            len = max;
+        }
+        const int read = uart_read_bytes(UART_NUM_0, dest, len, 0);
+        if (read <= 0) {
+            return;
+        }
+        if (direct) {
+            uart_proto_direct_advance(&rx_parser, read);
+        } else {
+            uart_proto_feed(&rx_parser, chunk, read);
         }
+        credit_kick();
     }
 }
 
 static void IRAM_ATTR output_rx_thread(void *arg) {
     ESP_LOGI(TAG, "Started RX thread");
+
+    // Descriptor of the packet being received
+    wifi_send_buff *rx_packet = NULL;
+
+    uart_proto_init(&rx_parser, &rx_callbacks, &rx_packet, (const uint8_t*)intron);
+
+    TickType_t wait = portMAX_DELAY;
     for(;;) {
-        read_message();
+        // Sleep until the driver reports something. Errors are only counted,
+        // the parser recovers from the damaged data on its own. Data events
+        // of bytes already drained find the buffer empty.
+        uart_event_t event;
+        if (xQueueReceive(uart_event_queue, &event, wait) && uart_event(&event)) {
+            rx_drain();
+        }
+        wait = check_baud();
     }
 }
 
+#define BATCH_MAX_PACKETS CONFIG_UART_NIC_BATCH_MAX_PACKETS
+
+/**
+ * @brief Check a packet taken from the bulk queue against CoDel
+ *
+ * @return bool The packet was dropped
+ */
+static bool IRAM_ATTR codel_dropped(wifi_receive_buff *buff) {
+    const uint32_t now = esp_timer_get_time();
+    const uint32_t sojourn = now - buff->queued_us;
+    if (sojourn > stats[STAT_INGRESS_SOJOURN_MAX_US]) {
+        stats[STAT_INGRESS_SOJOURN_MAX_US] = sojourn;
+    }
+    bulk_dequeued++;
+    const uint32_t backlog = bulk_enqueued - bulk_dequeued;
+    // The WiFi task may have counted a packet not queued yet, or one it
+    // failed to queue, for a moment
+    if (!codel_drop(&ingress_codel, now, sojourn, (int32_t)backlog > 0 ? backlog : 0)) {
+        return false;
+    }
+    stats[STAT_CODEL_DROPS]++;
+    free_wifi_receive_buff(buff);
+    return true;
+}
+
+/**
+ * @brief Pick the queue to take the next packet from
+ *
+ * Strict priority: the highest class with a packet waiting, the bulk queue
+ * when there is none.
+ */
+static QueueHandle_t IRAM_ATTR next_queue(void) {
+    for (size_t i = 0; i < PKT_CLASS_BULK; ++i) {
+        if (uxQueueMessagesWaiting(uart_prio_queue[i])) {
+            return uart_prio_queue[i];
+        }
+    }
+    return uart_tx_queue;
+}
+
+/**
+ * @brief Collect more packets waiting in the UART TX queue
+ *
+ * @param batch Batch with the first packet already in place
+ * @return size_t Number of packets in the batch
+ */
+static size_t IRAM_ATTR collect_batch(wifi_receive_buff **batch) {
+    size_t count = 1;
+    size_t bytes = batch[0]->len;
+    const TickType_t budget = pdMS_TO_TICKS(CONFIG_UART_NIC_BATCH_WAIT_MS);
+    const TickType_t start = xTaskGetTickCount();
+    TickType_t wait = budget;
+
+    while (count < BATCH_MAX_PACKETS) {
+        wifi_receive_buff *next;
+        const QueueHandle_t queue = next_queue();
+        if (!xQueuePeek(queue, &next, wait)) {
+            break;
+        }
+        if (next && bytes + next->len > CONFIG_UART_NIC_BATCH_MAX_BYTES) {
+            // Leave it for the next batch
+            break;
+        }
+        xQueueReceive(queue, &next, 0);
+        if (next && !(queue == uart_tx_queue && codel_dropped(next))) {
+            batch[count++] = next;
+            bytes += next->len;
+        }
+
+        const TickType_t elapsed = xTaskGetTickCount() - start;
+        wait = elapsed < budget ? budget - elapsed : 0;
+    }
+
+    return count;
+}
+
+static void IRAM_ATTR send_packet(wifi_receive_buff *buff) {
+    const uint32_t l = buff->len;
+    frame_begin(MSG_PACKET);
+    frame_write(&l, sizeof(l));
+    frame_write_ref(buff->data, buff->len, ingress_sent, buff);
+    frame_end();
+}
+
+static void IRAM_ATTR send_packet_batch(wifi_receive_buff **batch, size_t count) {
+    // Count and the length table go out in one write with the intron and type
+    frame_begin(MSG_PACKET_BATCH);
+    const uint8_t c = count;
+    frame_write(&c, sizeof(c));
+    for (size_t i = 0; i < count; ++i) {
+        const uint16_t l = batch[i]->len;
+        frame_write(&l, sizeof(l));
+    }
+    for (size_t i = 0; i < count; ++i) {
+        frame_write_ref(batch[i]->data, batch[i]->len, ingress_sent, batch[i]);
+    }
+    frame_end();
+}
+
+static void send_ctrl(const tx_ctrl *ctrl) {
+    switch (ctrl->type) {
+    case TX_CTRL_LINK:
+        send_link_status(ctrl->arg);
+        break;
+    case TX_CTRL_DEVINFO:
+        send_device_info();
+        break;
+    case TX_CTRL_STATS:
+        send_stats();
+        break;
+    case TX_CTRL_CREDIT:
+        send_credit();
+        break;
+    case TX_CTRL_FRAMING:
+        send_framing(ctrl->arg);
+        break;
+    case TX_CTRL_SET_BAUD:
+        send_baud(ctrl->arg);
+        break;
+    case TX_CTRL_RESTORE_BAUD:
+        switch_baud(ctrl->arg);
+        break;
+    case TX_CTRL_BAUD_PROBE:
+        send_baud_probe(ctrl->arg);
+        break;
+    case TX_CTRL_CLIENTCONFIG_ACK:
+        send_client_config_ack(ctrl->arg);
+        break;
+    case TX_CTRL_SCAN_RESULTS:
+        tx_scan_count = ctrl->arg;
+        tx_scan_sent = 0;
+        if (!tx_scan_count) {
+            send_scan_done(SCAN_STATUS_OK, 0);
+            scan_owner = SCAN_OWNER_NONE;
+        }
+        break;
+    case TX_CTRL_SCAN_DONE:
+        send_scan_done(ctrl->arg, 0);
+        break;
+    case TX_CTRL_LINK_INFO:
+        send_link_info();
+        break;
+    }
+}
+
+/**
+ * @brief The only task writing to UART
+ *
+ * Control messages requested by other tasks go out between frames, before
+ * packets waiting in the queues. Packets go by priority of their class.
+ */
 static void IRAM_ATTR uart_tx_thread(void *arg) {
     // Send initial device info to let master know ESP is ready
     send_device_info();
 
+    wifi_receive_buff *batch[BATCH_MAX_PACKETS];
     for(;;) {
-        wifi_receive_buff *buff;
-        if(xQueueReceive(uart_tx_queue, &buff, (TickType_t)1000 /*portMAX_DELAY*/)) {
-            if (!buff) {
+        tx_ctrl ctrl;
+        while (xQueueReceive(tx_ctrl_queue, &ctrl, 0)) {
+            send_ctrl(&ctrl);
+        }
+
+        update_credit();
+        send_scan_results();
+
+        if (tx_reap_pending) {
+            tx_reap_pending = false;
+            uart_tx_reap();
+        }
+
+        const QueueHandle_t queue = next_queue();
+        const bool scan_pending = tx_scan_sent != tx_scan_count;
+        const TickType_t wait = queue == uart_tx_queue && !scan_pending ? (TickType_t)1000 /*portMAX_DELAY*/ : 0;
+        if(xQueueReceive(queue, &batch[0], wait)) {
+            if (!batch[0] || (queue == uart_tx_queue && codel_dropped(batch[0]))) {
                 continue;
             }
+            size_t count = 1;
+            if (features & FEATURE_PACKET_BATCH) {
+                count = collect_batch(batch);
+            }
+
+            stats[STAT_INGRESS_PACKETS] += count;
+            for (size_t i = 0; i < count; ++i) {
+                stats[STAT_INGRESS_BYTES] += batch[i]->len;
+            }
+
             //ESP_LOGI(TAG, "Printing packet to UART");
-            xSemaphoreTake(uart_mtx, portMAX_DELAY);
-            uart_write_bytes(UART_NUM_0, intron, sizeof(intron));
-            const uint8_t t = MSG_PACKET;
-            const uint32_t l = buff->len;
-            uart_write_bytes(UART_NUM_0, (const char*)&t, sizeof(t));
-            uart_write_bytes(UART_NUM_0, (const char*)&l, sizeof(l));
-            uart_write_bytes(UART_NUM_0, (const char*)buff->data, buff->len);
-            xSemaphoreGive(uart_mtx);
-            //ESP_LOGI(TAG, "Packet UART out done");
-            free_wifi_receive_buff(buff);
+            // Buffers are released by uart_tx_reap once sent
+            if (count == 1) {
+                send_packet(batch[0]);
+            } else {
+                send_packet_batch(batch, count);
+            }
         }
     }
 }
@@ -561,13 +1887,18 @@ void app_main() {
     // Configure parameters of an UART driver,
     // communication pins and install the driver
     uart_config_t uart_config = {
-        .baud_rate = 4600000,
+        .baud_rate = CONFIG_UART_NIC_BAUD_RATE,
         .data_bits = UART_DATA_8_BITS,
         .parity    = UART_PARITY_DISABLE,
         .stop_bits = UART_STOP_BITS_1,
+#ifdef CONFIG_UART_NIC_HW_FLOWCTRL
+        .flow_ctrl = UART_HW_FLOWCTRL_CTS_RTS,
+        .rx_flow_ctrl_thresh = CONFIG_UART_NIC_RX_FLOWCTRL_THRESH,
+#else
         .flow_ctrl = UART_HW_FLOWCTRL_DISABLE
+#endif
     };
-    uart_driver_install(UART_NUM_0, 16384, 0, 0, NULL, 0);
+    uart_driver_install(UART_NUM_0, 16384, 0, UART_EVENT_QUEUE_LEN, &uart_event_queue, 0);
     uart_param_config(UART_NUM_0, &uart_config);
     uart_intr_config_t uart_intr = {
         .intr_enable_mask = UART_RXFIFO_FULL_INT_ENA_M
@@ -579,27 +1910,42 @@ void app_main() {
         .txfifo_empty_intr_thresh = 40
     };
     uart_intr_config(UART_NUM_0, &uart_intr);
+    uart_tx_init(tx_wake);
 
     ESP_LOGI(TAG, "UART RE-INITIALIZED");
 
-    uart_mtx = xSemaphoreCreateMutex();
-    if (!uart_mtx) {
-        ESP_LOGI(TAG, "Could not create UART mutex");
-        return;
-    }
+    buf_pool_init(&wifi_receive_buff_pool, wifi_receive_buff_mem, sizeof(wifi_receive_buff), CONFIG_UART_NIC_INGRESS_DESCRIPTORS);
+    buf_pool_init(&wifi_send_buff_pool, wifi_send_buff_mem, sizeof(wifi_send_buff), CONFIG_UART_NIC_EGRESS_BUFFERS);
+    credit_init(&egress_credit, CREDIT_UPDATE_STEP);
+    codel_init(&ingress_codel, codel_target(CONFIG_UART_NIC_BAUD_RATE), CONFIG_UART_NIC_CODEL_INTERVAL_MS * 1000);
+    storm_limit_init(&storm_limits, CONFIG_UART_NIC_STORM_RATE, CONFIG_UART_NIC_STORM_BURST, esp_timer_get_time());
 
-    uart_tx_queue = xQueueCreate(20, sizeof(wifi_receive_buff*));
+    uart_tx_queue = xQueueCreate(CONFIG_UART_NIC_INGRESS_DESCRIPTORS, sizeof(wifi_receive_buff*));
     if (uart_tx_queue == 0) {
         ESP_LOGI(TAG, "Failed to create INPUT/TX queue");
         return;
     }
+    for (size_t i = 0; i < PKT_CLASS_BULK; ++i) {
+        uart_prio_queue[i] = xQueueCreate(CONFIG_UART_NIC_INGRESS_DESCRIPTORS, sizeof(wifi_receive_buff*));
+        if (uart_prio_queue[i] == 0) {
+            ESP_LOGI(TAG, "Failed to create priority TX queue");
+            return;
+        }
+    }
 
-    wifi_egress_queue = xQueueCreate(20, sizeof(wifi_send_buff*));
+    // Room for every packet buffer, a packet received never waits for space
+    wifi_egress_queue = xQueueCreate(CONFIG_UART_NIC_EGRESS_BUFFERS, sizeof(wifi_send_buff*));
     if (wifi_egress_queue == 0) {
         ESP_LOGI(TAG, "Failed to create WiFi TX queue");
         return;
     }
 
+    tx_ctrl_queue = xQueueCreate(TX_CTRL_QUEUE_LEN, sizeof(tx_ctrl));
+    if (tx_ctrl_queue == 0) {
+        ESP_LOGI(TAG, "Failed to create UART control queue");
+        return;
+    }
+
     ESP_LOGI(TAG, "Wifi init");
     esp_wifi_restore();
     wifi_init_sta();
@@ -611,4 +1957,9 @@ void app_main() {
     xTaskCreate(&wifi_egress_thread, "wifi_egress_thread", 2048, NULL, 12, NULL);
     ESP_LOGI(TAG, "Creating TX thread");
     xTaskCreate(&uart_tx_thread, "uart_tx_thread", 2048, NULL, 14, NULL);
+
+    TimerHandle_t link_check = xTimerCreate("link_check", pdMS_TO_TICKS(LINK_CHECK_MS), pdTRUE, NULL, link_check_timer);
+    if (link_check == 0 || xTimerStart(link_check, 0) != pdPASS) {
+        ESP_LOGI(TAG, "Failed to start link check timer");
+    }
 }
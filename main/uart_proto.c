@@ -0,0 +1,554 @@
+/* UART NIC protocol
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "uart_proto.h"
+
+#include <string.h>
+
+// CRC-32 (IEEE 802.3, reflected), the same as zlib's crc32. Kept in DRAM, the
+// lookups would be slower through the flash cache.
+static const DRAM_ATTR uint32_t crc32_table[256] = {
+    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+    0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+    0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+    0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+    0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+    0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+    0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+    0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+    0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+    0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+    0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+    0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+    0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+    0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+    0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+    0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+    0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+    0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+};
+
+uint32_t IRAM_ATTR uart_proto_crc32(uint32_t crc, const uint8_t *data, size_t len) {
+    crc = ~crc;
+    while (len--) {
+        crc = crc32_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+void cobs_encode_begin(cobs_encoder *enc) {
+    enc->len = 1;
+}
+
+void IRAM_ATTR cobs_encode(cobs_encoder *enc, const uint8_t *data, size_t len, cobs_emit emit, void *ctx) {
+    while (len--) {
+        const uint8_t c = *data++;
+        if (c == 0) {
+            enc->block[0] = enc->len;
+            emit(ctx, enc->block, enc->len);
+            enc->len = 1;
+            continue;
+        }
+        enc->block[enc->len++] = c;
+        if (enc->len == sizeof(enc->block)) {
+            // Full block, no implicit zero
+            enc->block[0] = 0xff;
+            emit(ctx, enc->block, enc->len);
+            enc->len = 1;
+        }
+    }
+}
+
+void IRAM_ATTR cobs_encode_end(cobs_encoder *enc, cobs_emit emit, void *ctx) {
+    enc->block[0] = enc->len;
+    enc->block[enc->len] = 0;
+    emit(ctx, enc->block, enc->len + 1);
+    enc->len = 1;
+}
+
+static void update_intron_matcher(uart_proto_parser *parser) {
+    const uint8_t *intron = parser->intron;
+    parser->intron_fail[0] = 0;
+    uint8_t k = 0;
+    for (unsigned i = 1; i < INTRON_LEN; ++i) {
+        while (k > 0 && intron[i] != intron[k]) {
+            k = parser->intron_fail[k - 1];
+        }
+        if (intron[i] == intron[k]) {
+            k++;
+        }
+        parser->intron_fail[i] = k;
+    }
+}
+
+void uart_proto_init(uart_proto_parser *parser, const uart_proto_callbacks *cb, void *ctx, const uint8_t *intron) {
+    memset(parser, 0, sizeof(*parser));
+    parser->cb = cb;
+    parser->ctx = ctx;
+    memcpy(parser->intron, intron, INTRON_LEN);
+    update_intron_matcher(parser);
+    parser->state = PROTO_INTRON;
+}
+
+static void IRAM_ATTR expect(uart_proto_parser *parser, uart_proto_state state) {
+    parser->state = state;
+    parser->pos = 0;
+}
+
+// Wait for the start of the next message
+static void IRAM_ATTR expect_next(uart_proto_parser *parser) {
+    expect(parser, parser->framing == FRAMING_COBS ? PROTO_FRAME_END : PROTO_INTRON);
+}
+
+static void IRAM_ATTR expect_fixed(uart_proto_parser *parser, uint8_t len) {
+    parser->fixed_len = len;
+    expect(parser, PROTO_FIXED);
+}
+
+static void IRAM_ATTR expect_list(uart_proto_parser *parser, void *body, uint8_t size, uint8_t head, uint8_t elem) {
+    parser->list = body;
+    parser->list_size = size;
+    parser->list_head = head;
+    parser->list_elem = elem;
+    expect(parser, PROTO_LIST);
+}
+
+static uint16_t read_u16(const uint8_t *data) {
+    return data[0] | (data[1] << 8);
+}
+
+static uint32_t read_u32(const uint8_t *data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static void dispatch_fixed(uart_proto_parser *parser) {
+    switch (parser->type) {
+    case MSG_INTRON:
+        memcpy(parser->intron, parser->fixed, INTRON_LEN);
+        update_intron_matcher(parser);
+        parser->cb->intron(parser->ctx, parser->intron);
+        break;
+    case MSG_SET_FEATURES:
+        parser->cb->set_features(parser->ctx, read_u32(parser->fixed));
+        break;
+    case MSG_CREDIT:
+        parser->cb->credit_sync(parser->ctx, read_u32(parser->fixed));
+        break;
+    case MSG_SET_FRAMING:
+        if (parser->fixed[0] == FRAMING_INTRON) {
+            parser->framing = FRAMING_INTRON;
+            expect(parser, PROTO_INTRON);
+        } else if (parser->fixed[0] == FRAMING_COBS) {
+            parser->framing = FRAMING_COBS;
+            parser->cobs_sync = false;
+            expect(parser, PROTO_FRAME_END);
+        } else {
+            break;
+        }
+        parser->cb->set_framing(parser->ctx, parser->framing);
+        break;
+    case MSG_SET_BAUD:
+        parser->cb->set_baud(parser->ctx, read_u32(parser->fixed));
+        break;
+    case MSG_BAUD_PROBE:
+        parser->cb->baud_probe(parser->ctx, read_u32(parser->fixed));
+        break;
+    case MSG_SET_GATEWAY:
+        parser->cb->set_gateway(parser->ctx, parser->fixed);
+        break;
+    case MSG_SET_STORM_LIMIT:
+        parser->cb->set_storm_limit(parser->ctx, parser->fixed[0], read_u16(parser->fixed + 1), read_u16(parser->fixed + 3));
+        break;
+    }
+}
+
+static void dispatch_mcast_filter(uart_proto_parser *parser) {
+    if (parser->mcast.count > MCAST_EXACT_MAX) {
+        parser->mcast.count = MCAST_EXACT_MAX;
+    }
+    parser->cb->set_mcast_filter(parser->ctx, &parser->mcast);
+}
+
+static void dispatch_arp_offload(uart_proto_parser *parser) {
+    if (parser->arp.count > ARP_OFFLOAD_MAX) {
+        parser->arp.count = ARP_OFFLOAD_MAX;
+    }
+    parser->cb->set_arp_offload(parser->ctx, &parser->arp);
+}
+
+static void dispatch_scan_start(uart_proto_parser *parser) {
+    const scan_request *scan = &parser->scan;
+    const uint8_t ssid_len = scan->ssid_len < SSID_MAX_LEN ? scan->ssid_len : SSID_MAX_LEN;
+    parser->cb->scan_start(parser->ctx, scan->channel, scan->flags, read_u16(scan->dwell_min), read_u16(scan->dwell_max), scan->ssid, ssid_len);
+}
+
+static void dispatch_client_config(uart_proto_parser *parser) {
+    const uint8_t ssid_len = parser->ssid_len < SSID_MAX_LEN ? parser->ssid_len : SSID_MAX_LEN;
+    const uint8_t pass_len = parser->pass_len < PASS_MAX_LEN ? parser->pass_len : PASS_MAX_LEN;
+    parser->cb->client_config(parser->ctx, parser->ssid, ssid_len, parser->pass, pass_len);
+}
+
+// Deliver the complete message
+static void IRAM_ATTR dispatch(uart_proto_parser *parser) {
+    parser->messages++;
+    switch (parser->type) {
+    case MSG_PACKET:
+        if (parser->packet_data) {
+            parser->cb->packet_end(parser->ctx, parser->packet_data, parser->packet_len);
+            parser->packet_data = NULL;
+        }
+        break;
+    case MSG_CLIENTCONFIG:
+        dispatch_client_config(parser);
+        break;
+    case MSG_GET_LINK:
+        parser->cb->get_link(parser->ctx);
+        break;
+    case MSG_GET_STATS:
+        parser->cb->get_stats(parser->ctx);
+        break;
+    case MSG_GET_LINK_INFO:
+        parser->cb->get_link_info(parser->ctx);
+        break;
+    case MSG_SET_MCAST_FILTER:
+        dispatch_mcast_filter(parser);
+        break;
+    case MSG_SET_ARP_OFFLOAD:
+        dispatch_arp_offload(parser);
+        break;
+    case MSG_SCAN_START:
+        dispatch_scan_start(parser);
+        break;
+    default:
+        dispatch_fixed(parser);
+        break;
+    }
+}
+
+// Message body was received, verify the trailer if any and deliver it
+static void IRAM_ATTR body_done(uart_proto_parser *parser) {
+    if (parser->crc_frame) {
+        expect(parser, PROTO_CRC);
+        return;
+    }
+    expect_next(parser);
+    dispatch(parser);
+}
+
+static void IRAM_ATTR abort_message(uart_proto_parser *parser) {
+    if (parser->type == MSG_PACKET && parser->packet_data) {
+        parser->cb->packet_abort(parser->ctx, parser->packet_data);
+        parser->packet_data = NULL;
+    }
+}
+
+static void IRAM_ATTR check_crc(uart_proto_parser *parser) {
+    expect_next(parser);
+    if (read_u32(parser->crc_trailer) == parser->crc) {
+        dispatch(parser);
+        return;
+    }
+    parser->crc_errors++;
+    abort_message(parser);
+}
+
+static void IRAM_ATTR start_packet_data(uart_proto_parser *parser) {
+    if (parser->packet_len > MAX_PACKET_SIZE) {
+        // Most likely garbage, look for the next intron
+        expect_next(parser);
+        parser->cb->packet_invalid(parser->ctx, parser->packet_len);
+        return;
+    }
+    parser->packet_data = parser->cb->packet_begin(parser->ctx, parser->packet_len);
+    expect(parser, PROTO_PACKET_DATA);
+    if (parser->packet_len == 0) {
+        body_done(parser);
+    }
+}
+
+static void IRAM_ATTR start_message(uart_proto_parser *parser, uint8_t type) {
+    parser->crc_frame = type & MSG_CRC_FLAG;
+    parser->crc = 0;
+    type &= ~MSG_CRC_FLAG;
+    parser->type = type;
+    switch (type) {
+    case MSG_PACKET:
+        parser->packet_len = 0;
+        expect(parser, PROTO_PACKET_LEN);
+        break;
+    case MSG_CLIENTCONFIG:
+        expect(parser, PROTO_SSID_LEN);
+        break;
+    case MSG_GET_LINK:
+    case MSG_GET_STATS:
+    case MSG_GET_LINK_INFO:
+        body_done(parser);
+        break;
+    case MSG_INTRON:
+        expect_fixed(parser, INTRON_LEN);
+        break;
+    case MSG_SET_FEATURES:
+    case MSG_CREDIT:
+    case MSG_SET_BAUD:
+    case MSG_BAUD_PROBE:
+    case MSG_SET_GATEWAY:
+        expect_fixed(parser, sizeof(uint32_t));
+        break;
+    case MSG_SET_FRAMING:
+        expect_fixed(parser, sizeof(uint8_t));
+        break;
+    case MSG_SET_STORM_LIMIT:
+        expect_fixed(parser, sizeof(uint8_t) + 2 * sizeof(uint16_t));
+        break;
+    case MSG_SET_MCAST_FILTER:
+        expect_list(parser, &parser->mcast, sizeof(parser->mcast), offsetof(mcast_filter, addrs), sizeof(parser->mcast.addrs[0]));
+        break;
+    case MSG_SET_ARP_OFFLOAD:
+        expect_list(parser, &parser->arp, sizeof(parser->arp), offsetof(arp_offload, addrs), sizeof(parser->arp.addrs[0]));
+        break;
+    case MSG_SCAN_START:
+        expect_list(parser, &parser->scan, sizeof(parser->scan), offsetof(scan_request, ssid), sizeof(parser->scan.ssid[0]));
+        break;
+    default:
+        expect_next(parser);
+        parser->cb->unknown(parser->ctx, type);
+        break;
+    }
+}
+
+/**
+ * @brief Store bytes of a variable length string field, dropping the excess
+ *
+ * @return size_t Number of bytes consumed
+ */
+static size_t take_string(uart_proto_parser *parser, uint8_t *dst, size_t dst_size, uint8_t field_len, const uint8_t *data, size_t len) {
+    size_t take = field_len - parser->pos;
+    if (take > len) {
+        take = len;
+    }
+    if (parser->pos < dst_size) {
+        const size_t store = parser->pos + take > dst_size ? dst_size - parser->pos : take;
+        memcpy(dst + parser->pos, data, store);
+    }
+    parser->pos += take;
+    return take;
+}
+
+/**
+ * @brief Run the message state machine
+ *
+ * @return size_t Number of bytes consumed, less than len if the framing changed
+ */
+static size_t IRAM_ATTR feed_message(uart_proto_parser *parser, const uint8_t *data, size_t len) {
+    const uint8_t framing = parser->framing;
+    const size_t total = len;
+    while (len && parser->framing == framing) {
+        size_t used = 1;
+        const uint8_t c = *data;
+        const uart_proto_state state = parser->state;
+
+        switch (state) {
+        case PROTO_INTRON: {
+            uint32_t pos = parser->pos;
+            // Tight loop, this is where the noise between messages goes
+            for (used = 0; used < len && pos < INTRON_LEN; ++used) {
+                while (pos > 0 && data[used] != parser->intron[pos]) {
+                    pos = parser->intron_fail[pos - 1];
+                }
+                if (data[used] == parser->intron[pos]) {
+                    pos++;
+                }
+            }
+            parser->hunted += used;
+            if (pos == INTRON_LEN) {
+                if (parser->hunted > INTRON_LEN) {
+                    parser->resyncs++;
+                }
+                parser->hunted = 0;
+                expect(parser, PROTO_TYPE);
+            } else {
+                parser->pos = pos;
+            }
+            break;
+        }
+        case PROTO_TYPE:
+            start_message(parser, c);
+            break;
+        case PROTO_PACKET_LEN:
+            // Little endian uint32_t
+            parser->packet_len |= (uint32_t)c << (8 * parser->pos);
+            if (++parser->pos == sizeof(uint32_t)) {
+                start_packet_data(parser);
+            }
+            break;
+        case PROTO_PACKET_DATA:
+            used = parser->packet_len - parser->pos;
+            if (used > len) {
+                used = len;
+            }
+            if (parser->packet_data) {
+                memcpy(parser->packet_data + parser->pos, data, used);
+            }
+            parser->pos += used;
+            if (parser->pos == parser->packet_len) {
+                body_done(parser);
+            }
+            break;
+        case PROTO_SSID_LEN:
+            parser->ssid_len = c;
+            parser->pass_len = 0;
+            expect(parser, parser->ssid_len ? PROTO_SSID : PROTO_PASS_LEN);
+            break;
+        case PROTO_SSID:
+            used = take_string(parser, parser->ssid, sizeof(parser->ssid), parser->ssid_len, data, len);
+            if (parser->pos == parser->ssid_len) {
+                expect(parser, PROTO_PASS_LEN);
+            }
+            break;
+        case PROTO_PASS_LEN:
+            parser->pass_len = c;
+            if (parser->pass_len) {
+                expect(parser, PROTO_PASS);
+            } else {
+                body_done(parser);
+            }
+            break;
+        case PROTO_PASS:
+            used = take_string(parser, parser->pass, sizeof(parser->pass), parser->pass_len, data, len);
+            if (parser->pos == parser->pass_len) {
+                body_done(parser);
+            }
+            break;
+        case PROTO_FIXED:
+            parser->fixed[parser->pos] = c;
+            if (++parser->pos == parser->fixed_len) {
+                body_done(parser);
+            }
+            break;
+        case PROTO_LIST: {
+            if (parser->pos < parser->list_size) {
+                parser->list[parser->pos] = c;
+            }
+            // The count is the last byte of the fixed part
+            const uint32_t head = parser->list_head;
+            if (++parser->pos >= head && parser->pos == head + parser->list_elem * parser->list[head - 1]) {
+                body_done(parser);
+            }
+            break;
+        }
+        case PROTO_CRC:
+            parser->crc_trailer[parser->pos] = c;
+            if (++parser->pos == sizeof(parser->crc_trailer)) {
+                check_crc(parser);
+            }
+            break;
+        case PROTO_FRAME_END:
+            // Junk after the message, ignore up to the delimiter
+            used = len;
+            break;
+        }
+
+        if (parser->crc_frame && state != PROTO_INTRON && state != PROTO_CRC && state != PROTO_FRAME_END) {
+            // Covers the type and the whole body
+            parser->crc = uart_proto_crc32(parser->crc, data, used);
+        }
+
+        data += used;
+        len -= used;
+    }
+    return total - len;
+}
+
+static void IRAM_ATTR cobs_frame_end(uart_proto_parser *parser) {
+    if (parser->cobs_sync && parser->state != PROTO_TYPE && parser->state != PROTO_FRAME_END) {
+        // Truncated message, lost bytes or corruption
+        parser->frame_errors++;
+        abort_message(parser);
+    }
+    parser->cobs_sync = true;
+    parser->cobs_left = 0;
+    parser->cobs_zero = false;
+    expect(parser, PROTO_TYPE);
+}
+
+void IRAM_ATTR uart_proto_feed(uart_proto_parser *parser, const uint8_t *data, size_t len) {
+    static const uint8_t zero = 0;
+
+    while (len) {
+        size_t used;
+        if (parser->framing == FRAMING_INTRON) {
+            used = feed_message(parser, data, len);
+        } else if (*data == 0) {
+            cobs_frame_end(parser);
+            used = 1;
+        } else if (!parser->cobs_sync) {
+            const uint8_t *delim = memchr(data, 0, len);
+            used = delim ? (size_t)(delim - data) : len;
+        } else if (parser->cobs_left == 0) {
+            // Code byte, the zero ending the previous block is only known to
+            // be data now that the frame goes on
+            if (parser->cobs_zero) {
+                feed_message(parser, &zero, 1);
+            }
+            parser->cobs_left = *data - 1;
+            parser->cobs_zero = *data != 0xff;
+            used = 1;
+        } else {
+            used = parser->cobs_left < len ? parser->cobs_left : len;
+            const uint8_t *delim = memchr(data, 0, used);
+            if (delim) {
+                used = delim - data;
+            }
+            parser->cobs_left -= used;
+            feed_message(parser, data, used);
+        }
+        data += used;
+        len -= used;
+    }
+}
+
+uint8_t *IRAM_ATTR uart_proto_direct_buffer(uart_proto_parser *parser, size_t *len) {
+    if (parser->state != PROTO_PACKET_DATA || !parser->packet_data || parser->framing != FRAMING_INTRON) {
+        return NULL;
+    }
+    *len = parser->packet_len - parser->pos;
+    return parser->packet_data + parser->pos;
+}
+
+void IRAM_ATTR uart_proto_direct_advance(uart_proto_parser *parser, size_t len) {
+    if (parser->crc_frame) {
+        parser->crc = uart_proto_crc32(parser->crc, parser->packet_data + parser->pos, len);
+    }
+    parser->pos += len;
+    if (parser->pos == parser->packet_len) {
+        body_done(parser);
+    }
+}
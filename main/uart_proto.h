@@ -0,0 +1,591 @@
+/* UART NIC protocol
+
+  Message definitions and a push-style parser for the byte stream received
+  from the host. The parser does not depend on ESP8266_RTOS_SDK, it is fed
+  arbitrary chunks of bytes and reports complete messages using callbacks.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#else
+#define IRAM_ATTR
+#define DRAM_ATTR
+#endif
+
+#define INTRON_LEN 8
+
+// Every message starts with the intron followed by the type. In FRAMING_COBS
+// mode (see MSG_SET_FRAMING) there is no intron, instead the type, body and
+// CRC of each message are COBS encoded and followed by a zero byte, so the
+// receiver always recovers at the next message. When the type has
+// MSG_CRC_FLAG set, the message is followed by CRC-32 of the type and the body
+// as uint32_t and is dropped when it doesn't match. Only sent by the NIC once
+// the host enabled FEATURE_CRC, always accepted by the NIC.
+#define MSG_CRC_FLAG 0x80
+
+// intron
+// 0 as uint8_t
+// fw version as uint16_t
+// hw addr data as uint8_t[6]
+// supported features as uint32_t (FEATURE_* bits)
+// time the last connection took in milliseconds as uint32_t, 0 when none
+#define MSG_DEVINFO 0
+
+// intron
+// 1 as uint8_t
+// link up as bool (uint8_t)
+#define MSG_LINK 1
+
+// intron
+// 2 as uint8_t
+#define MSG_GET_LINK 2
+
+// intron
+// 2 as uint8_t
+// ssid size as uint8_t
+// ssid bytes
+// pass size as uint8_t
+// pass bytes
+//
+// NIC answers with MSG_CLIENTCONFIG_ACK.
+#define MSG_CLIENTCONFIG 3
+
+// intron
+// 3 as uint8_t
+// LEN as uint32_t
+// DATA
+#define MSG_PACKET 4
+
+// intron
+// 5 as uint8_t
+// new intron as uint8_t[8]
+#define MSG_INTRON 5
+
+// intron
+// 6 as uint8_t
+// features to enable as uint32_t (FEATURE_* bits, others are disabled)
+#define MSG_SET_FEATURES 6
+
+// intron
+// 7 as uint8_t
+// packet count N as uint8_t
+// packet lengths as uint16_t[N]
+// DATA of all the packets, back to back
+#define MSG_PACKET_BATCH 7
+
+// intron
+// 8 as uint8_t
+// framing of following messages in both directions as uint8_t (FRAMING_*)
+//
+// NIC answers with the same message as the last one in the old framing.
+#define MSG_SET_FRAMING 8
+
+#define FRAMING_INTRON 0
+#define FRAMING_COBS 1
+
+// intron
+// 9 as uint8_t
+// credit limit as uint32_t from the NIC, MSG_PACKETs sent as uint32_t from
+// the host
+//
+// Sent by the NIC with FEATURE_CREDITS enabled. The host may send MSG_PACKET
+// while the number of MSG_PACKETs it sent since enabling the feature is lower
+// than the limit. The limit grows, wrapping around.
+//
+// Sent by the host when no credit came for a while, with the number of
+// MSG_PACKETs it sent since enabling the feature. Packets whose header got
+// lost on the way leave the counts of the two sides apart, the NIC takes
+// the host's count over and answers with a new limit.
+#define MSG_CREDIT 9
+
+// intron
+// 10 as uint8_t
+#define MSG_GET_STATS 10
+
+// intron
+// 11 as uint8_t
+// counter count N as uint8_t
+// counters as uint32_t[N], indexed by STAT_*
+//
+// Counters wrap around. Hosts must ignore counters they don't know, the NIC
+// may send fewer than the host knows.
+#define MSG_STATS 11
+
+// Bytes lost because the UART RX FIFO overflowed
+#define STAT_UART_FIFO_OVF 0
+// UART RX ring buffer got full, the driver stopped reading the FIFO
+#define STAT_UART_BUFFER_FULL 1
+// Bytes received with a wrong stop bit
+#define STAT_UART_FRAME_ERR 2
+// Messages from the host dropped due to CRC mismatch
+#define STAT_CRC_ERRORS 3
+// COBS frames from the host that ended before their message was complete
+#define STAT_COBS_FRAME_ERRORS 4
+// Packets from the host dropped because the WiFi egress queue was full
+#define STAT_EGRESS_QUEUE_DROPS 5
+// Packets from WiFi dropped because the UART TX queue was full
+#define STAT_INGRESS_QUEUE_DROPS 6
+// Packets dropped because no packet buffer was free
+#define STAT_EGRESS_POOL_EXHAUSTED 7
+#define STAT_INGRESS_POOL_EXHAUSTED 8
+// Packets and their bytes sent from the host to WiFi and from WiFi to the host
+#define STAT_EGRESS_PACKETS 9
+#define STAT_EGRESS_BYTES 10
+#define STAT_INGRESS_PACKETS 11
+#define STAT_INGRESS_BYTES 12
+// Frames from WiFi addressed to other stations
+#define STAT_INGRESS_FILTERED 13
+// Packets from the host the WiFi driver refused to send
+#define STAT_WIFI_TX_ERRORS 14
+// Packets from the host with a size outside of the packet buffer
+#define STAT_INVALID_PACKET_SIZE 15
+// Times the intron was found only after skipping garbage
+#define STAT_INTRON_RESYNCS 16
+// Scans started to check the AP is still there
+#define STAT_PROBES 17
+// Most packet buffers ever in use, bounding the queue depth in each direction
+#define STAT_EGRESS_BUFFERS_HIGH 18
+#define STAT_INGRESS_BUFFERS_HIGH 19
+// Packets from WiFi dropped for any reason but filtering and CoDel, one
+// counter per class starting here, indexed by pkt_class
+#define STAT_INGRESS_CLASS_DROPS 20
+#define STAT_INGRESS_CONTROL_DROPS 20
+#define STAT_INGRESS_ACK_DROPS 21
+#define STAT_INGRESS_BULK_DROPS 22
+// Bulk packets from WiFi dropped by CoDel because they waited too long
+#define STAT_CODEL_DROPS 23
+// Longest time a bulk packet from WiFi waited for UART, in microseconds
+#define STAT_INGRESS_SOJOURN_MAX_US 24
+// Multicast frames from WiFi rejected by the filter, see MSG_SET_MCAST_FILTER
+#define STAT_MCAST_FILTERED 25
+// ARP requests for the host answered by the NIC, see MSG_SET_ARP_OFFLOAD
+#define STAT_ARP_REPLIES 26
+// ARP messages from WiFi for other targets, dropped
+#define STAT_ARP_FILTERED 27
+// Group addressed frames from WiFi over the rate limit, one counter per class
+// starting here, indexed by STORM_*
+#define STAT_STORM_DROPS 28
+#define STAT_STORM_ARP_DROPS 28
+#define STAT_STORM_IPV4_DROPS 29
+#define STAT_STORM_IPV6_DROPS 30
+#define STAT_STORM_OTHER_DROPS 31
+// Outcome of the link probes counted by STAT_PROBES: answered to ARP sent to
+// the gateway, AP found by a scan of its channel, link reported down
+#define STAT_PROBE_ARP_OK 32
+#define STAT_PROBE_SCAN_OK 33
+#define STAT_PROBE_FAILED 34
+// Duration of the last and the longest link probe, in milliseconds
+#define STAT_PROBE_LAST_MS 35
+#define STAT_PROBE_MAX_MS 36
+// Time from MSG_CLIENTCONFIG to association in milliseconds, as in MSG_DEVINFO
+#define STAT_LINK_TIME_MS 37
+// Connections straight to the AP remembered from before, and those that
+// failed and fell back to a scan
+#define STAT_FAST_CONNECTS 38
+#define STAT_FAST_CONNECT_FAILS 39
+// Channels scanned for a stronger AP of the network while the signal is weak,
+// see CONFIG_UART_NIC_ROAM_RSSI
+#define STAT_ROAM_SCANS 40
+// Reassociations to a stronger AP started, and those that failed and fell
+// back to any AP of the network
+#define STAT_ROAMS 41
+#define STAT_ROAM_FAILS 42
+// Duration of the last successful roam, from leaving the old AP to
+// association with the new one, in milliseconds
+#define STAT_ROAM_LAST_MS 43
+// Control messages of the link check timer put off because the queue of the
+// UART TX thread was full
+#define STAT_TIMER_CTRL_DROPS 44
+// Packets from the host lost before the NIC parsed their header, found when
+// the host sends MSG_CREDIT
+#define STAT_EGRESS_LOST_HEADERS 45
+#define STAT_COUNT 46
+
+// intron
+// 12 as uint8_t
+// baud rate as uint32_t, one of BAUD_RATES
+//
+// NIC answers with the same message carrying the rate it switches to, or 0
+// when it keeps the current one, as the last one at the old rate. The host
+// switches once it receives the answer and confirms the new rate by sending
+// any message other than MSG_BAUD_PROBE. Unless that arrives within
+// BAUD_FALLBACK_MS, the NIC returns to the previous rate.
+#define MSG_SET_BAUD 12
+
+// Rates MSG_SET_BAUD may switch to, besides the one the NIC starts at
+#define BAUD_RATES 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, \
+    1000000, 1500000, 2000000, 2500000, 3000000, 4000000, 4600000
+
+// intron
+// 13 as uint8_t
+// token as uint32_t
+//
+// NIC answers with the same message, letting the host verify the link after
+// MSG_SET_BAUD before confirming the new rate.
+#define MSG_BAUD_PROBE 13
+
+#define BAUD_FALLBACK_MS 2000
+
+// intron
+// 14 as uint8_t
+// flags as uint8_t (MCAST_* bits)
+// hash filter as uint8_t[8]
+// address count N as uint8_t
+// addresses as uint8_t[N][6]
+//
+// Multicast frames from WiFi are passed to the host when their destination
+// is one of the addresses or its bit is set in the hash filter. The bit is
+// given by the top 6 bits of the CRC-32 of the address (as by
+// uart_proto_crc32), bit i is (1 << i % 8) in byte i / 8. Addresses over
+// MCAST_EXACT_MAX are ignored, they belong to the hash filter. Broadcast is
+// always passed. Until the host sends the message, all multicast is passed.
+#define MSG_SET_MCAST_FILTER 14
+
+// Pass all multicast frames, regardless of the lists
+#define MCAST_ACCEPT_ALL (1 << 0)
+#define MCAST_EXACT_MAX 8
+#define MCAST_HASH_LEN 8
+
+// intron
+// 15 as uint8_t
+// address count N as uint8_t
+// IPv4 addresses of the host as uint8_t[N][4]
+//
+// NIC answers ARP requests from WiFi for these addresses itself and drops ARP
+// messages for other targets, except gratuitous ARP. The host has to send the message again when
+// its addresses change. Addresses over ARP_OFFLOAD_MAX are ignored, an empty
+// list passes all ARP to the host again, as before the first message.
+#define MSG_SET_ARP_OFFLOAD 15
+
+#define ARP_OFFLOAD_MAX 4
+
+// intron
+// 16 as uint8_t
+// class as uint8_t (STORM_*)
+// rate as uint16_t, frames per second, 0 for no limit
+// burst as uint16_t, frames
+//
+// Limits broadcast and multicast frames from WiFi of the class, protecting
+// the UART from storms. Frames over the limit are dropped before they take
+// any resources. Defaults come from the NIC configuration.
+#define MSG_SET_STORM_LIMIT 16
+
+// Group addressed frames by EtherType
+#define STORM_ARP 0
+#define STORM_IPV4 1
+#define STORM_IPV6 2
+#define STORM_OTHER 3
+#define STORM_CLASSES 4
+
+// intron
+// 17 as uint8_t
+// IPv4 address of the default gateway as uint8_t[4], zeros when there is none
+//
+// Lets the NIC check the link is alive by ARP to the gateway rather than by
+// scanning for the AP once no packets arrive for a while.
+#define MSG_SET_GATEWAY 17
+
+// intron
+// 18 as uint8_t
+// action taken as uint8_t (CLIENTCONFIG_*)
+//
+// Sent by the NIC for every MSG_CLIENTCONFIG. The same credentials as the
+// running ones don't restart WiFi, hosts may send them whenever in doubt.
+#define MSG_CLIENTCONFIG_ACK 18
+
+// WiFi restarted with the new credentials, MSG_DEVINFO follows
+#define CLIENTCONFIG_RESTARTED 0
+// Credentials unchanged, not associated, connecting again
+#define CLIENTCONFIG_RECONNECTING 1
+// Credentials unchanged and associated, nothing done
+#define CLIENTCONFIG_UNCHANGED 2
+
+// intron
+// 19 as uint8_t
+// channel as uint8_t, 0 for all
+// flags as uint8_t (SCAN_* bits)
+// minimal dwell time per channel as uint16_t, ms, 0 for the default
+// maximal dwell time per channel as uint16_t, ms, 0 for the default
+// SSID length N as uint8_t, 0 for any SSID
+// SSID as uint8_t[N]
+//
+// Starts a scan in the background, packets keep flowing meanwhile. The NIC
+// answers with MSG_SCAN_RESULT for each AP found and MSG_SCAN_DONE. Passive
+// scans use the maximal dwell time only.
+#define MSG_SCAN_START 19
+
+// Listen for beacons instead of sending probe requests
+#define SCAN_PASSIVE (1 << 0)
+// Report APs hiding their SSID
+#define SCAN_SHOW_HIDDEN (1 << 1)
+
+// intron
+// 20 as uint8_t
+// BSSID as uint8_t[6]
+// channel as uint8_t
+// RSSI as int8_t, dBm
+// authentication mode as uint8_t (wifi_auth_mode_t of the SDK)
+// SSID length N as uint8_t
+// SSID as uint8_t[N]
+//
+// One AP found by MSG_SCAN_START, strongest first. At most
+// CONFIG_UART_NIC_SCAN_RESULTS_MAX APs are reported.
+#define MSG_SCAN_RESULT 20
+
+// intron
+// 21 as uint8_t
+// status as uint8_t (SCAN_STATUS_*)
+// APs reported as uint8_t
+//
+// Ends the answer to MSG_SCAN_START.
+#define MSG_SCAN_DONE 21
+
+#define SCAN_STATUS_OK 0
+// Another scan is running, try again later
+#define SCAN_STATUS_BUSY 1
+#define SCAN_STATUS_FAILED 2
+
+// intron
+// 22 as uint8_t
+//
+// NIC answers with MSG_LINK_INFO.
+#define MSG_GET_LINK_INFO 22
+
+// intron
+// 23 as uint8_t
+// associated as uint8_t, the rest is zeros when not
+// BSSID as uint8_t[6]
+// channel as uint8_t
+// RSSI as int8_t, dBm
+// PHY modes of the AP as uint8_t (LINK_PHY_* bits)
+// time associated as uint32_t, seconds
+//
+// Link quality as sampled every CONFIG_UART_NIC_LINK_CHECK_MS. Sent for
+// MSG_GET_LINK_INFO and with FEATURE_LINK_INFO enabled whenever the link goes
+// up or down, the AP or channel changes or the RSSI moved by
+// CONFIG_UART_NIC_LINK_INFO_RSSI_STEP dB since the last message.
+#define MSG_LINK_INFO 23
+
+#define LINK_PHY_11B (1 << 0)
+#define LINK_PHY_11G (1 << 1)
+#define LINK_PHY_11N (1 << 2)
+
+// NIC may send several packets in one MSG_PACKET_BATCH
+#define FEATURE_PACKET_BATCH (1 << 0)
+// NIC protects the messages it sends with CRC, see MSG_CRC_FLAG
+#define FEATURE_CRC (1 << 1)
+// NIC grants the host credits for sending packets, see MSG_CREDIT
+#define FEATURE_CREDITS (1 << 2)
+// NIC sends MSG_LINK_INFO on significant changes
+#define FEATURE_LINK_INFO (1 << 3)
+
+// Packets longer than this are considered a corrupted stream
+#define MAX_PACKET_SIZE 2000
+
+#define SSID_MAX_LEN 32
+#define PASS_MAX_LEN 64
+
+// Body of MSG_SET_MCAST_FILTER, in the wire layout
+typedef struct {
+    uint8_t flags;
+    uint8_t hash[MCAST_HASH_LEN];
+    // Number of valid addresses
+    uint8_t count;
+    uint8_t addrs[MCAST_EXACT_MAX][6];
+} mcast_filter;
+
+// Body of MSG_SET_ARP_OFFLOAD, in the wire layout
+typedef struct {
+    uint8_t count;
+    uint8_t addrs[ARP_OFFLOAD_MAX][4];
+} arp_offload;
+
+// Body of MSG_SCAN_START, in the wire layout
+typedef struct {
+    uint8_t channel;
+    uint8_t flags;
+    uint8_t dwell_min[2];
+    uint8_t dwell_max[2];
+    uint8_t ssid_len;
+    uint8_t ssid[SSID_MAX_LEN];
+} scan_request;
+
+typedef struct {
+    // Packet header was parsed. Return buffer for len bytes of packet data or
+    // NULL to skip the data.
+    uint8_t *(*packet_begin)(void *ctx, uint32_t len);
+    // Packet data were stored in the buffer returned by packet_begin
+    void (*packet_end)(void *ctx, uint8_t *data, uint32_t len);
+    // Packet data stored by packet_begin were corrupted, release the buffer
+    void (*packet_abort)(void *ctx, uint8_t *data);
+    // Packet with invalid size was dropped
+    void (*packet_invalid)(void *ctx, uint32_t len);
+    // Strings are not NUL terminated
+    void (*client_config)(void *ctx, const uint8_t *ssid, uint8_t ssid_len, const uint8_t *pass, uint8_t pass_len);
+    void (*get_link)(void *ctx);
+    void (*get_stats)(void *ctx);
+    void (*get_link_info)(void *ctx);
+    // The parser already uses the new intron when this is called
+    void (*intron)(void *ctx, const uint8_t *intron);
+    void (*set_features)(void *ctx, uint32_t features);
+    void (*credit_sync)(void *ctx, uint32_t sent);
+    // The parser already expects the new framing when this is called
+    void (*set_framing)(void *ctx, uint8_t framing);
+    void (*set_baud)(void *ctx, uint32_t baud);
+    void (*baud_probe)(void *ctx, uint32_t token);
+    void (*set_mcast_filter)(void *ctx, const mcast_filter *filter);
+    void (*set_arp_offload)(void *ctx, const arp_offload *offload);
+    void (*set_storm_limit)(void *ctx, uint8_t storm_class, uint16_t rate, uint16_t burst);
+    void (*set_gateway)(void *ctx, const uint8_t *ip);
+    // SSID is not NUL terminated, ssid_len 0 for any
+    void (*scan_start)(void *ctx, uint8_t channel, uint8_t flags, uint16_t dwell_min, uint16_t dwell_max, const uint8_t *ssid, uint8_t ssid_len);
+    void (*unknown)(void *ctx, uint8_t type);
+} uart_proto_callbacks;
+
+typedef enum {
+    PROTO_INTRON,
+    PROTO_TYPE,
+    PROTO_PACKET_LEN,
+    PROTO_PACKET_DATA,
+    PROTO_SSID_LEN,
+    PROTO_SSID,
+    PROTO_PASS_LEN,
+    PROTO_PASS,
+    // Message body of fixed size
+    PROTO_FIXED,
+    // Message body of a fixed part ending with an element count, followed by
+    // the elements
+    PROTO_LIST,
+    PROTO_CRC,
+    // Message done, skipping to the end of the COBS frame
+    PROTO_FRAME_END,
+} uart_proto_state;
+
+typedef struct {
+    const uart_proto_callbacks *cb;
+    void *ctx;
+
+    uint8_t framing;
+    // COBS decoder: data bytes left in the current block and whether the block
+    // ends with an implicit zero
+    uint8_t cobs_left;
+    bool cobs_zero;
+    // Seen a frame delimiter since switching to COBS
+    bool cobs_sync;
+
+    uint8_t intron[INTRON_LEN];
+    // KMP failure function of the intron: intron_fail[i] is the length of the
+    // longest proper prefix of intron[0..i] that is also its suffix.
+    uint8_t intron_fail[INTRON_LEN];
+
+    uart_proto_state state;
+    uint8_t type;
+    // The message carries CRC trailer
+    bool crc_frame;
+    uint32_t crc;
+    // Position within the current field (intron match length, bytes of
+    // length or data received)
+    uint32_t pos;
+
+    uint32_t packet_len;
+    // NULL when skipping packet data
+    uint8_t *packet_data;
+
+    // Lengths as sent, the excess over the buffer size is skipped
+    uint8_t ssid_len;
+    uint8_t pass_len;
+    uint8_t ssid[SSID_MAX_LEN];
+    uint8_t pass[PASS_MAX_LEN];
+
+    uint8_t fixed_len;
+    uint8_t fixed[INTRON_LEN];
+    // CRC trailer, the body of the message is still needed after it
+    uint8_t crc_trailer[sizeof(uint32_t)];
+
+    // Destination of PROTO_LIST, elements over its size are skipped
+    uint8_t *list;
+    uint8_t list_size;
+    // Length of the fixed part and of one element
+    uint8_t list_head;
+    uint8_t list_elem;
+
+    // Counts are as sent
+    mcast_filter mcast;
+    arp_offload arp;
+    scan_request scan;
+
+    // Valid messages delivered
+    uint32_t messages;
+    // Messages dropped due to CRC mismatch
+    uint32_t crc_errors;
+    // COBS frames that ended before their message was complete
+    uint32_t frame_errors;
+    // Intron found only after skipping bytes that were not part of a message
+    uint32_t resyncs;
+    // Bytes consumed while looking for the intron
+    uint32_t hunted;
+} uart_proto_parser;
+
+// Streaming COBS encoder, collects one block at a time
+typedef struct {
+    // Code byte followed by up to 254 data bytes
+    uint8_t block[255];
+    uint8_t len;
+} cobs_encoder;
+
+typedef void (*cobs_emit)(void *ctx, const uint8_t *data, size_t len);
+
+/**
+ * @brief Update CRC-32 with more data
+ *
+ * Start with crc = 0, the result of one call can be passed to the next one.
+ */
+uint32_t uart_proto_crc32(uint32_t crc, const uint8_t *data, size_t len);
+
+void cobs_encode_begin(cobs_encoder *enc);
+
+/**
+ * @brief Encode part of a frame, complete blocks are passed to emit
+ */
+void cobs_encode(cobs_encoder *enc, const uint8_t *data, size_t len, cobs_emit emit, void *ctx);
+
+/**
+ * @brief Emit the last block and the frame delimiter
+ */
+void cobs_encode_end(cobs_encoder *enc, cobs_emit emit, void *ctx);
+
+void uart_proto_init(uart_proto_parser *parser, const uart_proto_callbacks *cb, void *ctx, const uint8_t *intron);
+
+/**
+ * @brief Process a chunk of received bytes
+ *
+ * Callbacks are invoked synchronously for every message completed by the
+ * chunk. The chunk may end anywhere, the parser keeps its state.
+ */
+void uart_proto_feed(uart_proto_parser *parser, const uint8_t *data, size_t len);
+
+/**
+ * @brief Get the destination of packet data the parser is waiting for
+ *
+ * Allows reading the rest of a packet directly into its buffer instead of
+ * feeding it through an intermediate one. Not available with COBS framing.
+ *
+ * @param len Number of bytes still expected
+ * @return uint8_t* Where to store them or NULL when not receiving a packet
+ */
+uint8_t *uart_proto_direct_buffer(uart_proto_parser *parser, size_t *len);
+
+/**
+ * @brief Account bytes stored into the buffer from uart_proto_direct_buffer
+ */
+void uart_proto_direct_advance(uart_proto_parser *parser, size_t len);
@@ -0,0 +1,166 @@
+/* Interrupt driven UART0 TX
+
+  The ring is filled by one task at a time and drained by the ISR. Slots are
+  reused only after their completion callback ran in the task, the ISR just
+  moves its index past them. Indices are only written by their owner, the
+  interrupt is enabled together with publishing a descriptor so that the ISR
+  never misses one.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "uart_tx.h"
+
+#include <string.h>
+
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_attr.h"
+#include "driver/uart.h"
+#include "esp8266/uart_struct.h"
+#include "esp8266/uart_register.h"
+
+// Externals with no header, see 0002-Add-UART-TX-FIFO-empty-hook.patch
+esp_err_t uart_set_tx_empty_hook(uart_port_t uart_num, void (*hook)(void));
+
+typedef struct {
+    const uint8_t *payload;
+    uint16_t header_len;
+    uint16_t payload_len;
+    uart_tx_done done;
+    void *arg;
+    uint8_t header[UART_TX_HEADER_MAX];
+} uart_tx_desc;
+
+static uart_tx_desc ring[UART_TX_DESCRIPTORS];
+_Static_assert(UART_TX_DESCRIPTORS <= 256, "Ring indices are uint8_t");
+// Next slot to fill, written by the sending task
+static volatile uint8_t tx_head;
+// Slot being sent, written by the ISR
+static volatile uint8_t tx_isr;
+// Oldest slot not reaped yet, written by the reaping task
+static uint8_t tx_tail;
+// Bytes of the tx_isr slot already in the FIFO
+static uint16_t tx_pos;
+
+// Given by the ISR whenever a descriptor finished
+static SemaphoreHandle_t tx_done_sem;
+static void (*tx_wake)(BaseType_t *woken);
+
+static inline uint8_t IRAM_ATTR next(uint8_t i) {
+    return i + 1 == UART_TX_DESCRIPTORS ? 0 : i + 1;
+}
+
+static void IRAM_ATTR uart_tx_isr(void) {
+    BaseType_t woken = pdFALSE;
+    if (tx_isr == tx_head) {
+        // Nothing queued, the interrupt is a leftover
+        return;
+    }
+
+    size_t room = UART_FIFO_LEN - uart0.status.txfifo_cnt;
+    while (room && tx_isr != tx_head) {
+        const uart_tx_desc *d = &ring[tx_isr];
+        const uint8_t *src;
+        size_t left;
+        if (tx_pos < d->header_len) {
+            src = d->header + tx_pos;
+            left = d->header_len - tx_pos;
+        } else {
+            src = d->payload + (tx_pos - d->header_len);
+            left = d->header_len + d->payload_len - tx_pos;
+        }
+        const size_t n = left < room ? left : room;
+        for (size_t i = 0; i < n; ++i) {
+            uart0.fifo.rw_byte = src[i];
+        }
+        room -= n;
+        tx_pos += n;
+        if (tx_pos == d->header_len + d->payload_len) {
+            tx_pos = 0;
+            tx_isr = next(tx_isr);
+            xSemaphoreGiveFromISR(tx_done_sem, &woken);
+            if (d->done) {
+                tx_wake(&woken);
+            }
+        }
+    }
+
+    if (tx_isr == tx_head) {
+        uart0.int_ena.txfifo_empty = 0;
+    }
+    uart0.int_clr.txfifo_empty = 1;
+
+    if (woken == pdTRUE) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+void uart_tx_init(void (*wake)(BaseType_t *woken)) {
+    tx_done_sem = xSemaphoreCreateBinary();
+    tx_wake = wake;
+    uart_set_tx_empty_hook(UART_NUM_0, uart_tx_isr);
+}
+
+void IRAM_ATTR uart_tx_reap(void) {
+    while (tx_tail != tx_isr) {
+        uart_tx_desc *d = &ring[tx_tail];
+        if (d->done) {
+            d->done(d->arg);
+        }
+        tx_tail = next(tx_tail);
+    }
+}
+
+// Publish the filled slot and let the ISR pick it up
+static void IRAM_ATTR commit(void) {
+    portENTER_CRITICAL();
+    tx_head = next(tx_head);
+    uart0.int_ena.txfifo_empty = 1;
+    portEXIT_CRITICAL();
+}
+
+static uart_tx_desc *IRAM_ATTR take_slot(void) {
+    while (next(tx_head) == tx_tail) {
+        uart_tx_reap();
+        if (next(tx_head) != tx_tail) {
+            break;
+        }
+        xSemaphoreTake(tx_done_sem, portMAX_DELAY);
+    }
+    return &ring[tx_head];
+}
+
+void IRAM_ATTR uart_tx_send(const void *header, size_t header_len, const void *payload, size_t payload_len, uart_tx_done done, void *arg) {
+    const uint8_t *h = header;
+    // Leading part of a long header goes alone
+    while (header_len > UART_TX_HEADER_MAX) {
+        uart_tx_desc *d = take_slot();
+        memcpy(d->header, h, UART_TX_HEADER_MAX);
+        d->header_len = UART_TX_HEADER_MAX;
+        d->payload_len = 0;
+        d->done = NULL;
+        commit();
+        h += UART_TX_HEADER_MAX;
+        header_len -= UART_TX_HEADER_MAX;
+    }
+
+    uart_tx_desc *d = take_slot();
+    if (header_len) {
+        memcpy(d->header, h, header_len);
+    }
+    d->header_len = header_len;
+    d->payload = payload;
+    d->payload_len = payload_len;
+    d->done = done;
+    d->arg = arg;
+    commit();
+}
+
+void IRAM_ATTR uart_tx_wait_idle(void) {
+    while (tx_isr != tx_head) {
+        xSemaphoreTake(tx_done_sem, portMAX_DELAY);
+    }
+}
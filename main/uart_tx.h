@@ -0,0 +1,57 @@
+/* Interrupt driven UART0 TX
+
+  Descriptors queued to a ring are streamed into the TX FIFO by the TX FIFO
+  empty interrupt. A descriptor carries a small header copied into the ring
+  and a payload sent from where it lies, so large data are copied just once,
+  straight into the FIFO. The UART driver keeps handling RX, it passes the
+  interrupt on thanks to 0002-Add-UART-TX-FIFO-empty-hook.patch.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "freertos/FreeRTOS.h"
+
+// Longer headers take more descriptors
+#define UART_TX_HEADER_MAX 32
+#define UART_TX_DESCRIPTORS CONFIG_UART_NIC_TX_DESCRIPTORS
+
+// Called from uart_tx_reap once the payload is in the FIFO
+typedef void (*uart_tx_done)(void *arg);
+
+/**
+ * @brief Take over the TX FIFO empty interrupt of UART0
+ *
+ * @param wake Called from the ISR when a descriptor with a completion
+ * callback finished, to get uart_tx_reap called soon
+ */
+void uart_tx_init(void (*wake)(BaseType_t *woken));
+
+/**
+ * @brief Queue data for sending
+ *
+ * Blocks while the ring is full. Calls of uart_tx_send and uart_tx_reap must
+ * be serialized by the caller. Nothing else may write to the UART until
+ * uart_tx_wait_idle returns.
+ *
+ * @param header Copied into the ring, may be NULL
+ * @param payload Sent in place, must stay intact until done is called
+ * @param done Completion callback or NULL
+ */
+void uart_tx_send(const void *header, size_t header_len, const void *payload, size_t payload_len, uart_tx_done done, void *arg);
+
+/**
+ * @brief Call completion callbacks of descriptors already sent
+ */
+void uart_tx_reap(void);
+
+/**
+ * @brief Wait until everything queued is in the FIFO
+ */
+void uart_tx_wait_idle(void);
@@ -1,13 +1,15 @@
 #!/bin/python
 
 import struct
-from time import sleep
+from time import sleep, monotonic
 import datetime
 import fcntl
 import serial
 import os
 import sys
-from threading import Thread, Lock
+import io
+import zlib
+from threading import Thread, Lock, RLock, Condition, Event
 
 from pathlib import Path
 
@@ -23,11 +25,141 @@ MSG_LINK = 1
 MSG_GET_LINK = 2
 MSG_CLIENTCONFIG = 3
 MSG_PACKET = 4
+MSG_INTRON = 5
+MSG_SET_FEATURES = 6
+MSG_PACKET_BATCH = 7
+MSG_SET_FRAMING = 8
+MSG_CREDIT = 9
+MSG_GET_STATS = 10
+MSG_STATS = 11
+MSG_SET_BAUD = 12
+MSG_BAUD_PROBE = 13
+MSG_SET_MCAST_FILTER = 14
+MSG_SET_ARP_OFFLOAD = 15
+MSG_SET_STORM_LIMIT = 16
+MSG_SET_GATEWAY = 17
+MSG_CLIENTCONFIG_ACK = 18
+MSG_SCAN_START = 19
+MSG_SCAN_RESULT = 20
+MSG_SCAN_DONE = 21
+MSG_GET_LINK_INFO = 22
+MSG_LINK_INFO = 23
+MSG_CRC_FLAG = 0x80
+
+CLIENTCONFIG_ACTIONS = ["restarted", "reconnecting", "unchanged"]
+
+SCAN_PASSIVE = 1 << 0
+SCAN_SHOW_HIDDEN = 1 << 1
+SCAN_STATUSES = ["ok", "busy", "failed"]
+
+LINK_PHYS = ["b", "g", "n"]
+
+FRAMING_INTRON = 0
+FRAMING_COBS = 1
+
+FEATURE_PACKET_BATCH = 1 << 0
+FEATURE_CRC = 1 << 1
+FEATURE_CREDITS = 1 << 2
+FEATURE_LINK_INFO = 1 << 3
+
+MCAST_ACCEPT_ALL = 1 << 0
+MCAST_EXACT_MAX = 8
+ARP_OFFLOAD_MAX = 4
+
+STORM_ARP = 0
+STORM_IPV4 = 1
+STORM_IPV6 = 2
+STORM_OTHER = 3
+IFF_PROMISC = 0x100
+IFF_ALLMULTI = 0x200
+
+# Protocol extensions to enable when the NIC supports them
+FEATURES = FEATURE_PACKET_BATCH | FEATURE_CRC | FEATURE_CREDITS | FEATURE_LINK_INFO
+# Send the NIC our count of packets when no credit arrives for this long, in
+# case it missed some packet headers and the counts went out of sync
+CREDIT_TIMEOUT = 0.1
+# Framing to switch to when the NIC supports it
+FRAMING = FRAMING_COBS
+# Hardware flow control, needs RTS/CTS wired and CONFIG_UART_NIC_HW_FLOWCTRL
+RTSCTS = False
+
+# Names of the NIC counters in MSG_STATS, in STAT_* order
+STATS = [
+    "uart_fifo_ovf",
+    "uart_buffer_full",
+    "uart_frame_err",
+    "crc_errors",
+    "cobs_frame_errors",
+    "egress_queue_drops",
+    "ingress_queue_drops",
+    "egress_pool_exhausted",
+    "ingress_pool_exhausted",
+    "egress_packets",
+    "egress_bytes",
+    "ingress_packets",
+    "ingress_bytes",
+    "ingress_filtered",
+    "wifi_tx_errors",
+    "invalid_packet_size",
+    "intron_resyncs",
+    "probes",
+    "egress_buffers_high",
+    "ingress_buffers_high",
+    "ingress_control_drops",
+    "ingress_ack_drops",
+    "ingress_bulk_drops",
+    "codel_drops",
+    "ingress_sojourn_max_us",
+    "mcast_filtered",
+    "arp_replies",
+    "arp_filtered",
+    "storm_arp_drops",
+    "storm_ipv4_drops",
+    "storm_ipv6_drops",
+    "storm_other_drops",
+    "probe_arp_ok",
+    "probe_scan_ok",
+    "probe_failed",
+    "probe_last_ms",
+    "probe_max_ms",
+    "link_time_ms",
+    "fast_connects",
+    "fast_connect_fails",
+    "roam_scans",
+    "roams",
+    "roam_fails",
+    "roam_last_ms",
+    "timer_ctrl_drops",
+    "egress_lost_headers",
+]
+# Seconds between dumps of the NIC counters, None to disable
+STATS_INTERVAL = 60
+# Seconds between checks of the multicast groups, IPv4 addresses and gateway
+# of the interface, None to let the NIC pass all multicast and ARP and scan
+# for the AP to check the link
+OFFLOAD_INTERVAL = 5
+# Rate limits of broadcast and multicast from WiFi to set on the NIC, as
+# class: (frames per second, burst), others keep the NIC defaults
+STORM_LIMITS = {}
+# Seconds between scans for APs printed as they come, None for no scans
+SCAN_INTERVAL = None
 
 INTRON = b"UN\x00\x01\x02\x03\x04\x05"
 INTERFACE = "tap0"
 SERIAL = sys.argv[1] if len(sys.argv) == 2 else "/dev/ttyUSB0"
-BAUD_RATE = 1000000 #921600
+# Same as CONFIG_UART_NIC_BAUD_RATE, the rate the printer uses
+BAUD_RATE = 4600000
+# Rate to switch to once the NIC reports its version, one of BAUD_RATES in
+# uart_proto.h, None to stay at BAUD_RATE
+TARGET_BAUD_RATE = None
+# How long to wait for each answer while switching and how many probes to try
+BAUD_TIMEOUT = 0.25
+BAUD_PROBES = 4
+# NIC returns to the old rate when the new one is not confirmed by then, see
+# BAUD_FALLBACK_MS in uart_proto.h
+BAUD_FALLBACK = 2
+# How long to wait for the NIC to acknowledge a framing switch
+FRAMING_TIMEOUT = 0.5
 SSID = "esptest"
 PASS = "lwesp8266"
 MTU = 1420
@@ -40,7 +172,8 @@ fcntl.ioctl(tap, TUNSETIFF, ifr)
 fcntl.ioctl(tap, TUNSETOWNER, os.getuid())
 
 
-ser = serial.Serial(SERIAL, baudrate=BAUD_RATE, parity=serial.PARITY_NONE)
+ser = serial.Serial(SERIAL, baudrate=BAUD_RATE, parity=serial.PARITY_NONE, rtscts=RTSCTS)
+nic_version = 0
 last_in = datetime.datetime.now()
 lock = Lock()
 
@@ -51,11 +184,23 @@ def safe(b: bytes):
         return b
 
 
+# Received bytes to be read again
+pending = bytearray()
+
+
+def raw_read(size: int) -> bytes:
+    data = bytes(pending[:size])
+    del pending[:size]
+    if len(data) < size:
+        data += ser.read(size - len(data))
+    return data
+
+
 def wait_for_intron():
     # print("TAP: Waiting for intron")
     pos = 0
     while pos < len(INTRON):
-        c = ser.read(1)[0]
+        c = raw_read(1)[0]
         if c == INTRON[pos]:
             pos = pos + 1
             # print(f"TAP: INTRON: pos: {pos}, byte: {bytes([c])}")
@@ -67,19 +212,177 @@ def wait_for_intron():
     # print("TAP: intron found")
 
 
-def recv_packet():
+def cobs_encode(data: bytes) -> bytes:
+    out = bytearray()
+    block = bytearray()
+    for c in data:
+        if c == 0:
+            out.append(len(block) + 1)
+            out += block
+            block.clear()
+        else:
+            block.append(c)
+            if len(block) == 254:
+                out.append(0xFF)
+                out += block
+                block.clear()
+    out.append(len(block) + 1)
+    out += block
+    return bytes(out)
+
+
+def cobs_decode(data: bytes) -> bytes:
+    out = bytearray()
+    pos = 0
+    while pos < len(data):
+        code = data[pos]
+        pos += 1
+        if pos + code - 1 > len(data):
+            raise ValueError("Truncated COBS block")
+        out += data[pos:pos + code - 1]
+        pos += code - 1
+        if code < 0xFF and pos < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+rx_cobs = False
+tx_cobs = False
+# Last bytes of the previous COBS frame, the intron may span frames
+cobs_tail = b""
+
+
+def wait_for_cobs_frame():
+    """Read one COBS frame, None if the NIC went back to intron framing"""
+    global rx_cobs, tx_cobs, cobs_tail
+    pos = pending.find(0)
+    if pos >= 0:
+        data = raw_read(pos + 1)
+    else:
+        data = raw_read(len(pending)) + ser.read_until(b"\x00")
+
+    # The NIC restarted and uses the intron again
+    combined = cobs_tail + data
+    pos = combined.find(INTRON)
+    if pos >= 0:
+        print("TAP: NIC switched back to intron framing")
+        rx_cobs = False
+        tx_cobs = False
+        cobs_tail = b""
+        pending[:0] = combined[pos:]
+        return None
+    cobs_tail = combined[-(len(INTRON) - 1):]
+
+    return data[:-1]
+
+
+# Bytes of the message being received, for the CRC check
+frame = bytearray()
+# Decoded COBS frame the message is read from, None with intron framing
+source = None
+
+
+def read(size: int) -> bytes:
+    data = source.read(size) if source else raw_read(size)
+    if len(data) < size:
+        raise EOFError("Message truncated")
+    frame.extend(data)
+    return data
+
+
+def deliver(packets):
     global last_in
-    len_data = ser.read(4)
+    for packet in packets:
+        # print(f"SIN : {packet.hex()}")
+        try:
+            os.write(tap, packet)
+        except IOError:
+            print("TAP: FAILED TO WRITE")
+    with lock:
+        last_in = datetime.datetime.now()
+
+
+# The recv_* functions read a message body and return what to do with it once
+# it is known to be intact
+
+
+def recv_packet():
+    len_data = read(4)
     len = int.from_bytes(len_data, "little", signed=False)
     # print(f"TAP: packet len: {len}, data: {len_data.hex()}")
-    packet = ser.read(len)
-    # print(f"SIN : {packet.hex()}")
-    try:
-        os.write(tap, packet)
-        with lock:
-            last_in = datetime.datetime.now()
-    except IOError:
-        print("TAP: FAILED TO WRITE")
+    packet = read(len)
+    return lambda: deliver([packet])
+
+
+def recv_packet_batch():
+    count = read(1)[0]
+    lens = struct.unpack(f"<{count}H", read(2 * count))
+    # print(f"TAP: packet batch: {lens}")
+    data = read(sum(lens))
+    packets = []
+    pos = 0
+    for len in lens:
+        packets.append(data[pos:pos + len])
+        pos += len
+    return lambda: deliver(packets)
+
+
+# Send messages with CRC, enabled once the NIC is known to support it
+tx_crc = False
+
+
+# Credit flow control, see MSG_CREDIT in uart_proto.h
+credit = Condition()
+credits_enabled = False
+credit_limit = 0
+packets_sent = 0
+# Counts sent to the NIC after waiting CREDIT_TIMEOUT for credit
+credit_syncs = 0
+
+
+def send_features(supported: int):
+    global tx_crc, credits_enabled, credit_limit, packets_sent
+    enable = FEATURES & supported
+    print(f"TAP: Enabling features: {enable:#x}")
+    with credit:
+        send_message(MSG_SET_FEATURES, enable.to_bytes(4, "little"))
+        credits_enabled = bool(enable & FEATURE_CREDITS)
+        credit_limit = 0
+        packets_sent = 0
+    tx_crc = bool(enable & FEATURE_CRC)
+    if enable & FEATURE_LINK_INFO:
+        # Changes come from now on, start with the current state
+        send_message(MSG_GET_LINK_INFO)
+
+
+def set_credit(limit: int):
+    global credit_limit
+    with credit:
+        credit_limit = limit
+        credit.notify_all()
+
+
+def recv_credit():
+    limit = int.from_bytes(read(4), "little", signed=False)
+    return lambda: set_credit(limit)
+
+
+def have_credit():
+    return 0 < (credit_limit - packets_sent) & 0xFFFFFFFF < 0x80000000
+
+
+def send_packet(packet: bytes):
+    global packets_sent, credit_syncs
+    with credit:
+        if credits_enabled:
+            while not credit.wait_for(have_credit, CREDIT_TIMEOUT):
+                if not credits_enabled:
+                    break
+                credit_syncs += 1
+                print(f"TAP: No credit, syncing packet count ({credit_syncs})")
+                send_message(MSG_CREDIT, packets_sent.to_bytes(4, "little"))
+            packets_sent = (packets_sent + 1) & 0xFFFFFFFF
+        send_message(MSG_PACKET, len(packet).to_bytes(4, "little", signed=False) + packet)
 
 
 def send_wifi_client():
@@ -87,17 +390,32 @@ def send_wifi_client():
 
     ssid_data = SSID.encode()
     pass_data = PASS.encode()
-    header = INTRON + MSG_CLIENTCONFIG.to_bytes(1, "little")
     ssid_part = len(ssid_data).to_bytes(length=1, byteorder="little", signed=False) + ssid_data
     pass_part = len(pass_data).to_bytes(length=1, byteorder="little", signed=False) + pass_data
 
-    send_message(header + ssid_part + pass_part)
+    send_message(MSG_CLIENTCONFIG, ssid_part + pass_part)
 
 
-send_lock = Lock()
+# Reentrant to let baud rate switching keep other senders out
+send_lock = RLock()
+
+
+def send_message(type: int, body: bytes = b""):
+    # Framing may not change between encoding and sending
+    with send_lock:
+        if tx_crc:
+            header = (type | MSG_CRC_FLAG).to_bytes(1, "little")
+            data = header + body + zlib.crc32(header + body).to_bytes(4, "little")
+        else:
+            data = type.to_bytes(1, "little") + body
+        if tx_cobs:
+            data = cobs_encode(data) + b"\x00"
+        else:
+            data = INTRON + data
+        send_raw(data)
 
 
-def send_message(data: bytes):
+def send_raw(data: bytes):
     with send_lock:
         ser.write(data)
         try:
@@ -107,11 +425,13 @@ def send_message(data: bytes):
 
 
 link_up = False
+# When the last MSG_GET_LINK went out, to measure how long the answer takes
+# to get through the packets queued in the NIC
+link_requested = None
+link_latency_max = 0.0
 
 
-def recv_link():
-    up_data = ser.read(1)
-    up = int.from_bytes(up_data, "little", signed=False) == 1
+def set_link(up: bool):
     link_up = up
     word = "up" if up else "down"
     print(f"TAP: Setting link {word}")
@@ -121,33 +441,290 @@ def recv_link():
         send_wifi_client()
 
 
-def recv_devinfo():
-    # ESP FW version
-    version = int.from_bytes(ser.read(2), "little", signed=False)
+def link_latency(received: float):
+    global link_requested, link_latency_max
+    if link_requested is None:
+        return
+    latency = received - link_requested
+    link_requested = None
+    link_latency_max = max(link_latency_max, latency)
+    print(f"TAP: Link status latency: {latency * 1000:.1f} ms, max: {link_latency_max * 1000:.1f} ms")
+
+
+def recv_link():
+    received = monotonic()
+    up_data = read(1)
+    up = int.from_bytes(up_data, "little", signed=False) == 1
+
+    def action():
+        link_latency(received)
+        set_link(up)
+    return action
+
+
+def recv_link_info():
+    up = read(1)[0]
+    bssid = read(MAC_LEN)
+    channel, rssi, phy, uptime = struct.unpack("<BbBI", read(7))
+    if not up:
+        return lambda: print("TAP: Link info: not associated")
+    modes = "".join(m for i, m in enumerate(LINK_PHYS) if phy & (1 << i))
+    return lambda: print(f"TAP: Link info: {bssid.hex(':')} channel {channel} rssi {rssi} 802.11{modes} up {uptime} s")
+
+
+devinfo_received = Event()
+# Multicast filter and ARP offload need to be sent again
+offload_reset = Event()
+
+
+def set_devinfo(version: int, mac: bytes, supported: int, link_time):
+    global nic_version
     print(f"TAP: ESP FW version: {version}")
+    nic_version = version
+    if link_time:
+        print(f"TAP: Last connection took {link_time} ms")
 
-    mac = ser.read(MAC_LEN)
     print(f"TAP: Device info mac: {mac.hex(' ')}")
     print(f"TAP: ip link set {INTERFACE} address {mac.hex(':')}")
     os.system(f"ip link set {INTERFACE} address {mac.hex(':')}")
     print(f"ip link set {INTERFACE} mtu {MTU}")
     os.system(f"ip link set {INTERFACE} mtu {MTU}")
 
+    if version >= 9:
+        print(f"TAP: Supported features: {supported:#x}")
+        send_features(supported)
+    if version >= 13:
+        # The NIC starts over with all multicast and ARP passed
+        offload_reset.set()
+    if version >= 15:
+        for storm_class, (rate, burst) in STORM_LIMITS.items():
+            send_message(MSG_SET_STORM_LIMIT, struct.pack("<BHH", storm_class, rate, burst))
+    if version >= 10:
+        # Waits for the answer, which comes through this thread
+        Thread(target=send_framing, args=(FRAMING,), daemon=True).start()
+    devinfo_received.set()
+
+
+# Framing switching, see MSG_SET_FRAMING in uart_proto.h. The acknowledgment
+# is handed over to send_framing while it waits.
+framing_switch = Condition()
+framing_waiting = False
+framing_ack = None
+
+
+def apply_tx_framing(framing: int):
+    global tx_cobs
+    tx_cobs = framing == FRAMING_COBS
+    if tx_cobs:
+        # Delimiter to let the NIC synchronize
+        send_raw(b"\x00")
+
+
+def send_framing(framing: int):
+    global framing_waiting, framing_ack
+    print(f"TAP: Switching framing: {framing}")
+    # Nothing goes out until the NIC tells which framing it expects
+    with send_lock:
+        with framing_switch:
+            framing_waiting = True
+            framing_ack = None
+        send_message(MSG_SET_FRAMING, framing.to_bytes(1, "little"))
+        with framing_switch:
+            acked = framing_switch.wait_for(lambda: framing_ack is not None, FRAMING_TIMEOUT)
+            framing_waiting = False
+        if not acked:
+            print("TAP: Framing switch not acknowledged yet, keeping the old one")
+            return
+        if framing_ack != framing:
+            print(f"TAP: NIC refused framing {framing}")
+        apply_tx_framing(framing_ack)
+
+
+def set_framing(framing: int):
+    global rx_cobs, cobs_tail, framing_ack
+    # Acknowledged, the NIC uses the new framing from now on
+    rx_cobs = framing == FRAMING_COBS
+    cobs_tail = b""
+    with framing_switch:
+        if framing_waiting:
+            framing_ack = framing
+            framing_switch.notify_all()
+            return
+    # Too late for send_framing, follow the NIC anyway
+    with send_lock:
+        apply_tx_framing(framing)
+
+
+def recv_framing():
+    framing = read(1)[0]
+    return lambda: set_framing(framing)
+
+
+# Baud rate switching, see MSG_SET_BAUD in uart_proto.h
+baud = Condition()
+baud_ack = None
+baud_echo = None
+
+
+def set_baud_ack(rate: int):
+    global baud_ack
+    with baud:
+        baud_ack = rate
+        baud.notify_all()
+
+
+def recv_baud():
+    rate = int.from_bytes(read(4), "little", signed=False)
+    return lambda: set_baud_ack(rate)
+
+
+def set_baud_echo(token: int):
+    global baud_echo
+    with baud:
+        baud_echo = token
+        baud.notify_all()
+
+
+def recv_baud_probe():
+    token = int.from_bytes(read(4), "little", signed=False)
+    return lambda: set_baud_echo(token)
+
+
+def switch_baud(rate: int):
+    global baud_ack, baud_echo
+    old = ser.baudrate
+    print(f"TAP: Switching baud rate: {old} -> {rate}")
+    with send_lock:
+        with baud:
+            baud_ack = None
+        send_message(MSG_SET_BAUD, rate.to_bytes(4, "little"))
+        with baud:
+            if not baud.wait_for(lambda: baud_ack is not None, BAUD_TIMEOUT):
+                print("TAP: Baud rate switch not acknowledged")
+                return
+            if baud_ack != rate:
+                print(f"TAP: NIC refused baud rate {rate}")
+                return
+        ser.baudrate = rate
+        if tx_cobs:
+            # Delimiter to let the NIC synchronize after the garbage
+            send_raw(b"\x00")
+        for _ in range(BAUD_PROBES):
+            token = int.from_bytes(os.urandom(4), "little")
+            send_message(MSG_BAUD_PROBE, token.to_bytes(4, "little"))
+            with baud:
+                if baud.wait_for(lambda: baud_echo == token, BAUD_TIMEOUT):
+                    # Any message but a probe confirms the rate
+                    send_message(MSG_GET_LINK)
+                    print(f"TAP: Running at {rate} baud")
+                    return
+        print(f"TAP: No answer at {rate} baud, returning to {old}")
+        ser.baudrate = old
+        # Let the NIC give up on the new rate as well
+        sleep(BAUD_FALLBACK)
+
+
+def recv_clientconfig_ack():
+    action = read(1)[0]
+    name = CLIENTCONFIG_ACTIONS[action] if action < len(CLIENTCONFIG_ACTIONS) else action
+    return lambda: print(f"TAP: Client config: {name}")
+
+
+def recv_scan_result():
+    bssid = read(MAC_LEN)
+    channel, rssi, auth, ssid_len = struct.unpack("<BbBB", read(4))
+    ssid = read(ssid_len).decode(errors="replace")
+    return lambda: print(f"TAP: AP {bssid.hex(':')} channel {channel} rssi {rssi} auth {auth} ssid: {ssid}")
+
+
+def recv_scan_done():
+    status, count = read(2)
+    name = SCAN_STATUSES[status] if status < len(SCAN_STATUSES) else status
+    return lambda: print(f"TAP: Scan {name}, {count} APs")
+
+
+def recv_devinfo():
+    # ESP FW version
+    version = int.from_bytes(read(2), "little", signed=False)
+    mac = read(MAC_LEN)
+    supported = 0
+    if version >= 9:
+        supported = int.from_bytes(read(4), "little", signed=False)
+    link_time = None
+    if version >= 17:
+        link_time = int.from_bytes(read(4), "little", signed=False)
+    return lambda: set_devinfo(version, mac, supported, link_time)
+
+
+def set_stats(counters):
+    names = [STATS[i] if i < len(STATS) else f"stat{i}" for i in range(len(counters))]
+    print("TAP: NIC stats: " + ", ".join(f"{n}={c}" for n, c in zip(names, counters)))
+
+
+def recv_stats():
+    count = read(1)[0]
+    counters = struct.unpack(f"<{count}I", read(4 * count))
+    return lambda: set_stats(counters)
+
 
 def recv_message():
-    wait_for_intron()
-    type_data = ser.read(1)
+    global source
+    if rx_cobs:
+        data = wait_for_cobs_frame()
+        if not data:
+            return
+        try:
+            source = io.BytesIO(cobs_decode(data))
+        except ValueError:
+            print("TAP: Invalid COBS frame")
+            return
+    else:
+        source = None
+        wait_for_intron()
+    frame.clear()
+    type_data = read(1)
     # print(f"TAP: Receiving message type: {type_data}")
 
     type_value = int.from_bytes(type_data, "little", signed=False)
+    crc = type_value & MSG_CRC_FLAG
+    type_value &= ~MSG_CRC_FLAG
     if type_value == MSG_PACKET:
-        recv_packet()
+        action = recv_packet()
     elif type_value == MSG_LINK:
-        recv_link()
+        action = recv_link()
     elif type_value == MSG_DEVINFO:
-        recv_devinfo()
+        action = recv_devinfo()
+    elif type_value == MSG_PACKET_BATCH:
+        action = recv_packet_batch()
+    elif type_value == MSG_SET_FRAMING:
+        action = recv_framing()
+    elif type_value == MSG_CREDIT:
+        action = recv_credit()
+    elif type_value == MSG_STATS:
+        action = recv_stats()
+    elif type_value == MSG_SET_BAUD:
+        action = recv_baud()
+    elif type_value == MSG_BAUD_PROBE:
+        action = recv_baud_probe()
+    elif type_value == MSG_CLIENTCONFIG_ACK:
+        action = recv_clientconfig_ack()
+    elif type_value == MSG_SCAN_RESULT:
+        action = recv_scan_result()
+    elif type_value == MSG_SCAN_DONE:
+        action = recv_scan_done()
+    elif type_value == MSG_LINK_INFO:
+        action = recv_link_info()
     else:
         print(f"TAP: Unknown message type: {type_value}")
+        return
+
+    if crc:
+        trailer = source.read(4) if source else raw_read(4)
+        expected = int.from_bytes(trailer, "little", signed=False)
+        if zlib.crc32(frame) != expected:
+            print(f"TAP: CRC mismatch, dropping message type: {type_value}")
+            return
+    action()
 
 
 def serial_thread():
@@ -162,18 +739,136 @@ Thread(target=serial_thread, daemon=True).start()
 
 
 def ping_thread():
+    global link_requested
     while True:
         sleep(30)
         print("###### Sending getlink")
-        send_message(INTRON + MSG_GET_LINK.to_bytes(1, "little"))
+        send_message(MSG_GET_LINK)
+        link_requested = monotonic()
 
 
 Thread(target=ping_thread, daemon=True).start()
 
 
+def stats_thread():
+    while True:
+        sleep(STATS_INTERVAL)
+        if nic_version >= 11:
+            send_message(MSG_GET_STATS)
+
+
+if STATS_INTERVAL:
+    Thread(target=stats_thread, daemon=True).start()
+
+
+def mcast_filter():
+    """Filter flags and addresses the kernel listens to on the interface"""
+    flags = int(Path(f"/sys/class/net/{INTERFACE}/flags").read_text(), 16)
+    if flags & (IFF_PROMISC | IFF_ALLMULTI):
+        return MCAST_ACCEPT_ALL, []
+    addrs = []
+    for line in Path("/proc/net/dev_mcast").read_text().splitlines():
+        # index, interface, users, global users, address
+        fields = line.split()
+        if len(fields) == 5 and fields[1] == INTERFACE:
+            addrs.append(bytes.fromhex(fields[4]))
+    return 0, sorted(addrs)
+
+
+def send_mcast_filter(flags: int, addrs):
+    """Exact match for the first addresses, the hash filter for the rest"""
+    exact = addrs[:MCAST_EXACT_MAX]
+    hash = 0
+    for addr in addrs[MCAST_EXACT_MAX:]:
+        hash |= 1 << (zlib.crc32(addr) >> 26)
+    print(f"TAP: Multicast filter: flags {flags:#x}, {len(addrs)} addresses")
+    send_message(MSG_SET_MCAST_FILTER, bytes([flags]) + hash.to_bytes(8, "little") + bytes([len(exact)]) + b"".join(exact))
+
+
+def arp_addresses():
+    """IPv4 addresses of the interface"""
+    addrs = []
+    for line in os.popen(f"ip -o -4 addr show dev {INTERFACE}").read().splitlines():
+        # index: interface inet address/prefix ...
+        fields = line.split()
+        if len(fields) > 3 and fields[2] == "inet":
+            addrs.append(bytes(int(b) for b in fields[3].split("/")[0].split(".")))
+    return sorted(addrs)[:ARP_OFFLOAD_MAX]
+
+
+def send_arp_offload(addrs):
+    print(f"TAP: ARP offload: {', '.join('.'.join(str(b) for b in addr) for addr in addrs)}")
+    send_message(MSG_SET_ARP_OFFLOAD, bytes([len(addrs)]) + b"".join(addrs))
+
+
+def gateway():
+    """IPv4 address of the default gateway on the interface, zeros if none"""
+    for line in os.popen(f"ip -4 route show default dev {INTERFACE}").read().splitlines():
+        # default via address ...
+        fields = line.split()
+        if len(fields) > 2 and fields[1] == "via":
+            return bytes(int(b) for b in fields[2].split("."))
+    return bytes(4)
+
+
+def send_gateway(addr: bytes):
+    print(f"TAP: Gateway: {'.'.join(str(b) for b in addr)}")
+    send_message(MSG_SET_GATEWAY, addr)
+
+
+def offload_thread():
+    sent_mcast = None
+    sent_arp = None
+    sent_gateway = None
+    while True:
+        if offload_reset.wait(OFFLOAD_INTERVAL):
+            offload_reset.clear()
+            sent_mcast = None
+            sent_arp = None
+            sent_gateway = None
+        if nic_version >= 13:
+            current = mcast_filter()
+            if current != sent_mcast:
+                send_mcast_filter(*current)
+                sent_mcast = current
+        if nic_version >= 14:
+            current = arp_addresses()
+            if current != sent_arp:
+                send_arp_offload(current)
+                sent_arp = current
+        if nic_version >= 16:
+            current = gateway()
+            if current != sent_gateway:
+                send_gateway(current)
+                sent_gateway = current
+
+
+if OFFLOAD_INTERVAL:
+    Thread(target=offload_thread, daemon=True).start()
+
+
+def send_scan(channel=0, flags=SCAN_SHOW_HIDDEN, dwell_min=0, dwell_max=0, ssid=b""):
+    send_message(MSG_SCAN_START, struct.pack("<BBHHB", channel, flags, dwell_min, dwell_max, len(ssid)) + ssid)
+
+
+def scan_thread():
+    while True:
+        sleep(SCAN_INTERVAL)
+        if nic_version >= 19:
+            send_scan()
+
+
+if SCAN_INTERVAL:
+    Thread(target=scan_thread, daemon=True).start()
+
+
 print("TAP: Configuring wifi")
 send_wifi_client()
 
+# Devinfo only comes when the NIC boots
+if TARGET_BAUD_RATE and TARGET_BAUD_RATE != BAUD_RATE and devinfo_received.wait(5) and nic_version >= 12:
+    switch_baud(TARGET_BAUD_RATE)
+
 
 print("TAP: Reading tap device")
 while True:
@@ -183,14 +878,8 @@ while True:
     # if not link_up:
     #     send_wifi_client()
 
-    out = (
-        INTRON
-        + MSG_PACKET.to_bytes(1, "little")
-        + len(packet).to_bytes(4, "little", signed=False)
-        + packet
-    )
-    # print(f"TAP: SOUT MESSAGE: {out}")
-    send_message(out)
+    # print(f"TAP: SOUT MESSAGE: {packet.hex()}")
+    send_packet(packet)
     #print("O", end="", flush=True)
     # with lock:
     #     if (datetime.datetime.now() - last_in).total_seconds() > 5:
@@ -0,0 +1,31 @@
+/* Minimal harness of the host benchmarks
+
+  Each benchmark runs its loop for a while and reports the throughput next
+  to what the UART delivers, so the numbers read as headroom.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// Bytes per second of CONFIG_UART_NIC_BAUD_RATE, 8N1 takes 10 bits a byte
+#define UART_BYTES_PER_SECOND (4600000 / 10)
+#define BENCH_NS 300000000ull
+
+static inline uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void bench_report(const char *name, uint64_t bytes, uint64_t ns) {
+    const double per_second = bytes * 1e9 / ns;
+    printf("%-40s %8.1f MB/s %7.2f ns/B %8.1fx 4.6 Mbaud\n",
+        name, per_second / 1e6, (double)ns / bytes, per_second / UART_BYTES_PER_SECOND);
+}
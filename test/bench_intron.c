@@ -0,0 +1,161 @@
+/* Benchmark of the intron scan of the UART NIC protocol parser
+
+  Feeds streams with the kinds of noise the printer's UART sees between
+  messages: the ESP8266 ROM boot log, bytes read at the wrong baud rate,
+  a line held low and intron prefixes that keep the matcher backtracking.
+  Each run of noise is followed by a packet the parser has to find. The
+  streams go in by single bytes, as read before the bulk reads, and in the
+  chunks of rx_drain.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "uart_proto.h"
+
+// As in uart_nic.c
+#define RX_CHUNK_SIZE 256
+#define NOISE_LEN 1000
+#define PACKET_LEN 64
+#define ROUNDS 64
+#define STREAM_MAX (ROUNDS * (NOISE_LEN + INTRON_LEN + 5 + PACKET_LEN))
+
+static const uint8_t intron[INTRON_LEN] = {'U', 'N', '\x00', '\x01', '\x02', '\x03', '\x04', '\x05'};
+
+static const char boot_log[] =
+    "\r\n ets Jan  8 2013,rst cause:2, boot mode:(3,6)\r\n\r\n"
+    "load 0x40100000, len 7288, room 16 \r\ntail 8\r\nchksum 0x2b\r\n"
+    "load 0x3ffe8400, len 24, room 0 \r\ntail 8\r\nchksum 0x6b\r\n"
+    "load 0x3ffe8418, len 3312, room 0 \r\ntail 0\r\nchksum 0x31\r\n"
+    "I (42) boot: ESP-IDF v3.4 2nd stage bootloader\r\n"
+    "I (42) boot: compile time 10:22:07\r\n"
+    "I (43) boot: SPI Speed      : 40MHz\r\n";
+
+typedef enum {
+    NOISE_BOOT_LOG,
+    NOISE_WRONG_BAUD,
+    NOISE_BREAK,
+    NOISE_INTRON_PREFIXES,
+    NOISE_KINDS,
+} noise_kind;
+
+static const char *const noise_names[NOISE_KINDS] = {
+    "boot log",
+    "wrong baud rate",
+    "line held low",
+    "intron prefixes",
+};
+
+static uint8_t stream[STREAM_MAX];
+static size_t stream_len;
+static uint8_t packet_buf[PACKET_LEN];
+static uint32_t packets;
+
+static uint8_t *packet_begin(void *ctx, uint32_t len) {
+    return len <= sizeof(packet_buf) ? packet_buf : NULL;
+}
+
+static void packet_end(void *ctx, uint8_t *data, uint32_t len) {
+    packets++;
+}
+
+static void packet_abort(void *ctx, uint8_t *data) {
+}
+
+static void packet_invalid(void *ctx, uint32_t len) {
+}
+
+static void unknown(void *ctx, uint8_t type) {
+}
+
+static const uart_proto_callbacks callbacks = {
+    .packet_begin = packet_begin,
+    .packet_end = packet_end,
+    .packet_abort = packet_abort,
+    .packet_invalid = packet_invalid,
+    .unknown = unknown,
+};
+
+static void put(const void *data, size_t len) {
+    memcpy(stream + stream_len, data, len);
+    stream_len += len;
+}
+
+static void put_noise(noise_kind kind) {
+    for (size_t i = 0; i < NOISE_LEN; ++i) {
+        uint8_t c;
+        switch (kind) {
+        case NOISE_BOOT_LOG:
+            c = boot_log[i % (sizeof(boot_log) - 1)];
+            break;
+        case NOISE_WRONG_BAUD:
+            c = rand();
+            break;
+        case NOISE_BREAK:
+            c = 0;
+            break;
+        default:
+            // All but the last byte of the intron, over and over
+            c = intron[i % (INTRON_LEN - 1)];
+            break;
+        }
+        stream[stream_len++] = c;
+    }
+}
+
+static void build_stream(noise_kind kind) {
+    stream_len = 0;
+    srand(1);
+    for (int i = 0; i < ROUNDS; ++i) {
+        put_noise(kind);
+        put(intron, INTRON_LEN);
+        const uint8_t type = MSG_PACKET;
+        put(&type, 1);
+        const uint32_t len = PACKET_LEN;
+        put(&len, sizeof(len));
+        for (int j = 0; j < PACKET_LEN; ++j) {
+            stream[stream_len++] = j;
+        }
+    }
+}
+
+static void run(noise_kind kind, size_t chunk) {
+    uart_proto_parser parser;
+    uart_proto_init(&parser, &callbacks, NULL, intron);
+    packets = 0;
+    uint64_t bytes = 0;
+    uint32_t runs = 0;
+    const uint64_t start = bench_now_ns();
+    uint64_t elapsed;
+    do {
+        for (size_t pos = 0; pos < stream_len; pos += chunk) {
+            const size_t left = stream_len - pos;
+            uart_proto_feed(&parser, stream + pos, left < chunk ? left : chunk);
+        }
+        bytes += stream_len;
+        runs++;
+        elapsed = bench_now_ns() - start;
+    } while (elapsed < BENCH_NS);
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s, %zu B reads", noise_names[kind], chunk);
+    bench_report(name, bytes, elapsed);
+    if (packets != runs * ROUNDS) {
+        fprintf(stderr, "%s: %u of %u packets found\n", name, packets, runs * ROUNDS);
+        exit(1);
+    }
+}
+
+int main(void) {
+    for (noise_kind kind = 0; kind < NOISE_KINDS; ++kind) {
+        build_stream(kind);
+        run(kind, 1);
+        run(kind, RX_CHUNK_SIZE);
+    }
+    return 0;
+}
@@ -0,0 +1,11 @@
+/* Host stand-in for the section attributes of ESP8266_RTOS_SDK
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#pragma once
+
+#define IRAM_ATTR
+#define DRAM_ATTR
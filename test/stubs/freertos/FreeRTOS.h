@@ -0,0 +1,13 @@
+/* Host stand-in for the FreeRTOS of ESP8266_RTOS_SDK
+
+  The host tests run on one thread, critical sections have nothing to mask.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#pragma once
+
+#define portENTER_CRITICAL()
+#define portEXIT_CRITICAL()
@@ -0,0 +1,8 @@
+/* Host stand-in for the FreeRTOS of ESP8266_RTOS_SDK
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#pragma once
@@ -0,0 +1,41 @@
+/* Minimal harness of the host tests
+
+  Each test program checks its module and exits with a failure status when
+  any check fails.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#pragma once
+
+#include <stdio.h>
+
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures++; \
+        } \
+    } while (0)
+
+#define CHECK_EQ(actual, expected) do { \
+        const long long a_ = (long long)(actual); \
+        const long long e_ = (long long)(expected); \
+        if (a_ != e_) { \
+            fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, a_, e_); \
+            test_failures++; \
+        } \
+    } while (0)
+
+#define RUN(test) do { \
+        const int before_ = test_failures; \
+        test(); \
+        printf("%s %s\n", test_failures == before_ ? "ok  " : "FAIL", #test); \
+    } while (0)
+
+static inline int test_result(void) {
+    return test_failures ? 1 : 0;
+}
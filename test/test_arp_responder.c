@@ -0,0 +1,235 @@
+/* Host tests of the ARP responder
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include <string.h>
+
+#include "test.h"
+#include "arp_responder.h"
+
+static const uint8_t nic_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+static const uint8_t peer_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+static const uint8_t broadcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+static const uint8_t host_ip[4] = {192, 168, 1, 10};
+static const uint8_t other_ip[4] = {192, 168, 1, 11};
+static const uint8_t peer_ip[4] = {192, 168, 1, 1};
+
+static arp_offload offload_host(void) {
+    arp_offload offload;
+    memset(&offload, 0, sizeof(offload));
+    memcpy(offload.addrs[0], other_ip, 4);
+    memcpy(offload.addrs[1], host_ip, 4);
+    offload.count = 2;
+    return offload;
+}
+
+static void test_request_roundtrip(void) {
+    uint8_t request[ARP_FRAME_LEN];
+    arp_request(peer_mac, broadcast, peer_ip, host_ip, request);
+    CHECK(memcmp(request, broadcast, 6) == 0);
+    CHECK(memcmp(request + 6, peer_mac, 6) == 0);
+    CHECK_EQ(request[12], 0x08);
+    CHECK_EQ(request[13], 0x06);
+    CHECK_EQ(request[21], 1);
+    CHECK(memcmp(request + 32, "\0\0\0\0\0\0", 6) == 0);
+    CHECK(memcmp(request + 38, host_ip, 4) == 0);
+
+    CHECK(arp_sender(request, sizeof(request), peer_ip) == request + 22);
+    CHECK(arp_sender(request, sizeof(request), host_ip) == NULL);
+    CHECK(arp_sender(request, sizeof(request) - 1, peer_ip) == NULL);
+}
+
+static void test_reply_for_host(void) {
+    const arp_offload offload = offload_host();
+    uint8_t request[ARP_FRAME_LEN];
+    uint8_t reply[ARP_FRAME_LEN];
+    arp_request(peer_mac, broadcast, peer_ip, host_ip, request);
+    CHECK_EQ(arp_respond(&offload, nic_mac, request, sizeof(request), reply), ARP_REPLY);
+
+    CHECK(memcmp(reply, peer_mac, 6) == 0);
+    CHECK(memcmp(reply + 6, nic_mac, 6) == 0);
+    CHECK(memcmp(reply + 12, request + 12, 8) == 0);
+    CHECK_EQ(reply[20], 0);
+    CHECK_EQ(reply[21], 2);
+    CHECK(memcmp(reply + 22, nic_mac, 6) == 0);
+    CHECK(memcmp(reply + 28, host_ip, 4) == 0);
+    CHECK(memcmp(reply + 32, peer_mac, 6) == 0);
+    CHECK(memcmp(reply + 38, peer_ip, 4) == 0);
+    // The sender of the reply is the host
+    CHECK(arp_sender(reply, sizeof(reply), host_ip) == reply + 22);
+}
+
+static void test_padded_request(void) {
+    const arp_offload offload = offload_host();
+    uint8_t request[60];
+    uint8_t reply[ARP_FRAME_LEN];
+    memset(request, 0, sizeof(request));
+    arp_request(peer_mac, broadcast, peer_ip, other_ip, request);
+    CHECK_EQ(arp_respond(&offload, nic_mac, request, sizeof(request), reply), ARP_REPLY);
+    CHECK(memcmp(reply + 28, other_ip, 4) == 0);
+}
+
+static void test_other_target_dropped(void) {
+    const arp_offload offload = offload_host();
+    uint8_t request[ARP_FRAME_LEN];
+    uint8_t reply[ARP_FRAME_LEN];
+    arp_request(peer_mac, broadcast, host_ip, peer_ip, request);
+    CHECK_EQ(arp_respond(&offload, nic_mac, request, sizeof(request), reply), ARP_DROP);
+}
+
+static void test_reply_to_host_passed(void) {
+    const arp_offload offload = offload_host();
+    uint8_t request[ARP_FRAME_LEN];
+    uint8_t reply[ARP_FRAME_LEN];
+    uint8_t answer[ARP_FRAME_LEN];
+    // The host asked, the peer answers
+    arp_request(peer_mac, broadcast, host_ip, peer_ip, request);
+    arp_offload peer;
+    memset(&peer, 0, sizeof(peer));
+    memcpy(peer.addrs[0], peer_ip, 4);
+    peer.count = 1;
+    CHECK_EQ(arp_respond(&peer, peer_mac, request, sizeof(request), reply), ARP_REPLY);
+    CHECK_EQ(arp_respond(&offload, nic_mac, reply, sizeof(reply), answer), ARP_PASS);
+}
+
+static void test_disabled_or_not_arp_passed(void) {
+    arp_offload offload;
+    memset(&offload, 0, sizeof(offload));
+    uint8_t request[ARP_FRAME_LEN];
+    uint8_t reply[ARP_FRAME_LEN];
+    arp_request(peer_mac, broadcast, peer_ip, host_ip, request);
+    CHECK_EQ(arp_respond(&offload, nic_mac, request, sizeof(request), reply), ARP_PASS);
+
+    offload = offload_host();
+    CHECK_EQ(arp_respond(&offload, nic_mac, request, sizeof(request) - 1, reply), ARP_PASS);
+    request[13] = 0x00;
+    CHECK_EQ(arp_respond(&offload, nic_mac, request, sizeof(request), reply), ARP_PASS);
+    // ARP for another protocol
+    request[13] = 0x06;
+    request[17] = 0xDD;
+    CHECK_EQ(arp_respond(&offload, nic_mac, request, sizeof(request), reply), ARP_PASS);
+}
+
+// Frames as they come from the air, padded to the minimal Ethernet frame
+
+// Who has 192.168.1.10? Tell 192.168.1.1, still tagged with VLAN 100
+static const uint8_t vlan_request[64] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x02, 0x00, 0x00, 0x00, 0x00, 0x02,
+    0x81, 0x00, 0x00, 0x64, 0x08, 0x06,
+    0x00, 0x01, 0x08, 0x00, 0x06, 0x04, 0x00, 0x01,
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x02, 0xc0, 0xa8, 0x01, 0x01,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc0, 0xa8, 0x01, 0x0a,
+};
+
+// The same with the tag stripped by the AP, leaving its padding behind
+static const uint8_t untagged_request[60] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x02, 0x00, 0x00, 0x00, 0x00, 0x02, 0x08, 0x06,
+    0x00, 0x01, 0x08, 0x00, 0x06, 0x04, 0x00, 0x01,
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x02, 0xc0, 0xa8, 0x01, 0x01,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc0, 0xa8, 0x01, 0x0a,
+    0xde, 0xad, 0xbe, 0xef, 0xde, 0xad, 0xbe, 0xef, 0xde, 0xad, 0xbe, 0xef, 0xde, 0xad, 0xbe, 0xef, 0xde, 0xad,
+};
+
+// 192.168.1.1 announcing a new hardware address, as after a failover
+static const uint8_t gratuitous_request[60] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x02, 0x00, 0x00, 0x00, 0x00, 0x03, 0x08, 0x06,
+    0x00, 0x01, 0x08, 0x00, 0x06, 0x04, 0x00, 0x01,
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x03, 0xc0, 0xa8, 0x01, 0x01,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc0, 0xa8, 0x01, 0x01,
+};
+
+// The same in a reply, with the target hardware address repeated
+static const uint8_t gratuitous_reply[60] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x02, 0x00, 0x00, 0x00, 0x00, 0x03, 0x08, 0x06,
+    0x00, 0x01, 0x08, 0x00, 0x06, 0x04, 0x00, 0x02,
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x03, 0xc0, 0xa8, 0x01, 0x01,
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x03, 0xc0, 0xa8, 0x01, 0x01,
+};
+
+// Another device taking 192.168.1.10, the address of the host
+static const uint8_t conflicting_announcement[60] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x02, 0x00, 0x00, 0x00, 0x00, 0x04, 0x08, 0x06,
+    0x00, 0x01, 0x08, 0x00, 0x06, 0x04, 0x00, 0x01,
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x04, 0xc0, 0xa8, 0x01, 0x0a,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc0, 0xa8, 0x01, 0x0a,
+};
+
+// Address conflict detection of a device about to take 192.168.1.10
+static const uint8_t probe_host[60] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x02, 0x00, 0x00, 0x00, 0x00, 0x04, 0x08, 0x06,
+    0x00, 0x01, 0x08, 0x00, 0x06, 0x04, 0x00, 0x01,
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc0, 0xa8, 0x01, 0x0a,
+};
+
+// And of one about to take 192.168.1.12, nobody's
+static const uint8_t probe_other[60] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x02, 0x00, 0x00, 0x00, 0x00, 0x04, 0x08, 0x06,
+    0x00, 0x01, 0x08, 0x00, 0x06, 0x04, 0x00, 0x01,
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc0, 0xa8, 0x01, 0x0c,
+};
+
+static void test_vlan_tagged_passed(void) {
+    const arp_offload offload = offload_host();
+    uint8_t reply[ARP_FRAME_LEN];
+    // The reply would have to carry the tag, the host knows how
+    CHECK_EQ(arp_respond(&offload, nic_mac, vlan_request, sizeof(vlan_request), reply), ARP_PASS);
+    CHECK(arp_sender(vlan_request, sizeof(vlan_request), peer_ip) == NULL);
+}
+
+static void test_stripped_tag_padding_ignored(void) {
+    const arp_offload offload = offload_host();
+    uint8_t reply[ARP_FRAME_LEN];
+    uint8_t expected[ARP_FRAME_LEN];
+    arp_request(nic_mac, peer_mac, host_ip, peer_ip, expected);
+    expected[21] = 2;
+    CHECK_EQ(arp_respond(&offload, nic_mac, untagged_request, sizeof(untagged_request), reply), ARP_REPLY);
+    CHECK(memcmp(reply, expected, 32) == 0);
+    CHECK(memcmp(reply + 32, peer_mac, 6) == 0);
+    CHECK(memcmp(reply + 38, peer_ip, 4) == 0);
+}
+
+static void test_gratuitous_passed(void) {
+    const arp_offload offload = offload_host();
+    uint8_t reply[ARP_FRAME_LEN];
+    CHECK_EQ(arp_respond(&offload, nic_mac, gratuitous_request, sizeof(gratuitous_request), reply), ARP_PASS);
+    CHECK_EQ(arp_respond(&offload, nic_mac, gratuitous_reply, sizeof(gratuitous_reply), reply), ARP_PASS);
+    // Not answered for the host either, the host sees the conflict
+    CHECK_EQ(arp_respond(&offload, nic_mac, conflicting_announcement, sizeof(conflicting_announcement), reply), ARP_PASS);
+    // The new address of the gateway is learned
+    const uint8_t *sender = arp_sender(gratuitous_request, sizeof(gratuitous_request), peer_ip);
+    CHECK(sender == gratuitous_request + 22);
+    CHECK_EQ(sender[5], 0x03);
+}
+
+static void test_conflict_probe(void) {
+    const arp_offload offload = offload_host();
+    uint8_t reply[ARP_FRAME_LEN];
+    CHECK_EQ(arp_respond(&offload, nic_mac, probe_other, sizeof(probe_other), reply), ARP_DROP);
+    // Answered to the prober's hardware address, it has no IP address yet
+    CHECK_EQ(arp_respond(&offload, nic_mac, probe_host, sizeof(probe_host), reply), ARP_REPLY);
+    CHECK(memcmp(reply, probe_host + 22, 6) == 0);
+    CHECK(memcmp(reply + 22, nic_mac, 6) == 0);
+    CHECK(memcmp(reply + 28, host_ip, 4) == 0);
+    CHECK(memcmp(reply + 32, probe_host + 22, 6) == 0);
+    CHECK(memcmp(reply + 38, "\0\0\0\0", 4) == 0);
+    CHECK(arp_sender(probe_host, sizeof(probe_host), (const uint8_t *)"\0\0\0\0") == probe_host + 22);
+}
+
+int main(void) {
+    RUN(test_request_roundtrip);
+    RUN(test_reply_for_host);
+    RUN(test_padded_request);
+    RUN(test_other_target_dropped);
+    RUN(test_reply_to_host_passed);
+    RUN(test_disabled_or_not_arp_passed);
+    RUN(test_vlan_tagged_passed);
+    RUN(test_stripped_tag_padding_ignored);
+    RUN(test_gratuitous_passed);
+    RUN(test_conflict_probe);
+    return test_result();
+}
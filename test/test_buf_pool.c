@@ -0,0 +1,140 @@
+/* Host tests of the fixed-size buffer pool
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "test.h"
+#include "buf_pool.h"
+
+#define COUNT 4
+// Not a multiple of the pointer size
+#define ELEM_SIZE 13
+
+BUF_POOL_STORAGE(mem, ELEM_SIZE, COUNT);
+
+static void test_hands_out_every_block_once(void) {
+    buf_pool_t pool;
+    buf_pool_init(&pool, mem, ELEM_SIZE, COUNT);
+    uint8_t *blocks[COUNT];
+    for (int i = 0; i < COUNT; ++i) {
+        blocks[i] = buf_pool_alloc(&pool);
+        CHECK(blocks[i] != NULL);
+        CHECK((uintptr_t)blocks[i] % sizeof(void *) == 0);
+        CHECK(blocks[i] >= (uint8_t *)mem);
+        CHECK(blocks[i] + ELEM_SIZE <= (uint8_t *)mem + sizeof(mem));
+        for (int j = 0; j < i; ++j) {
+            const intptr_t apart = blocks[i] > blocks[j] ? blocks[i] - blocks[j] : blocks[j] - blocks[i];
+            CHECK(apart >= ELEM_SIZE);
+        }
+    }
+    CHECK(buf_pool_alloc(&pool) == NULL);
+    CHECK_EQ(pool.free_count, 0);
+    CHECK_EQ(pool.exhausted, 1);
+}
+
+static void test_freed_blocks_are_reused(void) {
+    buf_pool_t pool;
+    buf_pool_init(&pool, mem, ELEM_SIZE, COUNT);
+    void *blocks[COUNT];
+    for (int i = 0; i < COUNT; ++i) {
+        blocks[i] = buf_pool_alloc(&pool);
+    }
+    buf_pool_free(&pool, blocks[2]);
+    CHECK_EQ(pool.free_count, 1);
+    CHECK(buf_pool_alloc(&pool) == blocks[2]);
+    CHECK(buf_pool_alloc(&pool) == NULL);
+}
+
+static void test_low_water(void) {
+    buf_pool_t pool;
+    buf_pool_init(&pool, mem, ELEM_SIZE, COUNT);
+    CHECK_EQ(pool.low_water, COUNT);
+    void *a = buf_pool_alloc(&pool);
+    void *b = buf_pool_alloc(&pool);
+    buf_pool_free(&pool, a);
+    buf_pool_free(&pool, b);
+    CHECK_EQ(pool.free_count, COUNT);
+    CHECK_EQ(pool.low_water, COUNT - 2);
+    CHECK_EQ(pool.exhausted, 0);
+}
+
+#define STRESS_COUNT 32
+#define STRESS_CYCLES 4000000
+
+BUF_POOL_STORAGE(stress_mem, ELEM_SIZE, STRESS_COUNT);
+
+// Allocations and frees in random order, as from several tasks
+static void test_stress(void) {
+    buf_pool_t pool;
+    buf_pool_init(&pool, stress_mem, ELEM_SIZE, STRESS_COUNT);
+    uint8_t *held[STRESS_COUNT];
+    size_t held_count = 0;
+    uint32_t failed = 0;
+    size_t min_free = STRESS_COUNT;
+    uint32_t rng = 2463534242;
+    for (uint32_t cycle = 0; cycle < STRESS_CYCLES; ++cycle) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        // Mostly full or mostly empty for a while, so both ends get hit
+        const bool filling = (cycle >> 12) & 1;
+        const bool alloc = rng % 8 < (filling ? 5u : 3u);
+        if (alloc) {
+            uint8_t *block = buf_pool_alloc(&pool);
+            if (!block) {
+                CHECK_EQ(held_count, STRESS_COUNT);
+                failed++;
+                continue;
+            }
+            // Owned by nobody else: the mark of a holder would be there
+            CHECK_EQ(block[ELEM_SIZE - 1], 0);
+            block[ELEM_SIZE - 1] = 0xa5;
+            held[held_count++] = block;
+        } else if (held_count) {
+            const size_t i = (rng >> 8) % held_count;
+            uint8_t *block = held[i];
+            held[i] = held[--held_count];
+            CHECK_EQ(block[ELEM_SIZE - 1], 0xa5);
+            block[ELEM_SIZE - 1] = 0;
+            buf_pool_free(&pool, block);
+        }
+        CHECK_EQ(pool.free_count, STRESS_COUNT - held_count);
+        if (STRESS_COUNT - held_count < min_free) {
+            min_free = STRESS_COUNT - held_count;
+        }
+        CHECK_EQ(pool.low_water, min_free);
+    }
+    while (held_count) {
+        uint8_t *block = held[--held_count];
+        block[ELEM_SIZE - 1] = 0;
+        buf_pool_free(&pool, block);
+    }
+    CHECK_EQ(pool.free_count, STRESS_COUNT);
+    CHECK_EQ(pool.low_water, 0);
+    CHECK_EQ(pool.exhausted, failed);
+    CHECK(failed > 0);
+
+    // Every block is still there, once
+    uint8_t *blocks[STRESS_COUNT];
+    for (int i = 0; i < STRESS_COUNT; ++i) {
+        blocks[i] = buf_pool_alloc(&pool);
+        CHECK(blocks[i] != NULL);
+        for (int j = 0; j < i; ++j) {
+            CHECK(blocks[i] != blocks[j]);
+        }
+    }
+    CHECK(buf_pool_alloc(&pool) == NULL);
+}
+
+int main(void) {
+    RUN(test_hands_out_every_block_once);
+    RUN(test_freed_blocks_are_reused);
+    RUN(test_low_water);
+    RUN(test_stress);
+    return test_result();
+}
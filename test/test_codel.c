@@ -0,0 +1,128 @@
+/* Host tests of CoDel
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "test.h"
+#include "codel.h"
+
+#define TARGET 5
+#define INTERVAL 100
+
+static void test_disabled_never_drops(void) {
+    codel_t codel;
+    codel_init(&codel, 0, INTERVAL);
+    for (uint32_t now = 0; now < 10 * INTERVAL; now += 10) {
+        CHECK(!codel_drop(&codel, now, 1000, 10));
+    }
+}
+
+static void test_below_target_never_drops(void) {
+    codel_t codel;
+    codel_init(&codel, TARGET, INTERVAL);
+    for (uint32_t now = 0; now < 10 * INTERVAL; now += 10) {
+        CHECK(!codel_drop(&codel, now, TARGET - 1, 10));
+    }
+}
+
+static void test_last_packet_never_dropped(void) {
+    codel_t codel;
+    codel_init(&codel, TARGET, INTERVAL);
+    for (uint32_t now = 0; now < 10 * INTERVAL; now += 10) {
+        CHECK(!codel_drop(&codel, now, 1000, 0));
+    }
+}
+
+static void test_drops_after_interval_above_target(void) {
+    codel_t codel;
+    codel_init(&codel, TARGET, INTERVAL);
+    CHECK(!codel_drop(&codel, 0, TARGET, 1));
+    CHECK(!codel_drop(&codel, INTERVAL / 2, TARGET, 1));
+    CHECK(!codel_drop(&codel, INTERVAL - 1, TARGET, 1));
+    CHECK(codel_drop(&codel, INTERVAL, TARGET, 1));
+    CHECK_EQ(codel.count, 1);
+}
+
+static void test_drop_rate_grows(void) {
+    codel_t codel;
+    codel_init(&codel, TARGET, INTERVAL);
+    CHECK(!codel_drop(&codel, 0, TARGET, 1));
+    CHECK(codel_drop(&codel, 100, TARGET, 1));
+    // Then interval / sqrt(count) apart
+    CHECK(!codel_drop(&codel, 199, TARGET, 1));
+    CHECK(codel_drop(&codel, 200, TARGET, 1));
+    CHECK(!codel_drop(&codel, 269, TARGET, 1));
+    CHECK(codel_drop(&codel, 270, TARGET, 1));
+    CHECK(!codel_drop(&codel, 326, TARGET, 1));
+    CHECK(codel_drop(&codel, 327, TARGET, 1));
+    CHECK_EQ(codel.count, 4);
+}
+
+static void test_stops_dropping_below_target(void) {
+    codel_t codel;
+    codel_init(&codel, TARGET, INTERVAL);
+    CHECK(!codel_drop(&codel, 0, TARGET, 1));
+    CHECK(codel_drop(&codel, 100, TARGET, 1));
+    CHECK(!codel_drop(&codel, 150, TARGET - 1, 1));
+    CHECK(!codel.dropping);
+    // A whole interval above the target again before the next drop
+    CHECK(!codel_drop(&codel, 200, TARGET, 1));
+    CHECK(!codel_drop(&codel, 299, TARGET, 1));
+    CHECK(codel_drop(&codel, 300, TARGET, 1));
+}
+
+static void test_resumes_at_previous_rate(void) {
+    codel_t codel;
+    codel_init(&codel, TARGET, INTERVAL);
+    CHECK(!codel_drop(&codel, 0, TARGET, 1));
+    CHECK(codel_drop(&codel, 100, TARGET, 1));
+    CHECK(codel_drop(&codel, 200, TARGET, 1));
+    CHECK(codel_drop(&codel, 270, TARGET, 1));
+    CHECK(!codel_drop(&codel, 280, 0, 1));
+    CHECK(!codel_drop(&codel, 290, TARGET, 1));
+    CHECK(codel_drop(&codel, 390, TARGET, 1));
+    // The drops added in the last dropping state
+    CHECK_EQ(codel.count, 2);
+}
+
+static void test_set_target(void) {
+    codel_t codel;
+    codel_init(&codel, TARGET, INTERVAL);
+    CHECK(!codel_drop(&codel, 0, TARGET, 1));
+    CHECK(codel_drop(&codel, 100, TARGET, 1));
+    codel_set_target(&codel, 2 * TARGET);
+    CHECK(!codel_drop(&codel, 200, TARGET, 1));
+    CHECK(!codel.dropping);
+    codel_set_target(&codel, 0);
+    CHECK(!codel_drop(&codel, 300, 1000, 1));
+    CHECK(!codel_drop(&codel, 500, 1000, 1));
+    codel_set_target(&codel, TARGET);
+    CHECK(!codel_drop(&codel, 600, TARGET, 1));
+    CHECK(codel_drop(&codel, 700, TARGET, 1));
+}
+
+static void test_time_wraps_around(void) {
+    codel_t codel;
+    codel_init(&codel, TARGET, INTERVAL);
+    const uint32_t start = UINT32_MAX - INTERVAL / 2;
+    CHECK(!codel_drop(&codel, start, TARGET, 1));
+    CHECK(!codel_drop(&codel, start + INTERVAL - 1, TARGET, 1));
+    CHECK(codel_drop(&codel, start + INTERVAL, TARGET, 1));
+    CHECK(!codel_drop(&codel, start + 2 * INTERVAL - 1, TARGET, 1));
+    CHECK(codel_drop(&codel, start + 2 * INTERVAL, TARGET, 1));
+}
+
+int main(void) {
+    RUN(test_disabled_never_drops);
+    RUN(test_below_target_never_drops);
+    RUN(test_last_packet_never_dropped);
+    RUN(test_drops_after_interval_above_target);
+    RUN(test_drop_rate_grows);
+    RUN(test_stops_dropping_below_target);
+    RUN(test_resumes_at_previous_rate);
+    RUN(test_set_target);
+    RUN(test_time_wraps_around);
+    return test_result();
+}
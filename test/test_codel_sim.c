@@ -0,0 +1,207 @@
+/* Host simulation of CoDel in front of the UART
+
+  A TCP-like sender on the internet sends full size frames through WiFi to
+  the NIC, which queues them for the host behind the UART at 4.6 Mbaud.
+  The sender grows its window until packets get lost and halves it once per
+  window of losses, as Reno does. Without CoDel only the queue filling up
+  drops packets, with it the delay of the queue stays near the target. Time
+  runs in microseconds.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include <string.h>
+
+#include "test.h"
+#include "codel.h"
+
+// As in uart_nic.c and sdkconfig
+#define FRAME_BYTES 1536
+#define BAUD_RATE 4600000
+#define FRAME_US ((uint64_t)FRAME_BYTES * 10 * 1000000 / BAUD_RATE)
+#define TARGET_US (FRAME_US > 5000 ? FRAME_US : 5000)
+#define INTERVAL_US 100000
+// Bulk packets stop being queued when only the priority reserve is left
+#define QUEUE_LEN (20 - 4)
+
+// Internet one way, and a much faster WiFi than the UART
+#define ONE_WAY_US 10000
+#define WIFI_US 500
+#define DURATION_US 30000000
+// Leaves out slow start at the beginning
+#define WARMUP_US 2000000
+#define PIPE_MAX 1024
+#define HISTOGRAM_STEP_US 100
+#define HISTOGRAM_LEN 2000
+
+// Packets, or ACKs and losses, on the way with a fixed delay, so in order
+typedef struct {
+    uint32_t at[PIPE_MAX];
+    uint32_t seq[PIPE_MAX];
+    size_t head;
+    size_t count;
+} pipe_t;
+
+typedef struct {
+    uint32_t delivered;
+    uint32_t codel_drops;
+    uint32_t tail_drops;
+    uint64_t sojourn_sum;
+    uint32_t sojourn_max;
+    uint32_t sojourn_p99;
+    uint32_t goodput_percent;
+} sim_result;
+
+static pipe_t to_nic;
+static pipe_t acks;
+static pipe_t losses;
+static uint32_t histogram[HISTOGRAM_LEN];
+
+static void pipe_push(pipe_t *pipe, uint32_t at, uint32_t seq) {
+    const size_t i = (pipe->head + pipe->count++) % PIPE_MAX;
+    pipe->at[i] = at;
+    pipe->seq[i] = seq;
+}
+
+static bool pipe_due(const pipe_t *pipe, uint32_t now, uint32_t *seq) {
+    if (!pipe->count || pipe->at[pipe->head] != now) {
+        return false;
+    }
+    *seq = pipe->seq[pipe->head];
+    return true;
+}
+
+static void pipe_pop(pipe_t *pipe) {
+    pipe->head = (pipe->head + 1) % PIPE_MAX;
+    pipe->count--;
+}
+
+static sim_result simulate(uint32_t target) {
+    codel_t codel;
+    codel_init(&codel, target, INTERVAL_US);
+    memset(&to_nic, 0, sizeof(to_nic));
+    memset(&acks, 0, sizeof(acks));
+    memset(&losses, 0, sizeof(losses));
+    memset(histogram, 0, sizeof(histogram));
+    sim_result result = { 0 };
+
+    // The sender, the window in thousandths of a packet
+    uint32_t cwnd = 2000;
+    uint32_t ssthresh = UINT32_MAX;
+    uint32_t in_flight = 0;
+    uint32_t next_seq = 0;
+    uint32_t recover = 0;
+    uint32_t wifi_free = 0;
+
+    // The NIC
+    uint32_t queue_at[QUEUE_LEN];
+    uint32_t queue_seq[QUEUE_LEN];
+    size_t queue_head = 0;
+    size_t queue_count = 0;
+    uint32_t uart_free = 0;
+
+    for (uint32_t now = 0; now < DURATION_US; ++now) {
+        const bool counted = now >= WARMUP_US;
+        uint32_t seq;
+
+        while (pipe_due(&acks, now, &seq)) {
+            pipe_pop(&acks);
+            in_flight--;
+            cwnd += cwnd < ssthresh ? 1000 : 1000000 / cwnd;
+        }
+        while (pipe_due(&losses, now, &seq)) {
+            pipe_pop(&losses);
+            in_flight--;
+            // Once a window, the packets sent before it was halved were
+            // sent too fast already
+            if ((int32_t)(seq - recover) >= 0) {
+                cwnd = cwnd / 2 > 2000 ? cwnd / 2 : 2000;
+                ssthresh = cwnd;
+                recover = next_seq;
+            }
+        }
+        if (in_flight * 1000 < cwnd && (int32_t)(now - wifi_free) >= 0) {
+            wifi_free = now + WIFI_US;
+            pipe_push(&to_nic, now + ONE_WAY_US + WIFI_US, next_seq++);
+            in_flight++;
+        }
+
+        while (pipe_due(&to_nic, now, &seq)) {
+            pipe_pop(&to_nic);
+            if (queue_count == QUEUE_LEN) {
+                // Noticed by the duplicate ACKs of the next packets
+                pipe_push(&losses, now + FRAME_US + ONE_WAY_US, seq);
+                result.tail_drops += counted;
+                continue;
+            }
+            const size_t i = (queue_head + queue_count++) % QUEUE_LEN;
+            queue_at[i] = now;
+            queue_seq[i] = seq;
+        }
+
+        while (queue_count && (int32_t)(now - uart_free) >= 0) {
+            const uint32_t sojourn = now - queue_at[queue_head];
+            seq = queue_seq[queue_head];
+            queue_head = (queue_head + 1) % QUEUE_LEN;
+            queue_count--;
+            if (codel_drop(&codel, now, sojourn, queue_count)) {
+                pipe_push(&losses, now + FRAME_US + ONE_WAY_US, seq);
+                result.codel_drops += counted;
+                continue;
+            }
+            uart_free = now + FRAME_US;
+            pipe_push(&acks, uart_free + ONE_WAY_US, seq);
+            if (counted) {
+                result.delivered++;
+                result.sojourn_sum += sojourn;
+                if (sojourn > result.sojourn_max) {
+                    result.sojourn_max = sojourn;
+                }
+                const uint32_t bin = sojourn / HISTOGRAM_STEP_US;
+                histogram[bin < HISTOGRAM_LEN ? bin : HISTOGRAM_LEN - 1]++;
+            }
+        }
+    }
+
+    uint32_t below = 0;
+    for (uint32_t bin = 0; bin < HISTOGRAM_LEN; ++bin) {
+        below += histogram[bin];
+        if (below >= result.delivered * 99ull / 100) {
+            result.sojourn_p99 = (bin + 1) * HISTOGRAM_STEP_US;
+            break;
+        }
+    }
+    const uint32_t capacity = (DURATION_US - WARMUP_US) / FRAME_US;
+    result.goodput_percent = result.delivered * 100ull / capacity;
+    printf("     target %u us: delay %llu us average, %u us p99, %u us max, goodput %u%%, %u CoDel drops, %u tail drops\n",
+        target, (unsigned long long)(result.sojourn_sum / result.delivered), result.sojourn_p99,
+        result.sojourn_max, result.goodput_percent, result.codel_drops, result.tail_drops);
+    return result;
+}
+
+static sim_result tail;
+
+// What the queue does to a single TCP stream on its own
+static void test_tail_drop_only(void) {
+    tail = simulate(0);
+    CHECK_EQ(tail.codel_drops, 0);
+    CHECK(tail.tail_drops > 0);
+    CHECK(tail.sojourn_max <= QUEUE_LEN * FRAME_US);
+}
+
+static void test_codel_keeps_delay_near_target(void) {
+    const sim_result codel = simulate(TARGET_US);
+    CHECK(codel.codel_drops > 0);
+    CHECK_EQ(codel.tail_drops, 0);
+    CHECK(codel.sojourn_sum / codel.delivered < tail.sojourn_sum / tail.delivered / 2);
+    CHECK(codel.sojourn_p99 < tail.sojourn_p99);
+    CHECK(codel.goodput_percent >= 95);
+}
+
+int main(void) {
+    RUN(test_tail_drop_only);
+    RUN(test_codel_keeps_delay_near_target);
+    return test_result();
+}
@@ -0,0 +1,274 @@
+/* Host simulation of the credit flow control of packets from the host
+
+  A host sending as fast as its credit allows feeds the parser byte by byte,
+  the NIC takes packet buffers from the pool and sends them to WiFi at a
+  lower rate. Time runs in byte times of the UART. Headers lost on the wire
+  leave the counts of the two sides apart until the host sends its count.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include <string.h>
+
+#include "test.h"
+#include "uart_proto.h"
+#include "buf_pool.h"
+#include "credit.h"
+
+#define BUFFERS 8
+#define STEP ((BUFFERS + 3) / 4)
+#define PACKET_LEN 200
+// WiFi takes longer to send a packet than UART to receive it
+#define DRAIN_TICKS 400
+// MSG_CREDIT on its way to the host
+#define CREDIT_LATENCY 300
+// 100 ms at 4.6 Mbaud
+#define CREDIT_TIMEOUT 46000
+#define TICKS 4000000
+#define CAPACITY (TICKS / DRAIN_TICKS)
+
+static const uint8_t intron[INTRON_LEN] = {'U', 'N', '\x00', '\x01', '\x02', '\x03', '\x04', '\x05'};
+
+typedef struct {
+    uint8_t data[PACKET_LEN];
+} packet_buff;
+
+// The NIC
+static uart_proto_parser parser;
+BUF_POOL_STORAGE(pool_mem, sizeof(packet_buff), BUFFERS);
+static buf_pool_t pool;
+static credit_t credit;
+static packet_buff *egress[BUFFERS];
+static size_t egress_head;
+static size_t egress_count;
+static packet_buff *receiving;
+static uint32_t overflow_drops;
+static uint32_t delivered;
+static uint32_t lost_reported;
+
+// MSG_CREDITs on the way to the host
+typedef struct {
+    uint32_t at;
+    uint32_t limit;
+} credit_msg;
+static credit_msg credit_msgs[64];
+static size_t credit_msgs_head;
+static size_t credit_msgs_count;
+
+// The host
+static uint32_t host_limit;
+static uint32_t host_sent;
+static bool host_waiting;
+static uint32_t host_waiting_since;
+static uint32_t host_syncs;
+static bool host_sync_enabled;
+
+// The wire, the message being sent
+static uint8_t wire[PACKET_LEN + 32];
+static size_t wire_len;
+static size_t wire_pos;
+
+static uint32_t rng_state;
+static uint32_t loss_per_million;
+static uint32_t headers_lost;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static uint8_t *packet_begin(void *ctx, uint32_t len) {
+    credit_accept(&credit);
+    receiving = buf_pool_alloc(&pool);
+    if (!receiving) {
+        overflow_drops++;
+        return NULL;
+    }
+    return receiving->data;
+}
+
+static void packet_end(void *ctx, uint8_t *data, uint32_t len) {
+    egress[(egress_head + egress_count++) % BUFFERS] = receiving;
+    receiving = NULL;
+}
+
+static void packet_abort(void *ctx, uint8_t *data) {
+    buf_pool_free(&pool, receiving);
+    receiving = NULL;
+}
+
+static void packet_invalid(void *ctx, uint32_t len) {
+    credit_accept(&credit);
+}
+
+static void credit_sync_host(void *ctx, uint32_t sent) {
+    lost_reported += credit_sync(&credit, sent);
+}
+
+static void unknown(void *ctx, uint8_t type) {
+}
+
+static const uart_proto_callbacks callbacks = {
+    .packet_begin = packet_begin,
+    .packet_end = packet_end,
+    .packet_abort = packet_abort,
+    .packet_invalid = packet_invalid,
+    .credit_sync = credit_sync_host,
+    .unknown = unknown,
+};
+
+static void wire_put(const void *data, size_t len) {
+    memcpy(wire + wire_len, data, len);
+    wire_len += len;
+}
+
+static void wire_message(uint8_t type, const uint8_t *body, size_t len) {
+    wire_len = 0;
+    wire_pos = 0;
+    wire_put(intron, INTRON_LEN);
+    const uint8_t flagged = type | MSG_CRC_FLAG;
+    wire_put(&flagged, 1);
+    wire_put(body, len);
+    const uint32_t crc = uart_proto_crc32(0, wire + INTRON_LEN, 1 + len);
+    wire_put(&crc, sizeof(crc));
+}
+
+static void host_send_packet(void) {
+    uint8_t body[sizeof(uint32_t) + PACKET_LEN];
+    const uint32_t len = PACKET_LEN;
+    memcpy(body, &len, sizeof(len));
+    memset(body + sizeof(len), 0xaa, PACKET_LEN);
+    wire_message(MSG_PACKET, body, sizeof(body));
+    host_sent++;
+
+    if (rng() % 1000000 < loss_per_million) {
+        switch (rng() % 3) {
+        case 0:
+            // The intron, the NIC hunts for the next one
+            wire[rng() % INTRON_LEN] ^= 0x01;
+            headers_lost++;
+            break;
+        case 1:
+            // The type, unknown to the NIC
+            wire[INTRON_LEN] ^= 0x40;
+            headers_lost++;
+            break;
+        default:
+            // The data, fails the CRC and still used a credit
+            wire[INTRON_LEN + 5 + rng() % PACKET_LEN] ^= 1 << rng() % 8;
+            break;
+        }
+    }
+}
+
+static void host_send_sync(void) {
+    wire_message(MSG_CREDIT, (const uint8_t *)&host_sent, sizeof(host_sent));
+    host_syncs++;
+}
+
+static bool host_have_credit(void) {
+    const uint32_t left = host_limit - host_sent;
+    return 0 < left && left < 0x80000000;
+}
+
+static void host_tick(uint32_t now) {
+    while (credit_msgs_count && credit_msgs[credit_msgs_head].at == now) {
+        host_limit = credit_msgs[credit_msgs_head].limit;
+        credit_msgs_head = (credit_msgs_head + 1) % 64;
+        credit_msgs_count--;
+    }
+    if (wire_pos < wire_len) {
+        return;
+    }
+    if (host_have_credit()) {
+        host_waiting = false;
+        host_send_packet();
+    } else if (!host_waiting) {
+        host_waiting = true;
+        host_waiting_since = now;
+    } else if (host_sync_enabled && now - host_waiting_since >= CREDIT_TIMEOUT) {
+        host_waiting_since = now;
+        host_send_sync();
+    }
+}
+
+static void nic_tick(uint32_t now) {
+    if (wire_pos < wire_len) {
+        uart_proto_feed(&parser, wire + wire_pos++, 1);
+    }
+    if (now % DRAIN_TICKS == 0 && egress_count) {
+        buf_pool_free(&pool, egress[egress_head]);
+        egress_head = (egress_head + 1) % BUFFERS;
+        egress_count--;
+        delivered++;
+    }
+    // The TX thread, woken by the RX task and WiFi
+    if (credit_update_due(&credit, pool.free_count)) {
+        const uint32_t limit = credit_limit(&credit, pool.free_count);
+        credit_advertise(&credit, limit);
+        credit_msgs[(credit_msgs_head + credit_msgs_count++) % 64] = (credit_msg){now + CREDIT_LATENCY, limit};
+    }
+}
+
+static void simulate(uint32_t loss, bool sync) {
+    uart_proto_init(&parser, &callbacks, NULL, intron);
+    buf_pool_init(&pool, pool_mem, sizeof(packet_buff), BUFFERS);
+    credit_init(&credit, STEP);
+    egress_head = egress_count = 0;
+    receiving = NULL;
+    overflow_drops = delivered = lost_reported = 0;
+    credit_msgs_head = credit_msgs_count = 0;
+    host_limit = host_sent = host_syncs = 0;
+    host_waiting = false;
+    host_sync_enabled = sync;
+    wire_len = wire_pos = 0;
+    rng_state = 2463534242;
+    loss_per_million = loss;
+    headers_lost = 0;
+
+    // As after MSG_SET_FEATURES
+    credit_msgs[credit_msgs_count++] = (credit_msg){CREDIT_LATENCY, credit_limit(&credit, pool.free_count)};
+    credit_advertise(&credit, credit_msgs[0].limit);
+    for (uint32_t now = 1; now < TICKS; ++now) {
+        host_tick(now);
+        nic_tick(now);
+    }
+    printf("     loss %u ppm, sync %d: %u of %u packets delivered, %u overflows, %u headers lost, %u reported, %u syncs\n",
+        loss, sync, delivered, CAPACITY, overflow_drops, headers_lost, lost_reported, host_syncs);
+}
+
+static void test_saturated_without_loss(void) {
+    simulate(0, true);
+    CHECK_EQ(overflow_drops, 0);
+    CHECK(delivered >= CAPACITY * 99 / 100);
+    CHECK_EQ(host_syncs, 0);
+}
+
+static void test_header_loss_recovers(void) {
+    simulate(2000, true);
+    CHECK_EQ(overflow_drops, 0);
+    CHECK(headers_lost > 10);
+    CHECK(host_syncs > 0);
+    // Those lost since the last sync are not known yet
+    CHECK(lost_reported <= headers_lost);
+    CHECK_EQ(headers_lost - lost_reported, host_sent - credit.accepted);
+    CHECK(delivered >= CAPACITY * 95 / 100);
+}
+
+// What the counts drifting apart did without the host sending its count
+static void test_header_loss_without_sync_stalls(void) {
+    simulate(2000, false);
+    CHECK_EQ(overflow_drops, 0);
+    CHECK(delivered < CAPACITY / 2);
+}
+
+int main(void) {
+    RUN(test_saturated_without_loss);
+    RUN(test_header_loss_recovers);
+    RUN(test_header_loss_without_sync_stalls);
+    return test_result();
+}
@@ -0,0 +1,129 @@
+/* Host simulation of the detection of a lost link
+
+  WiFi packets come in until the AP disappears, the timer checks the time of
+  the last one periodically. Time runs in FreeRTOS ticks which wrap around,
+  the seconds the check works with are derived from them as in uart_nic.c.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "test.h"
+#include "link_check.h"
+
+// As in sdkconfig
+#define TICK_RATE_HZ 100
+#define TIMEOUT 5
+#define PERIOD (1000 * TICK_RATE_HZ / 1000)
+// Packets from WiFi as long as the link is up, below the timeout
+#define PACKET_GAP (3 * TICK_RATE_HZ + 7)
+#define TRIALS 2000
+// Longest the detection may take, the seconds are whole so up to one more
+// than the timeout passes before the check sees it exceeded, and up to two
+// seconds of the clock are partial at both ends
+#define MAX_LATENCY ((TIMEOUT + 2) * TICK_RATE_HZ + PERIOD)
+#define MIN_LATENCY (TIMEOUT * TICK_RATE_HZ)
+
+static uint32_t rng_state = 2463534242;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static uint32_t seconds(uint32_t tick) {
+    return tick / TICK_RATE_HZ;
+}
+
+/*
+ * Runs from start, the link lost at start + lost, the timer firing first at
+ * start + phase. Returns the ticks from the last packet to detecting the
+ * loss, 0 when detected while the link was still up.
+ */
+static uint32_t detect(uint32_t start, uint32_t lost, uint32_t phase) {
+    uint32_t last = seconds(start);
+    uint32_t last_tick = 0;
+    uint32_t next_packet = PACKET_GAP;
+    uint32_t next_check = phase;
+    for (uint32_t t = 0;; ++t) {
+        const uint32_t tick = start + t;
+        if (t < lost && t == next_packet) {
+            last = seconds(tick);
+            last_tick = t;
+            next_packet += PACKET_GAP;
+        }
+        if (t == next_check) {
+            if (link_check_inactive(last, seconds(tick), TIMEOUT)) {
+                return t < lost ? 0 : t - last_tick;
+            }
+            next_check += PERIOD;
+        }
+    }
+}
+
+typedef struct {
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+} latency_stats;
+
+static latency_stats run_trials(uint32_t start_base, uint32_t start_spread) {
+    latency_stats stats = { UINT32_MAX, 0, 0 };
+    for (int i = 0; i < TRIALS; ++i) {
+        const uint32_t start = start_base + rng() % start_spread;
+        const uint32_t lost = PACKET_GAP + rng() % (60 * TICK_RATE_HZ);
+        const uint32_t latency = detect(start, lost, rng() % PERIOD);
+        if (latency < stats.min) {
+            stats.min = latency;
+        }
+        if (latency > stats.max) {
+            stats.max = latency;
+        }
+        stats.sum += latency;
+    }
+    printf("     detected after %u to %u ms, %u ms on average\n",
+        stats.min * 1000 / TICK_RATE_HZ, stats.max * 1000 / TICK_RATE_HZ,
+        (uint32_t)(stats.sum * 1000 / TICK_RATE_HZ / TRIALS));
+    return stats;
+}
+
+static void test_idle(void) {
+    CHECK_EQ(link_check_idle(10, 10), 0);
+    CHECK_EQ(link_check_idle(10, 15), 5);
+    // Wrapped around, only the part after that counts
+    CHECK_EQ(link_check_idle(42949670, 3), 3);
+}
+
+static void test_inactive_after_timeout(void) {
+    CHECK(!link_check_inactive(100, 100 + TIMEOUT, TIMEOUT));
+    CHECK(link_check_inactive(100, 101 + TIMEOUT, TIMEOUT));
+    CHECK(!link_check_inactive(42949670, TIMEOUT, TIMEOUT));
+    CHECK(link_check_inactive(42949670, TIMEOUT + 1, TIMEOUT));
+}
+
+static void test_detection_latency(void) {
+    const latency_stats stats = run_trials(0, UINT32_MAX / 2);
+    CHECK(stats.min >= MIN_LATENCY);
+    CHECK(stats.max <= MAX_LATENCY);
+}
+
+// The seconds wrap around at no power of two, the part up to the wrap is not
+// counted, so the detection takes up to one timeout longer but still comes
+// and traffic across the wrap does not look like a loss
+static void test_detection_across_wrap(void) {
+    const uint32_t span = 70 * TICK_RATE_HZ;
+    const latency_stats stats = run_trials(-span, span);
+    CHECK(stats.min >= MIN_LATENCY);
+    CHECK(stats.max <= MAX_LATENCY + (TIMEOUT + 1) * TICK_RATE_HZ);
+}
+
+int main(void) {
+    RUN(test_idle);
+    RUN(test_inactive_after_timeout);
+    RUN(test_detection_latency);
+    RUN(test_detection_across_wrap);
+    return test_result();
+}
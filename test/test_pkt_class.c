@@ -0,0 +1,306 @@
+/* Host tests of the ingress frame classification
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include <string.h>
+
+#include "test.h"
+#include "pkt_class.h"
+
+#define ETH_HEADER_LEN 14
+#define IPV4_HEADER_LEN 20
+#define IPV6_HEADER_LEN 40
+#define TCP_HEADER_LEN 20
+
+static uint8_t frame[1514];
+
+static void put_u16(uint8_t *data, uint16_t value) {
+    data[0] = value >> 8;
+    data[1] = value;
+}
+
+// Ethernet header, the L3 header starts at the returned offset
+static size_t eth(uint16_t ethertype, int vlan) {
+    memset(frame, 0, sizeof(frame));
+    memset(frame, 0xFF, 6);
+    size_t pos = 12;
+    if (vlan) {
+        put_u16(frame + pos, 0x8100);
+        pos += 4;
+    }
+    put_u16(frame + pos, ethertype);
+    return pos + 2;
+}
+
+// IPv4 header with payload bytes after it, returns the frame length
+static size_t ipv4(size_t pos, uint8_t proto, size_t payload) {
+    uint8_t *ip = frame + pos;
+    ip[0] = 0x45;
+    put_u16(ip + 2, IPV4_HEADER_LEN + payload);
+    ip[9] = proto;
+    return pos + IPV4_HEADER_LEN + payload;
+}
+
+static size_t ipv6(size_t pos, uint8_t next, size_t payload) {
+    uint8_t *ip = frame + pos;
+    ip[0] = 0x60;
+    put_u16(ip + 4, payload);
+    ip[6] = next;
+    return pos + IPV6_HEADER_LEN + payload;
+}
+
+static void udp_ports(size_t l4, uint16_t src, uint16_t dst) {
+    put_u16(frame + l4, src);
+    put_u16(frame + l4 + 2, dst);
+}
+
+static void tcp_header_len(size_t l4, size_t len) {
+    frame[l4 + 12] = (len / 4) << 4;
+}
+
+static void test_arp_is_control(void) {
+    CHECK_EQ(pkt_classify(frame, eth(0x0806, 0) + 28), PKT_CLASS_CONTROL);
+    CHECK_EQ(pkt_classify(frame, eth(0x0806, 1) + 28), PKT_CLASS_CONTROL);
+}
+
+static void test_icmp_is_control(void) {
+    CHECK_EQ(pkt_classify(frame, ipv4(eth(0x0800, 0), 1, 64)), PKT_CLASS_CONTROL);
+    CHECK_EQ(pkt_classify(frame, ipv6(eth(0x86DD, 0), 58, 32)), PKT_CLASS_CONTROL);
+}
+
+static void test_udp_control_ports(void) {
+    const size_t l4 = ETH_HEADER_LEN + IPV4_HEADER_LEN;
+    size_t len = ipv4(eth(0x0800, 0), 17, 100);
+    udp_ports(l4, 53, 40000);
+    CHECK_EQ(pkt_classify(frame, len), PKT_CLASS_CONTROL);
+    udp_ports(l4, 67, 68);
+    CHECK_EQ(pkt_classify(frame, len), PKT_CLASS_CONTROL);
+    udp_ports(l4, 40000, 53);
+    CHECK_EQ(pkt_classify(frame, len), PKT_CLASS_BULK);
+    udp_ports(l4, 5000, 5001);
+    CHECK_EQ(pkt_classify(frame, len), PKT_CLASS_BULK);
+
+    const size_t l4_v6 = ETH_HEADER_LEN + IPV6_HEADER_LEN;
+    len = ipv6(eth(0x86DD, 0), 17, 100);
+    udp_ports(l4_v6, 547, 546);
+    CHECK_EQ(pkt_classify(frame, len), PKT_CLASS_CONTROL);
+}
+
+static void test_tcp_without_payload_is_ack(void) {
+    const size_t l4 = ETH_HEADER_LEN + IPV4_HEADER_LEN;
+    size_t len = ipv4(eth(0x0800, 0), 6, TCP_HEADER_LEN);
+    tcp_header_len(l4, TCP_HEADER_LEN);
+    CHECK_EQ(pkt_classify(frame, len), PKT_CLASS_ACK);
+
+    // With options
+    len = ipv4(eth(0x0800, 0), 6, TCP_HEADER_LEN + 12);
+    tcp_header_len(l4, TCP_HEADER_LEN + 12);
+    CHECK_EQ(pkt_classify(frame, len), PKT_CLASS_ACK);
+
+    // Ethernet padding after a short IP packet is no payload
+    len = ipv4(eth(0x0800, 0), 6, TCP_HEADER_LEN);
+    tcp_header_len(l4, TCP_HEADER_LEN);
+    CHECK_EQ(pkt_classify(frame, len + 6), PKT_CLASS_ACK);
+
+    const size_t l4_v6 = ETH_HEADER_LEN + 4 + IPV6_HEADER_LEN;
+    len = ipv6(eth(0x86DD, 1), 6, TCP_HEADER_LEN);
+    tcp_header_len(l4_v6, TCP_HEADER_LEN);
+    CHECK_EQ(pkt_classify(frame, len), PKT_CLASS_ACK);
+}
+
+static void test_tcp_with_payload_is_bulk(void) {
+    const size_t l4 = ETH_HEADER_LEN + IPV4_HEADER_LEN;
+    const size_t len = ipv4(eth(0x0800, 0), 6, TCP_HEADER_LEN + 1);
+    tcp_header_len(l4, TCP_HEADER_LEN);
+    CHECK_EQ(pkt_classify(frame, len), PKT_CLASS_BULK);
+}
+
+static void test_later_fragment_is_bulk(void) {
+    const size_t pos = eth(0x0800, 0);
+    const size_t len = ipv4(pos, 1, 64);
+    put_u16(frame + pos + 6, 100);
+    CHECK_EQ(pkt_classify(frame, len), PKT_CLASS_BULK);
+}
+
+static void test_truncated_frames_are_bulk(void) {
+    CHECK_EQ(pkt_classify(frame, 0), PKT_CLASS_BULK);
+    CHECK_EQ(pkt_classify(frame, ETH_HEADER_LEN - 1), PKT_CLASS_BULK);
+
+    size_t pos = eth(0x0800, 0);
+    ipv4(pos, 1, 64);
+    CHECK_EQ(pkt_classify(frame, pos + IPV4_HEADER_LEN - 1), PKT_CLASS_BULK);
+
+    pos = eth(0x0800, 0);
+    ipv4(pos, 6, TCP_HEADER_LEN);
+    tcp_header_len(pos + IPV4_HEADER_LEN, TCP_HEADER_LEN);
+    CHECK_EQ(pkt_classify(frame, pos + IPV4_HEADER_LEN + 12), PKT_CLASS_BULK);
+
+    pos = eth(0x0800, 0);
+    ipv4(pos, 17, 8);
+    udp_ports(pos + IPV4_HEADER_LEN, 53, 53);
+    CHECK_EQ(pkt_classify(frame, pos + IPV4_HEADER_LEN + 3), PKT_CLASS_BULK);
+
+    pos = eth(0x86DD, 0);
+    CHECK_EQ(pkt_classify(frame, pos + IPV6_HEADER_LEN - 1), PKT_CLASS_BULK);
+
+    CHECK_EQ(pkt_classify(frame, eth(0x8100, 0) + 1), PKT_CLASS_BULK);
+}
+
+static void test_bad_ipv4_header_is_bulk(void) {
+    size_t pos = eth(0x0800, 0);
+    size_t len = ipv4(pos, 1, 64);
+    frame[pos] = 0x44;
+    CHECK_EQ(pkt_classify(frame, len), PKT_CLASS_BULK);
+
+    pos = eth(0x0800, 0);
+    len = ipv4(pos, 1, 64);
+    put_u16(frame + pos + 2, IPV4_HEADER_LEN - 1);
+    CHECK_EQ(pkt_classify(frame, len), PKT_CLASS_BULK);
+}
+
+static void test_other_ethertypes_are_bulk(void) {
+    CHECK_EQ(pkt_classify(frame, eth(0x88CC, 0) + 64), PKT_CLASS_BULK);
+}
+
+// Frames as they come from the air, the checksums are not checked
+
+// DHCP offer of 192.168.1.10, the BOOTP fields past the client address and
+// the options zeroed
+static const uint8_t dhcp_offer[316] = {
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x01, 0xf0, 0x9f, 0xc2, 0x11, 0x22, 0x33, 0x08, 0x00,
+    0x45, 0x00, 0x01, 0x2e, 0x00, 0x00, 0x00, 0x00, 0x40, 0x11, 0xf6, 0x63, 0xc0, 0xa8, 0x01, 0x01, 0xc0, 0xa8, 0x01, 0x0a,
+    0x00, 0x43, 0x00, 0x44, 0x01, 0x1a, 0x00, 0x00,
+    0x02, 0x01, 0x06, 0x00, 0x39, 0x03, 0xf3, 0x26, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xc0, 0xa8, 0x01, 0x0a, 0xc0, 0xa8, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00,
+    0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+// SYN-ACK from a web server, with MSS, SACK, timestamps and window scale
+static const uint8_t tcp_syn_ack[74] = {
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x01, 0xf0, 0x9f, 0xc2, 0x11, 0x22, 0x33, 0x08, 0x00,
+    0x45, 0x00, 0x00, 0x3c, 0x00, 0x00, 0x40, 0x00, 0x36, 0x06, 0x4d, 0x2f, 0x5d, 0xb8, 0xd8, 0x22, 0xc0, 0xa8, 0x01, 0x0a,
+    0x00, 0x50, 0xc0, 0x00, 0x8f, 0x3c, 0x2a, 0x01, 0x6b, 0x2f, 0x10, 0x01, 0xa0, 0x12, 0xfe, 0x88,
+    0x00, 0x00, 0x00, 0x00, 0x02, 0x04, 0x05, 0xb4, 0x04, 0x02, 0x08, 0x0a, 0xd2, 0xa1, 0xc3, 0xf0,
+    0x00, 0x01, 0xe2, 0x40, 0x01, 0x03, 0x03, 0x07,
+};
+
+// Bare ACK of the request, with timestamps
+static const uint8_t tcp_ack[66] = {
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x01, 0xf0, 0x9f, 0xc2, 0x11, 0x22, 0x33, 0x08, 0x00,
+    0x45, 0x00, 0x00, 0x34, 0x5d, 0x2c, 0x40, 0x00, 0x36, 0x06, 0xf0, 0x0a, 0x5d, 0xb8, 0xd8, 0x22, 0xc0, 0xa8, 0x01, 0x0a,
+    0x00, 0x50, 0xc0, 0x00, 0x8f, 0x3c, 0x2a, 0x02, 0x6b, 0x2f, 0x10, 0x51, 0x80, 0x10, 0x01, 0xfe,
+    0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x08, 0x0a, 0xd2, 0xa1, 0xc3, 0xf5, 0x00, 0x01, 0xe2, 0x45,
+};
+
+// The response in the next segment
+static const uint8_t tcp_data[109] = {
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x01, 0xf0, 0x9f, 0xc2, 0x11, 0x22, 0x33, 0x08, 0x00,
+    0x45, 0x00, 0x00, 0x5f, 0x5d, 0x2d, 0x40, 0x00, 0x36, 0x06, 0xef, 0xde, 0x5d, 0xb8, 0xd8, 0x22, 0xc0, 0xa8, 0x01, 0x0a,
+    0x00, 0x50, 0xc0, 0x00, 0x8f, 0x3c, 0x2a, 0x02, 0x6b, 0x2f, 0x10, 0x51, 0x80, 0x18, 0x01, 0xfe,
+    0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x08, 0x0a, 0xd2, 0xa1, 0xc3, 0xf5, 0x00, 0x01, 0xe2, 0x45,
+    0x48, 0x54, 0x54, 0x50, 0x2f, 0x31, 0x2e, 0x31, 0x20, 0x32, 0x30, 0x30, 0x20, 0x4f, 0x4b, 0x0d,
+    0x0a, 0x43, 0x6f, 0x6e, 0x74, 0x65, 0x6e, 0x74, 0x2d, 0x4c, 0x65, 0x6e, 0x67, 0x74, 0x68, 0x3a,
+    0x20, 0x35, 0x0d, 0x0a, 0x0d, 0x0a, 0x68, 0x65, 0x6c, 0x6c, 0x6f,
+};
+
+// ARP reply of the gateway, padded
+static const uint8_t arp_reply[60] = {
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x01, 0xf0, 0x9f, 0xc2, 0x11, 0x22, 0x33, 0x08, 0x06,
+    0x00, 0x01, 0x08, 0x00, 0x06, 0x04, 0x00, 0x02, 0xf0, 0x9f, 0xc2, 0x11, 0x22, 0x33, 0xc0, 0xa8,
+    0x01, 0x01, 0x02, 0x00, 0x00, 0x00, 0x00, 0x01, 0xc0, 0xa8, 0x01, 0x0a,
+};
+
+// DNS answer for example.com
+static const uint8_t dns_answer[87] = {
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x01, 0xf0, 0x9f, 0xc2, 0x11, 0x22, 0x33, 0x08, 0x00,
+    0x45, 0x00, 0x00, 0x49, 0x3f, 0x10, 0x40, 0x00, 0x40, 0x11, 0x78, 0x38, 0xc0, 0xa8, 0x01, 0x01, 0xc0, 0xa8, 0x01, 0x0a,
+    0x00, 0x35, 0xc8, 0x22, 0x00, 0x35, 0x00, 0x00,
+    0x1a, 0x2b, 0x81, 0x80, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x07, 0x65, 0x78, 0x61,
+    0x6d, 0x70, 0x6c, 0x65, 0x03, 0x63, 0x6f, 0x6d, 0x00, 0x00, 0x01, 0x00, 0x01, 0xc0, 0x0c, 0x00,
+    0x01, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x04, 0x5d, 0xb8, 0xd8, 0x22,
+};
+
+// Router advertisement of 2001:db8:1::/64 to all nodes
+static const uint8_t ipv6_router_advert[110] = {
+    0x33, 0x33, 0x00, 0x00, 0x00, 0x01, 0xf0, 0x9f, 0xc2, 0x11, 0x22, 0x33, 0x86, 0xdd,
+    0x60, 0x00, 0x00, 0x00, 0x00, 0x38, 0x3a, 0xff, 0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xf2, 0x9f, 0xc2, 0xff, 0xfe, 0x11, 0x22, 0x33, 0xff, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+    0x86, 0x00, 0x00, 0x00, 0x40, 0x00, 0x07, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x01, 0xf0, 0x9f, 0xc2, 0x11, 0x22, 0x33, 0x03, 0x04, 0x40, 0xc0, 0x00, 0x00, 0x1c, 0x20,
+    0x00, 0x00, 0x0e, 0x10, 0x00, 0x00, 0x00, 0x00, 0x20, 0x01, 0x0d, 0xb8, 0x00, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+// Neighbor solicitation of the address of the host by the router
+static const uint8_t ipv6_neighbor_solicit[86] = {
+    0x33, 0x33, 0xff, 0x00, 0x00, 0x10, 0xf0, 0x9f, 0xc2, 0x11, 0x22, 0x33, 0x86, 0xdd,
+    0x60, 0x00, 0x00, 0x00, 0x00, 0x20, 0x3a, 0xff, 0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xf2, 0x9f, 0xc2, 0xff, 0xfe, 0x11, 0x22, 0x33, 0xff, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x01, 0xff, 0x00, 0x00, 0x10,
+    0x87, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20, 0x01, 0x0d, 0xb8, 0x00, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x01, 0x01, 0xf0, 0x9f, 0xc2, 0x11, 0x22, 0x33,
+};
+
+// MLDv2 report of another node, behind a hop-by-hop header with a router alert
+static const uint8_t ipv6_mld_report[90] = {
+    0x33, 0x33, 0x00, 0x00, 0x00, 0x16, 0x3c, 0x22, 0xfb, 0x10, 0x20, 0x30, 0x86, 0xdd,
+    0x60, 0x00, 0x00, 0x00, 0x00, 0x24, 0x00, 0x01, 0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x3e, 0x22, 0xfb, 0xff, 0xfe, 0x10, 0x20, 0x30, 0xff, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x16,
+    0x3a, 0x00, 0x05, 0x02, 0x00, 0x00, 0x01, 0x00,
+    0x8f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x04, 0x00, 0x00, 0x00, 0xff, 0x02, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfb,
+};
+
+// SYN-ACK over IPv6
+static const uint8_t tcp6_syn_ack[94] = {
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x01, 0xf0, 0x9f, 0xc2, 0x11, 0x22, 0x33, 0x86, 0xdd,
+    0x60, 0x00, 0x00, 0x00, 0x00, 0x28, 0x06, 0x39, 0x20, 0x01, 0x0d, 0xb8, 0x00, 0x02, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x20, 0x01, 0x0d, 0xb8, 0x00, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10,
+    0x01, 0xbb, 0xc0, 0x01, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0xa0, 0x12, 0xfd, 0x20,
+    0x00, 0x00, 0x00, 0x00, 0x02, 0x04, 0x05, 0xa0, 0x04, 0x02, 0x08, 0x0a, 0x00, 0x00, 0x00, 0x01,
+    0x00, 0x00, 0x00, 0x02, 0x01, 0x03, 0x03, 0x07,
+};
+
+// FIN without options, padded to the minimal frame
+static const uint8_t tcp_fin[60] = {
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x01, 0xf0, 0x9f, 0xc2, 0x11, 0x22, 0x33, 0x08, 0x00,
+    0x45, 0x00, 0x00, 0x28, 0x5d, 0x2e, 0x40, 0x00, 0x36, 0x06, 0xf0, 0x14, 0x5d, 0xb8, 0xd8, 0x22, 0xc0, 0xa8, 0x01, 0x0a,
+    0x00, 0x50, 0xc0, 0x00, 0x8f, 0x3c, 0x2a, 0x07, 0x6b, 0x2f, 0x10, 0x51, 0x50, 0x11, 0x01, 0xfe, 0x00, 0x00, 0x00, 0x00,
+};
+
+static void test_frames_from_air(void) {
+    CHECK_EQ(pkt_classify(dhcp_offer, sizeof(dhcp_offer)), PKT_CLASS_CONTROL);
+    CHECK_EQ(pkt_classify(dns_answer, sizeof(dns_answer)), PKT_CLASS_CONTROL);
+    CHECK_EQ(pkt_classify(arp_reply, sizeof(arp_reply)), PKT_CLASS_CONTROL);
+    CHECK_EQ(pkt_classify(tcp_syn_ack, sizeof(tcp_syn_ack)), PKT_CLASS_ACK);
+    CHECK_EQ(pkt_classify(tcp_ack, sizeof(tcp_ack)), PKT_CLASS_ACK);
+    CHECK_EQ(pkt_classify(tcp_fin, sizeof(tcp_fin)), PKT_CLASS_ACK);
+    CHECK_EQ(pkt_classify(tcp_data, sizeof(tcp_data)), PKT_CLASS_BULK);
+    CHECK_EQ(pkt_classify(tcp6_syn_ack, sizeof(tcp6_syn_ack)), PKT_CLASS_ACK);
+    CHECK_EQ(pkt_classify(ipv6_router_advert, sizeof(ipv6_router_advert)), PKT_CLASS_CONTROL);
+    CHECK_EQ(pkt_classify(ipv6_neighbor_solicit, sizeof(ipv6_neighbor_solicit)), PKT_CLASS_CONTROL);
+    // Extension headers are not walked
+    CHECK_EQ(pkt_classify(ipv6_mld_report, sizeof(ipv6_mld_report)), PKT_CLASS_BULK);
+    // Cut in the TCP header
+    CHECK_EQ(pkt_classify(tcp_syn_ack, ETH_HEADER_LEN + IPV4_HEADER_LEN + 12), PKT_CLASS_BULK);
+}
+
+int main(void) {
+    RUN(test_arp_is_control);
+    RUN(test_icmp_is_control);
+    RUN(test_udp_control_ports);
+    RUN(test_tcp_without_payload_is_ack);
+    RUN(test_tcp_with_payload_is_bulk);
+    RUN(test_later_fragment_is_bulk);
+    RUN(test_truncated_frames_are_bulk);
+    RUN(test_bad_ipv4_header_is_bulk);
+    RUN(test_other_ethertypes_are_bulk);
+    RUN(test_frames_from_air);
+    return test_result();
+}
@@ -0,0 +1,167 @@
+/* Host tests of the storm limit of group addressed frames
+
+  Replays a bridging loop on the WiFi: the ARP request of one client
+  circling at 10000 frames per second and an SSDP search flood on top of
+  the usual mDNS announcements and spanning tree hellos. The frames are laid
+  out byte for byte as they come from the air.
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "test.h"
+#include "storm_limit.h"
+
+// As in sdkconfig
+#define RATE 200
+#define BURST 100
+#define MS 1000
+#define SECOND 1000000
+#define STEP_US 100
+
+// Who has 192.168.1.1? Tell 192.168.1.23, padded to the minimal frame
+static const uint8_t arp_request[60] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x1a, 0x2b, 0x3c, 0x4d, 0x5e, 0x08, 0x06,
+    0x00, 0x01, 0x08, 0x00, 0x06, 0x04, 0x00, 0x01,
+    0x00, 0x1a, 0x2b, 0x3c, 0x4d, 0x5e, 0xc0, 0xa8, 0x01, 0x17,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc0, 0xa8, 0x01, 0x01,
+};
+
+// M-SEARCH to 239.255.255.250:1900, the headers after the request line cut
+static const uint8_t ssdp_search[] = {
+    0x01, 0x00, 0x5e, 0x7f, 0xff, 0xfa, 0x3c, 0x22, 0xfb, 0x10, 0x20, 0x30, 0x08, 0x00,
+    0x45, 0x00, 0x00, 0x31, 0x6f, 0x21, 0x00, 0x00, 0x04, 0x11, 0x53, 0x9c,
+    0xc0, 0xa8, 0x01, 0x42, 0xef, 0xff, 0xff, 0xfa,
+    0xe1, 0x15, 0x07, 0x6c, 0x00, 0x1d, 0x00, 0x00,
+    'M', '-', 'S', 'E', 'A', 'R', 'C', 'H', ' ', '*', ' ', 'H', 'T', 'T', 'P', '/', '1', '.', '1', '\r', '\n',
+};
+
+// mDNS query from fe80::3e22:fbff:fe10:2030 for _ipp._tcp.local
+static const uint8_t mdns_query[] = {
+    0x33, 0x33, 0x00, 0x00, 0x00, 0xfb, 0x3c, 0x22, 0xfb, 0x10, 0x20, 0x30, 0x86, 0xdd,
+    0x60, 0x00, 0x00, 0x00, 0x00, 0x2d, 0x11, 0xff,
+    0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3e, 0x22, 0xfb, 0xff, 0xfe, 0x10, 0x20, 0x30,
+    0xff, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfb,
+    0x14, 0xe9, 0x14, 0xe9, 0x00, 0x2d, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x04, '_', 'i', 'p', 'p', 0x04, '_', 't', 'c', 'p', 0x05, 'l', 'o', 'c', 'a', 'l', 0x00,
+    0x00, 0x0c, 0x00, 0x01,
+};
+
+// Spanning tree configuration BPDU, 802.3 length instead of an EtherType
+static const uint8_t stp_hello[60] = {
+    0x01, 0x80, 0xc2, 0x00, 0x00, 0x00, 0x00, 0x1a, 0x2b, 0x00, 0x00, 0x01, 0x00, 0x26,
+    0x42, 0x42, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x80, 0x00, 0x00, 0x1a, 0x2b, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+    0x80, 0x00, 0x00, 0x1a, 0x2b, 0x00, 0x00, 0x01, 0x80, 0x01,
+    0x00, 0x00, 0x14, 0x00, 0x02, 0x00, 0x0f, 0x00,
+};
+
+typedef struct {
+    const char *name;
+    const uint8_t *frame;
+    size_t len;
+    uint8_t cls;
+    uint32_t start;
+    uint32_t end;
+    uint32_t period;
+    uint32_t passed;
+    uint32_t dropped;
+} source;
+
+static source sources[] = {
+    { "ARP loop", arp_request, sizeof(arp_request), STORM_ARP, 1 * SECOND, 3 * SECOND, 100, 0, 0 },
+    { "ARP", arp_request, sizeof(arp_request), STORM_ARP, 0, 6 * SECOND, 1 * SECOND, 0, 0 },
+    { "SSDP flood", ssdp_search, sizeof(ssdp_search), STORM_IPV4, 1500 * MS, 2500 * MS, 2 * MS, 0, 0 },
+    { "mDNS", mdns_query, sizeof(mdns_query), STORM_IPV6, 0, 6 * SECOND, 500 * MS, 0, 0 },
+    { "STP", stp_hello, sizeof(stp_hello), STORM_OTHER, 0, 6 * SECOND, 2 * SECOND, 0, 0 },
+};
+
+#define SOURCES (sizeof(sources) / sizeof(sources[0]))
+
+static void replay(storm_limit *limit, uint32_t start, uint32_t end) {
+    for (size_t i = 0; i < SOURCES; ++i) {
+        sources[i].passed = sources[i].dropped = 0;
+    }
+    for (uint32_t now = start; now < end; now += STEP_US) {
+        for (size_t i = 0; i < SOURCES; ++i) {
+            source *src = &sources[i];
+            if (now < src->start || now >= src->end || (now - src->start) % src->period) {
+                continue;
+            }
+            uint8_t cls;
+            if (storm_limit_pass(limit, src->frame, src->len, now, &cls)) {
+                src->passed++;
+            } else {
+                src->dropped++;
+            }
+            CHECK_EQ(cls, src->cls);
+        }
+    }
+}
+
+static void test_classes(void) {
+    for (size_t i = 0; i < SOURCES; ++i) {
+        CHECK_EQ(storm_class(sources[i].frame, sources[i].len), sources[i].cls);
+    }
+    // Too short to have an EtherType
+    CHECK_EQ(storm_class(arp_request, 13), STORM_OTHER);
+}
+
+static void test_storm_limited(void) {
+    storm_limit limit;
+    storm_limit_init(&limit, RATE, BURST, 0);
+    replay(&limit, 0, 6 * SECOND);
+    for (size_t i = 0; i < SOURCES; ++i) {
+        printf("     %-10s %5u passed, %5u dropped\n", sources[i].name, sources[i].passed, sources[i].dropped);
+    }
+    const source *loop = &sources[0];
+    const source *ssdp = &sources[2];
+    // The burst and the rate over the 2 s of the loop, shared with the
+    // ARP of other clients
+    CHECK(loop->passed + sources[1].passed <= BURST + 2 * RATE + 6);
+    CHECK(loop->dropped > 19000);
+    CHECK(ssdp->passed <= BURST + RATE + 1);
+    CHECK(ssdp->dropped > 0);
+    // Other classes untouched by the storms
+    CHECK_EQ(sources[3].dropped, 0);
+    CHECK_EQ(sources[4].dropped, 0);
+}
+
+static void test_recovers_after_storm(void) {
+    storm_limit limit;
+    storm_limit_init(&limit, RATE, BURST, 0);
+    replay(&limit, 0, 3 * SECOND);
+    CHECK(sources[0].dropped > 0);
+    // Refilled by the time the next ARP comes
+    replay(&limit, 3 * SECOND, 6 * SECOND);
+    CHECK_EQ(sources[0].passed + sources[0].dropped, 0);
+    CHECK_EQ(sources[1].passed, 3);
+    CHECK_EQ(sources[1].dropped, 0);
+}
+
+static void test_set(void) {
+    storm_limit limit;
+    storm_limit_init(&limit, RATE, BURST, 0);
+    // Unlimited ARP
+    storm_limit_set(&limit, STORM_ARP, 0, 0, 0);
+    // A burst of 0 still lets one through
+    storm_limit_set(&limit, STORM_IPV4, 1, 0, 0);
+    // Unknown, ignored
+    storm_limit_set(&limit, STORM_CLASSES, 1, 1, 0);
+    replay(&limit, 0, 6 * SECOND);
+    CHECK_EQ(sources[0].dropped, 0);
+    CHECK_EQ(sources[0].passed, 20000);
+    // The flood ends just before the second token
+    CHECK_EQ(sources[2].passed, 1);
+    CHECK_EQ(sources[4].dropped, 0);
+}
+
+int main(void) {
+    RUN(test_classes);
+    RUN(test_storm_limited);
+    RUN(test_recovers_after_storm);
+    RUN(test_set);
+    return test_result();
+}
@@ -0,0 +1,83 @@
+/* Host tests of the token bucket rate limiter
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include "test.h"
+#include "token_bucket.h"
+
+// Microseconds
+#define SECOND 1000000
+
+static uint32_t take_all(token_bucket *bucket, uint32_t now) {
+    uint32_t passed = 0;
+    while (token_bucket_take(bucket, now)) {
+        passed++;
+    }
+    return passed;
+}
+
+static void test_unlimited(void) {
+    token_bucket bucket;
+    token_bucket_init(&bucket, 0, 0, 0);
+    for (int i = 0; i < 1000; ++i) {
+        CHECK(token_bucket_take(&bucket, 0));
+    }
+}
+
+static void test_starts_with_full_burst(void) {
+    token_bucket bucket;
+    token_bucket_init(&bucket, 10, 5, 0);
+    CHECK_EQ(take_all(&bucket, 0), 5);
+}
+
+static void test_refills_at_rate(void) {
+    token_bucket bucket;
+    token_bucket_init(&bucket, 10, 5, 0);
+    take_all(&bucket, 0);
+    CHECK(!token_bucket_take(&bucket, SECOND / 10 - 1));
+    CHECK(token_bucket_take(&bucket, SECOND / 10));
+    CHECK(!token_bucket_take(&bucket, SECOND / 10));
+    // Partial tokens add up over calls
+    CHECK(!token_bucket_take(&bucket, SECOND / 10 + SECOND / 20));
+    CHECK(token_bucket_take(&bucket, 2 * SECOND / 10));
+}
+
+static void test_sustained_rate(void) {
+    token_bucket bucket;
+    token_bucket_init(&bucket, 100, 1, 0);
+    uint32_t passed = 0;
+    // Polled every millisecond for ten seconds
+    for (uint32_t now = 0; now < 10 * SECOND; now += 1000) {
+        passed += token_bucket_take(&bucket, now);
+    }
+    CHECK_EQ(passed, 1000);
+}
+
+static void test_burst_caps_refill(void) {
+    token_bucket bucket;
+    token_bucket_init(&bucket, 10, 5, 0);
+    take_all(&bucket, 0);
+    CHECK_EQ(take_all(&bucket, 60 * SECOND), 5);
+}
+
+static void test_time_wraps_around(void) {
+    token_bucket bucket;
+    const uint32_t start = UINT32_MAX - SECOND / 20;
+    token_bucket_init(&bucket, 10, 5, start);
+    take_all(&bucket, start);
+    CHECK(!token_bucket_take(&bucket, start + SECOND / 10 - 1));
+    CHECK(token_bucket_take(&bucket, start + SECOND / 10));
+}
+
+int main(void) {
+    RUN(test_unlimited);
+    RUN(test_starts_with_full_burst);
+    RUN(test_refills_at_rate);
+    RUN(test_sustained_rate);
+    RUN(test_burst_caps_refill);
+    RUN(test_time_wraps_around);
+    return test_result();
+}
@@ -0,0 +1,880 @@
+/* Host tests of the UART NIC protocol parser
+
+
+  Copyright (C) 2022 Prusa Research a.s - www.prusa3d.com
+  SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+#include <string.h>
+
+#include "test.h"
+#include "uart_proto.h"
+
+static const uint8_t intron[INTRON_LEN] = {'U', 'N', '\x00', '\x01', '\x02', '\x03', '\x04', '\x05'};
+
+// What the callbacks got
+typedef struct {
+    uint8_t packet_buf[MAX_PACKET_SIZE];
+    uint32_t packets;
+    uint32_t packet_len;
+    uint32_t aborted;
+    uint32_t invalid;
+    uint32_t client_configs;
+    uint8_t ssid[SSID_MAX_LEN];
+    uint8_t ssid_len;
+    uint8_t pass[PASS_MAX_LEN];
+    uint8_t pass_len;
+    uint32_t get_links;
+    uint32_t get_stats;
+    uint32_t get_link_infos;
+    uint32_t introns;
+    uint8_t intron[INTRON_LEN];
+    uint32_t features_calls;
+    uint32_t features;
+    uint32_t credit_syncs;
+    uint32_t credit_sent;
+    uint32_t framing_calls;
+    uint8_t framing;
+    uint32_t baud_calls;
+    uint32_t baud;
+    uint32_t baud_probes;
+    uint32_t token;
+    uint32_t mcast_calls;
+    mcast_filter mcast;
+    uint32_t arp_calls;
+    arp_offload arp;
+    uint32_t storm_calls;
+    uint8_t storm_class;
+    uint16_t storm_rate;
+    uint16_t storm_burst;
+    uint32_t gateway_calls;
+    uint8_t gateway[4];
+    uint32_t scan_calls;
+    uint8_t scan_channel;
+    uint8_t scan_flags;
+    uint16_t dwell_min;
+    uint16_t dwell_max;
+    uint8_t scan_ssid[SSID_MAX_LEN];
+    uint8_t scan_ssid_len;
+    uint32_t unknown;
+} record;
+
+static record rec;
+
+static uint8_t *packet_begin(void *ctx, uint32_t len) {
+    return len <= sizeof(rec.packet_buf) ? rec.packet_buf : NULL;
+}
+
+static void packet_end(void *ctx, uint8_t *data, uint32_t len) {
+    rec.packets++;
+    rec.packet_len = len;
+}
+
+static void packet_abort(void *ctx, uint8_t *data) {
+    rec.aborted++;
+}
+
+static void packet_invalid(void *ctx, uint32_t len) {
+    rec.invalid++;
+}
+
+static void client_config(void *ctx, const uint8_t *ssid, uint8_t ssid_len, const uint8_t *pass, uint8_t pass_len) {
+    rec.client_configs++;
+    memcpy(rec.ssid, ssid, ssid_len);
+    rec.ssid_len = ssid_len;
+    memcpy(rec.pass, pass, pass_len);
+    rec.pass_len = pass_len;
+}
+
+static void get_link(void *ctx) {
+    rec.get_links++;
+}
+
+static void get_stats(void *ctx) {
+    rec.get_stats++;
+}
+
+static void get_link_info(void *ctx) {
+    rec.get_link_infos++;
+}
+
+static void new_intron(void *ctx, const uint8_t *new) {
+    rec.introns++;
+    memcpy(rec.intron, new, INTRON_LEN);
+}
+
+static void set_features(void *ctx, uint32_t features) {
+    rec.features_calls++;
+    rec.features = features;
+}
+
+static void credit_sync(void *ctx, uint32_t sent) {
+    rec.credit_syncs++;
+    rec.credit_sent = sent;
+}
+
+static void set_framing(void *ctx, uint8_t framing) {
+    rec.framing_calls++;
+    rec.framing = framing;
+}
+
+static void set_baud(void *ctx, uint32_t baud) {
+    rec.baud_calls++;
+    rec.baud = baud;
+}
+
+// Sees every MSG_BAUD_PROBE when set
+static void (*probe_hook)(uint32_t token);
+
+static void baud_probe(void *ctx, uint32_t token) {
+    rec.baud_probes++;
+    rec.token = token;
+    if (probe_hook) {
+        probe_hook(token);
+    }
+}
+
+static void set_mcast_filter(void *ctx, const mcast_filter *filter) {
+    rec.mcast_calls++;
+    rec.mcast = *filter;
+}
+
+static void set_arp_offload(void *ctx, const arp_offload *offload) {
+    rec.arp_calls++;
+    rec.arp = *offload;
+}
+
+static void set_storm_limit(void *ctx, uint8_t storm_class, uint16_t rate, uint16_t burst) {
+    rec.storm_calls++;
+    rec.storm_class = storm_class;
+    rec.storm_rate = rate;
+    rec.storm_burst = burst;
+}
+
+static void set_gateway(void *ctx, const uint8_t *ip) {
+    rec.gateway_calls++;
+    memcpy(rec.gateway, ip, sizeof(rec.gateway));
+}
+
+static void scan_start(void *ctx, uint8_t channel, uint8_t flags, uint16_t dwell_min, uint16_t dwell_max, const uint8_t *ssid, uint8_t ssid_len) {
+    rec.scan_calls++;
+    rec.scan_channel = channel;
+    rec.scan_flags = flags;
+    rec.dwell_min = dwell_min;
+    rec.dwell_max = dwell_max;
+    memcpy(rec.scan_ssid, ssid, ssid_len);
+    rec.scan_ssid_len = ssid_len;
+}
+
+static void unknown(void *ctx, uint8_t type) {
+    rec.unknown++;
+}
+
+static const uart_proto_callbacks callbacks = {
+    .packet_begin = packet_begin,
+    .packet_end = packet_end,
+    .packet_abort = packet_abort,
+    .packet_invalid = packet_invalid,
+    .client_config = client_config,
+    .get_link = get_link,
+    .get_stats = get_stats,
+    .get_link_info = get_link_info,
+    .intron = new_intron,
+    .set_features = set_features,
+    .credit_sync = credit_sync,
+    .set_framing = set_framing,
+    .set_baud = set_baud,
+    .baud_probe = baud_probe,
+    .set_mcast_filter = set_mcast_filter,
+    .set_arp_offload = set_arp_offload,
+    .set_storm_limit = set_storm_limit,
+    .set_gateway = set_gateway,
+    .scan_start = scan_start,
+    .unknown = unknown,
+};
+
+static uart_proto_parser parser;
+
+// Message being built, as the host sends it
+static uint8_t msg[4096];
+static size_t msg_len;
+static size_t msg_start;
+static bool msg_crc;
+
+static void start(void) {
+    memset(&rec, 0, sizeof(rec));
+    uart_proto_init(&parser, &callbacks, NULL, intron);
+    msg_len = 0;
+}
+
+static void put(const void *data, size_t len) {
+    memcpy(msg + msg_len, data, len);
+    msg_len += len;
+}
+
+static void put_u8(uint8_t value) {
+    put(&value, 1);
+}
+
+static void put_u16(uint16_t value) {
+    const uint8_t bytes[] = {value, value >> 8};
+    put(bytes, sizeof(bytes));
+}
+
+static void put_u32(uint32_t value) {
+    const uint8_t bytes[] = {value, value >> 8, value >> 16, value >> 24};
+    put(bytes, sizeof(bytes));
+}
+
+static void msg_begin(uint8_t type, bool crc) {
+    put(intron, INTRON_LEN);
+    msg_start = msg_len;
+    msg_crc = crc;
+    put_u8(crc ? type | MSG_CRC_FLAG : type);
+}
+
+static void msg_end(void) {
+    if (msg_crc) {
+        put_u32(uart_proto_crc32(0, msg + msg_start, msg_len - msg_start));
+    }
+}
+
+// Feed what was built, in one go or byte by byte
+static void feed(bool bytewise) {
+    if (bytewise) {
+        for (size_t i = 0; i < msg_len; ++i) {
+            uart_proto_feed(&parser, msg + i, 1);
+        }
+    } else {
+        uart_proto_feed(&parser, msg, msg_len);
+    }
+    msg_len = 0;
+}
+
+static void test_crc32_matches_zlib(void) {
+    CHECK_EQ(uart_proto_crc32(0, (const uint8_t *)"123456789", 9), 0xCBF43926);
+    const uint32_t part = uart_proto_crc32(0, (const uint8_t *)"1234", 4);
+    CHECK_EQ(uart_proto_crc32(part, (const uint8_t *)"56789", 5), 0xCBF43926);
+}
+
+static void check_fixed_messages(bool crc, bool bytewise) {
+    start();
+    msg_begin(MSG_SET_FEATURES, crc);
+    put_u32(0xf);
+    msg_end();
+    msg_begin(MSG_SET_BAUD, crc);
+    put_u32(4600000);
+    msg_end();
+    msg_begin(MSG_BAUD_PROBE, crc);
+    put_u32(0x12345678);
+    msg_end();
+    msg_begin(MSG_SET_GATEWAY, crc);
+    put("\xc0\xa8\x01\x01", 4);
+    msg_end();
+    msg_begin(MSG_SET_STORM_LIMIT, crc);
+    put_u8(STORM_IPV4);
+    put_u16(300);
+    put_u16(50);
+    msg_end();
+    msg_begin(MSG_CREDIT, crc);
+    put_u32(0xfffffff0);
+    msg_end();
+    feed(bytewise);
+
+    CHECK_EQ(rec.features_calls, 1);
+    CHECK_EQ(rec.features, 0xf);
+    CHECK_EQ(rec.baud_calls, 1);
+    CHECK_EQ(rec.baud, 4600000);
+    CHECK_EQ(rec.baud_probes, 1);
+    CHECK_EQ(rec.token, 0x12345678);
+    CHECK_EQ(rec.gateway_calls, 1);
+    CHECK(memcmp(rec.gateway, "\xc0\xa8\x01\x01", 4) == 0);
+    CHECK_EQ(rec.storm_calls, 1);
+    CHECK_EQ(rec.storm_class, STORM_IPV4);
+    CHECK_EQ(rec.storm_rate, 300);
+    CHECK_EQ(rec.storm_burst, 50);
+    CHECK_EQ(rec.credit_syncs, 1);
+    CHECK_EQ(rec.credit_sent, 0xfffffff0);
+    CHECK_EQ(parser.crc_errors, 0);
+    CHECK_EQ(parser.messages, 6);
+}
+
+static void test_fixed_messages(void) {
+    check_fixed_messages(false, false);
+    check_fixed_messages(false, true);
+}
+
+static void test_fixed_messages_with_crc(void) {
+    check_fixed_messages(true, false);
+    check_fixed_messages(true, true);
+}
+
+static void test_intron_change_with_crc(void) {
+    static const uint8_t next[INTRON_LEN] = {'X', 'Y', 'Z', 1, 2, 3, 4, 5};
+    start();
+    msg_begin(MSG_INTRON, true);
+    put(next, INTRON_LEN);
+    msg_end();
+    feed(false);
+    CHECK_EQ(rec.introns, 1);
+    CHECK(memcmp(rec.intron, next, INTRON_LEN) == 0);
+
+    // The old one doesn't start messages any more
+    msg_begin(MSG_GET_LINK, false);
+    msg_end();
+    feed(false);
+    CHECK_EQ(rec.get_links, 0);
+    put(next, INTRON_LEN);
+    put_u8(MSG_GET_LINK);
+    feed(false);
+    CHECK_EQ(rec.get_links, 1);
+}
+
+static void test_crc_mismatch_drops_message(void) {
+    start();
+    msg_begin(MSG_SET_BAUD, true);
+    put_u32(115200);
+    msg_end();
+    msg[msg_len - 1] ^= 0x01;
+    msg_begin(MSG_GET_STATS, true);
+    msg_end();
+    feed(false);
+    CHECK_EQ(rec.baud_calls, 0);
+    CHECK_EQ(parser.crc_errors, 1);
+    // The next message is not affected
+    CHECK_EQ(rec.get_stats, 1);
+}
+
+static void check_list_messages(bool crc) {
+    start();
+    msg_begin(MSG_SET_MCAST_FILTER, crc);
+    put_u8(MCAST_ACCEPT_ALL);
+    put("\x01\x02\x03\x04\x05\x06\x07\x08", MCAST_HASH_LEN);
+    put_u8(2);
+    put("\x01\x00\x5e\x00\x00\xfb", 6);
+    put("\x33\x33\x00\x00\x00\x01", 6);
+    msg_end();
+    msg_begin(MSG_SET_ARP_OFFLOAD, crc);
+    put_u8(1);
+    put("\x0a\x00\x00\x02", 4);
+    msg_end();
+    feed(true);
+
+    CHECK_EQ(rec.mcast_calls, 1);
+    CHECK_EQ(rec.mcast.flags, MCAST_ACCEPT_ALL);
+    CHECK(memcmp(rec.mcast.hash, "\x01\x02\x03\x04\x05\x06\x07\x08", MCAST_HASH_LEN) == 0);
+    CHECK_EQ(rec.mcast.count, 2);
+    CHECK(memcmp(rec.mcast.addrs[1], "\x33\x33\x00\x00\x00\x01", 6) == 0);
+    CHECK_EQ(rec.arp_calls, 1);
+    CHECK_EQ(rec.arp.count, 1);
+    CHECK(memcmp(rec.arp.addrs[0], "\x0a\x00\x00\x02", 4) == 0);
+    CHECK_EQ(parser.crc_errors, 0);
+}
+
+static void test_list_messages(void) {
+    check_list_messages(false);
+    check_list_messages(true);
+}
+
+static void test_list_over_limit_is_truncated(void) {
+    start();
+    msg_begin(MSG_SET_ARP_OFFLOAD, true);
+    put_u8(ARP_OFFLOAD_MAX + 2);
+    for (uint8_t i = 0; i < ARP_OFFLOAD_MAX + 2; ++i) {
+        const uint8_t addr[4] = {10, 0, 0, i};
+        put(addr, sizeof(addr));
+    }
+    msg_end();
+    msg_begin(MSG_GET_LINK, false);
+    msg_end();
+    feed(false);
+    CHECK_EQ(rec.arp_calls, 1);
+    CHECK_EQ(rec.arp.count, ARP_OFFLOAD_MAX);
+    CHECK_EQ(rec.arp.addrs[ARP_OFFLOAD_MAX - 1][3], ARP_OFFLOAD_MAX - 1);
+    CHECK_EQ(parser.crc_errors, 0);
+    CHECK_EQ(rec.get_links, 1);
+}
+
+static void check_get_link_info(bool crc, bool bytewise) {
+    start();
+    msg_begin(MSG_GET_LINK_INFO, crc);
+    msg_end();
+    // No body, the next message follows right away
+    msg_begin(MSG_GET_LINK, crc);
+    msg_end();
+    msg_begin(MSG_GET_LINK_INFO, crc);
+    msg_end();
+    feed(bytewise);
+    CHECK_EQ(rec.get_link_infos, 2);
+    CHECK_EQ(rec.get_links, 1);
+    CHECK_EQ(rec.unknown, 0);
+    CHECK_EQ(parser.crc_errors, 0);
+}
+
+static void test_get_link_info(void) {
+    check_get_link_info(false, false);
+    check_get_link_info(false, true);
+    check_get_link_info(true, false);
+    check_get_link_info(true, true);
+}
+
+static void check_scan_start(bool crc, bool bytewise) {
+    start();
+    msg_begin(MSG_SCAN_START, crc);
+    put_u8(6);
+    put_u8(SCAN_PASSIVE | SCAN_SHOW_HIDDEN);
+    put_u16(100);
+    put_u16(300);
+    put_u8(4);
+    put("Home", 4);
+    msg_end();
+    feed(bytewise);
+    CHECK_EQ(rec.scan_calls, 1);
+    CHECK_EQ(rec.scan_channel, 6);
+    CHECK_EQ(rec.scan_flags, SCAN_PASSIVE | SCAN_SHOW_HIDDEN);
+    CHECK_EQ(rec.dwell_min, 100);
+    CHECK_EQ(rec.dwell_max, 300);
+    CHECK_EQ(rec.scan_ssid_len, 4);
+    CHECK(memcmp(rec.scan_ssid, "Home", 4) == 0);
+
+    // Any AP on all channels
+    msg_begin(MSG_SCAN_START, crc);
+    put_u8(0);
+    put_u8(0);
+    put_u16(0);
+    put_u16(0);
+    put_u8(0);
+    msg_end();
+    feed(bytewise);
+    CHECK_EQ(rec.scan_calls, 2);
+    CHECK_EQ(rec.scan_channel, 0);
+    CHECK_EQ(rec.scan_ssid_len, 0);
+    CHECK_EQ(parser.crc_errors, 0);
+}
+
+static void test_scan_start(void) {
+    check_scan_start(false, false);
+    check_scan_start(false, true);
+    check_scan_start(true, false);
+    check_scan_start(true, true);
+}
+
+static void test_scan_ssid_over_limit_is_truncated(void) {
+    start();
+    msg_begin(MSG_SCAN_START, true);
+    put_u8(1);
+    put_u8(0);
+    put_u16(0);
+    put_u16(0);
+    put_u8(SSID_MAX_LEN + 3);
+    for (uint8_t i = 0; i < SSID_MAX_LEN + 3; ++i) {
+        put_u8('a' + i % 26);
+    }
+    msg_end();
+    msg_begin(MSG_GET_LINK, false);
+    msg_end();
+    feed(false);
+    CHECK_EQ(rec.scan_calls, 1);
+    CHECK_EQ(rec.scan_ssid_len, SSID_MAX_LEN);
+    CHECK_EQ(rec.scan_ssid[SSID_MAX_LEN - 1], 'a' + (SSID_MAX_LEN - 1) % 26);
+    CHECK_EQ(parser.crc_errors, 0);
+    CHECK_EQ(rec.get_links, 1);
+}
+
+static void check_packet(bool crc, bool bytewise) {
+    start();
+    msg_begin(MSG_PACKET, crc);
+    put_u32(100);
+    for (int i = 0; i < 100; ++i) {
+        put_u8(i);
+    }
+    msg_end();
+    feed(bytewise);
+    CHECK_EQ(rec.packets, 1);
+    CHECK_EQ(rec.packet_len, 100);
+    CHECK_EQ(rec.packet_buf[99], 99);
+    CHECK_EQ(rec.aborted, 0);
+}
+
+static void test_packets(void) {
+    check_packet(false, false);
+    check_packet(false, true);
+    check_packet(true, false);
+    check_packet(true, true);
+}
+
+static void test_corrupted_packet_is_aborted(void) {
+    start();
+    msg_begin(MSG_PACKET, true);
+    put_u32(60);
+    for (int i = 0; i < 60; ++i) {
+        put_u8(i);
+    }
+    msg_end();
+    msg[msg_len - 10] ^= 0xff;
+    feed(false);
+    CHECK_EQ(rec.packets, 0);
+    CHECK_EQ(rec.aborted, 1);
+    CHECK_EQ(parser.crc_errors, 1);
+}
+
+static void test_direct_buffer_with_crc(void) {
+    start();
+    msg_begin(MSG_PACKET, true);
+    put_u32(64);
+    const size_t header = msg_len;
+    for (int i = 0; i < 64; ++i) {
+        put_u8(0x40 + i);
+    }
+    msg_end();
+    uart_proto_feed(&parser, msg, header);
+
+    size_t len;
+    uint8_t *dst = uart_proto_direct_buffer(&parser, &len);
+    CHECK(dst != NULL);
+    CHECK_EQ(len, 64);
+    if (dst) {
+        memcpy(dst, msg + header, 64);
+        uart_proto_direct_advance(&parser, 64);
+    }
+    uart_proto_feed(&parser, msg + header + 64, msg_len - header - 64);
+    CHECK_EQ(rec.packets, 1);
+    CHECK_EQ(rec.packet_buf[63], 0x40 + 63);
+    CHECK_EQ(parser.crc_errors, 0);
+}
+
+static void test_client_config_with_crc(void) {
+    start();
+    msg_begin(MSG_CLIENTCONFIG, true);
+    put_u8(7);
+    put("esptest", 7);
+    put_u8(4);
+    put("pass", 4);
+    msg_end();
+    feed(true);
+    CHECK_EQ(rec.client_configs, 1);
+    CHECK_EQ(rec.ssid_len, 7);
+    CHECK(memcmp(rec.ssid, "esptest", 7) == 0);
+    CHECK_EQ(rec.pass_len, 4);
+    CHECK(memcmp(rec.pass, "pass", 4) == 0);
+}
+
+static void test_resync_after_garbage(void) {
+    start();
+    put("garbage UN", 10);
+    msg_begin(MSG_GET_LINK, false);
+    msg_end();
+    feed(false);
+    CHECK_EQ(rec.get_links, 1);
+    CHECK_EQ(parser.resyncs, 1);
+}
+
+// An intron split across reads, after garbage looking like its start
+static void test_resync_in_chunks(void) {
+    for (size_t chunk = 1; chunk <= INTRON_LEN + 2; ++chunk) {
+        start();
+        put("UNU", 3);
+        put(intron, INTRON_LEN - 1);
+        msg_begin(MSG_SET_BAUD, false);
+        put_u32(115200);
+        msg_end();
+        msg_begin(MSG_GET_LINK, false);
+        msg_end();
+        for (size_t i = 0; i < msg_len; i += chunk) {
+            uart_proto_feed(&parser, msg + i, msg_len - i < chunk ? msg_len - i : chunk);
+        }
+        msg_len = 0;
+        CHECK_EQ(rec.baud_calls, 1);
+        CHECK_EQ(rec.baud, 115200);
+        CHECK_EQ(rec.get_links, 1);
+        CHECK_EQ(parser.resyncs, 1);
+    }
+}
+
+static void emit(void *ctx, const uint8_t *data, size_t len) {
+    put(data, len);
+}
+
+// Replace the message built since msg_start by its COBS frame
+static void cobs_frame(void) {
+    uint8_t plain[sizeof(msg)];
+    const size_t len = msg_len - msg_start;
+    memcpy(plain, msg + msg_start, len);
+    msg_len = msg_start - INTRON_LEN;
+    cobs_encoder enc;
+    cobs_encode_begin(&enc);
+    cobs_encode(&enc, plain, len, emit, NULL);
+    cobs_encode_end(&enc, emit, NULL);
+}
+
+// The start of a session of tap.py
+static void test_switch_to_cobs_with_crc(void) {
+    start();
+    msg_begin(MSG_SET_FEATURES, true);
+    put_u32(0xf);
+    msg_end();
+    msg_begin(MSG_SET_FRAMING, true);
+    put_u8(FRAMING_COBS);
+    msg_end();
+    feed(false);
+    CHECK_EQ(rec.framing_calls, 1);
+    CHECK_EQ(rec.framing, FRAMING_COBS);
+    CHECK_EQ(parser.framing, FRAMING_COBS);
+
+    put_u8(0);
+    msg_begin(MSG_GET_LINK, true);
+    msg_end();
+    cobs_frame();
+    msg_begin(MSG_PACKET, true);
+    put_u32(300);
+    for (int i = 0; i < 300; ++i) {
+        // Zeros every few bytes, see test_cobs_long_runs for long blocks
+        put_u8(i % 7 ? 0xaa : 0);
+    }
+    msg_end();
+    cobs_frame();
+    feed(true);
+    CHECK_EQ(rec.get_links, 1);
+    CHECK_EQ(rec.packets, 1);
+    CHECK_EQ(rec.packet_len, 300);
+    CHECK_EQ(rec.packet_buf[7], 0);
+    CHECK_EQ(rec.packet_buf[8], 0xaa);
+    CHECK_EQ(parser.crc_errors, 0);
+    CHECK_EQ(parser.frame_errors, 0);
+}
+
+static size_t encode(const uint8_t *data, size_t len) {
+    msg_len = 0;
+    cobs_encoder enc;
+    cobs_encode_begin(&enc);
+    cobs_encode(&enc, data, len, emit, NULL);
+    cobs_encode_end(&enc, emit, NULL);
+    return msg_len;
+}
+
+static void test_cobs_encoder(void) {
+    CHECK_EQ(encode((const uint8_t *)"", 0), 2);
+    CHECK(memcmp(msg, "\x01\x00", 2) == 0);
+    CHECK_EQ(encode((const uint8_t *)"\x00", 1), 3);
+    CHECK(memcmp(msg, "\x01\x01\x00", 3) == 0);
+    CHECK_EQ(encode((const uint8_t *)"\x00\x00", 2), 4);
+    CHECK(memcmp(msg, "\x01\x01\x01\x00", 4) == 0);
+    CHECK_EQ(encode((const uint8_t *)"\x11\x22\x00\x33", 4), 6);
+    CHECK(memcmp(msg, "\x03\x11\x22\x02\x33\x00", 6) == 0);
+
+    uint8_t data[300];
+    for (size_t i = 0; i < sizeof(data); ++i) {
+        data[i] = i % 255 + 1;
+    }
+    // A full block has no implicit zero after it
+    const size_t len = encode(data, 254);
+    CHECK(len >= 256);
+    CHECK_EQ(msg[0], 0xff);
+    CHECK(memcmp(msg + 1, data, 254) == 0);
+    for (size_t i = 0; i < len - 1; ++i) {
+        CHECK(msg[i] != 0);
+    }
+    CHECK_EQ(msg[len - 1], 0);
+    msg_len = 0;
+}
+
+// Blocks of 254 bytes and longer runs without zeros
+static void test_cobs_long_runs(void) {
+    start();
+    msg_begin(MSG_SET_FRAMING, false);
+    put_u8(FRAMING_COBS);
+    msg_end();
+    put_u8(0);
+    for (uint32_t len = 250; len <= 600; len += 50) {
+        msg_begin(MSG_PACKET, true);
+        put_u32(len);
+        for (uint32_t i = 0; i < len; ++i) {
+            put_u8(i % 255 + 1);
+        }
+        msg_end();
+        cobs_frame();
+    }
+    // The type, the length and 249 bytes make a full block
+    msg_begin(MSG_PACKET, false);
+    put_u32(249);
+    for (uint32_t i = 0; i < 249; ++i) {
+        put_u8(0x55);
+    }
+    msg_end();
+    cobs_frame();
+    feed(false);
+    CHECK_EQ(rec.packets, 9);
+    CHECK_EQ(rec.packet_len, 249);
+    CHECK_EQ(rec.packet_buf[248], 0x55);
+    CHECK_EQ(rec.aborted, 0);
+    CHECK_EQ(parser.crc_errors, 0);
+    CHECK_EQ(parser.frame_errors, 0);
+}
+
+#define FAULT_FRAMES 20000
+// One fault in this many bytes, of each kind
+#define FAULT_RATE 1000
+
+static uint8_t fault_stream[FAULT_FRAMES * 16];
+static uint32_t frame_start[FAULT_FRAMES + 1];
+// A fault hit the frame or the delimiter before it
+static bool frame_hit[FAULT_FRAMES];
+static uint32_t delivered_at[FAULT_FRAMES];
+static bool delivered[FAULT_FRAMES];
+static uint32_t wrong_tokens;
+// Position in the stream without faults of the byte being fed
+static uint32_t feeding;
+
+static void record_probe(uint32_t token) {
+    if (token >= FAULT_FRAMES || delivered[token]) {
+        wrong_tokens++;
+        return;
+    }
+    delivered[token] = true;
+    delivered_at[token] = feeding;
+}
+
+/**
+ * Random bit flips and dropped bytes in a stream of COBS frames. Every frame
+ * left intact, delimiter before it included, must be delivered: the parser
+ * is back in sync at the first delimiter after a fault. Reports how many
+ * bytes after a fault the first message delivered again starts.
+ */
+static void test_cobs_fault_recovery(void) {
+    start();
+    msg_begin(MSG_SET_FRAMING, false);
+    put_u8(FRAMING_COBS);
+    msg_end();
+    feed(false);
+
+    // Starts with the delimiter before the first frame
+    uint32_t len = 0;
+    fault_stream[len++] = 0;
+    for (uint32_t i = 0; i < FAULT_FRAMES; ++i) {
+        frame_start[i] = len;
+        msg_begin(MSG_BAUD_PROBE, true);
+        put_u32(i);
+        msg_end();
+        cobs_frame();
+        memcpy(fault_stream + len, msg, msg_len);
+        len += msg_len;
+        msg_len = 0;
+    }
+    frame_start[FAULT_FRAMES] = len;
+
+    memset(frame_hit, 0, sizeof(frame_hit));
+    memset(delivered, 0, sizeof(delivered));
+    wrong_tokens = 0;
+    probe_hook = record_probe;
+    uint32_t rng = 2463534242;
+    static uint32_t faults[FAULT_FRAMES];
+    uint32_t fault_count = 0;
+    uint32_t frame = 0;
+    feeding = 0;
+    // The first delimiter is left intact, the frames start after it
+    uart_proto_feed(&parser, fault_stream, 1);
+    for (feeding = 1; feeding < len; ++feeding) {
+        while (feeding >= frame_start[frame + 1]) {
+            frame++;
+        }
+        uint8_t c = fault_stream[feeding];
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        const uint32_t dice = rng % FAULT_RATE;
+        if (dice < 2 && fault_count < FAULT_FRAMES) {
+            frame_hit[frame] = true;
+            // The delimiter ends this frame and starts the next one
+            if (c == 0 && frame + 1 < FAULT_FRAMES) {
+                frame_hit[frame + 1] = true;
+            }
+            faults[fault_count++] = feeding;
+            if (dice == 0) {
+                continue;
+            }
+            c ^= 1 << (rng >> 16) % 8;
+        }
+        uart_proto_feed(&parser, &c, 1);
+    }
+    probe_hook = NULL;
+
+    uint32_t lost = 0;
+    for (uint32_t i = 0; i < FAULT_FRAMES; ++i) {
+        if (!frame_hit[i]) {
+            CHECK(delivered[i]);
+        }
+        lost += !delivered[i];
+    }
+    CHECK_EQ(wrong_tokens, 0);
+    CHECK(fault_count > 100);
+
+    // From each fault to the start of the first frame it didn't hit, which
+    // was delivered
+    uint64_t latency_sum = 0;
+    uint32_t latency_max = 0;
+    uint32_t next = 0;
+    for (uint32_t f = 0; f < fault_count; ++f) {
+        while (next < FAULT_FRAMES && (frame_start[next] <= faults[f] || frame_hit[next])) {
+            next++;
+        }
+        if (next == FAULT_FRAMES) {
+            break;
+        }
+        CHECK(delivered[next]);
+        const uint32_t latency = frame_start[next] - faults[f];
+        latency_sum += latency;
+        if (latency > latency_max) {
+            latency_max = latency;
+        }
+    }
+    printf("     %u faults in %u bytes, %u of %u messages lost, recovery %u bytes on average, %u at most\n",
+        fault_count, len, lost, FAULT_FRAMES, (uint32_t)(latency_sum / fault_count), latency_max);
+    CHECK(parser.crc_errors + parser.frame_errors > 0);
+}
+
+static void test_cobs_truncated_frame(void) {
+    start();
+    msg_begin(MSG_SET_FRAMING, false);
+    put_u8(FRAMING_COBS);
+    msg_end();
+    put_u8(0);
+    msg_begin(MSG_SET_BAUD, true);
+    put_u32(115200);
+    msg_end();
+    cobs_frame();
+    // Lose the end of the frame but the delimiter
+    msg[msg_len - 4] = 0;
+    msg_len -= 3;
+    msg_begin(MSG_GET_STATS, false);
+    msg_end();
+    cobs_frame();
+    feed(false);
+    CHECK_EQ(rec.baud_calls, 0);
+    CHECK_EQ(parser.frame_errors, 1);
+    CHECK_EQ(rec.get_stats, 1);
+}
+
+int main(void) {
+    RUN(test_crc32_matches_zlib);
+    RUN(test_fixed_messages);
+    RUN(test_fixed_messages_with_crc);
+    RUN(test_intron_change_with_crc);
+    RUN(test_crc_mismatch_drops_message);
+    RUN(test_list_messages);
+    RUN(test_list_over_limit_is_truncated);
+    RUN(test_get_link_info);
+    RUN(test_scan_start);
+    RUN(test_scan_ssid_over_limit_is_truncated);
+    RUN(test_packets);
+    RUN(test_corrupted_packet_is_aborted);
+    RUN(test_direct_buffer_with_crc);
+    RUN(test_client_config_with_crc);
+    RUN(test_resync_after_garbage);
+    RUN(test_resync_in_chunks);
+    RUN(test_switch_to_cobs_with_crc);
+    RUN(test_cobs_encoder);
+    RUN(test_cobs_long_runs);
+    RUN(test_cobs_truncated_frame);
+    RUN(test_cobs_fault_recovery);
+    return test_result();
+}